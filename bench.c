@@ -0,0 +1,508 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright      2018 Johan Westlund
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Runs bsdiff and bspatch on generated old and new files and prints
+ * one CSV line per file, window and RAM budget. The files are made
+ * from a fixed seed, so every run diffs the same bytes. */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bspatch.h"
+
+struct corpus
+{
+	const char *name;
+	uint8_t *old, *new;
+	size_t oldsize, newsize;
+};
+
+static uint64_t rnd(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static void *xmalloc(size_t n)
+{
+	void *p;
+
+	if ((p = malloc(n)) == NULL)
+		err(1, NULL);
+	return p;
+}
+
+/* Thumb code as a list of items, a plain 16-bit instruction, a BL to
+ * another item or a literal word holding an item's address. The old
+ * and new file are the same list assembled with a few runs of code
+ * inserted, so the branches and addresses across an insertion change
+ * like they do when firmware is rebuilt. */
+#define ITEM_INSN 0
+#define ITEM_BL 1
+#define ITEM_LIT 2
+#define BASE 0x08000000u
+
+struct item
+{
+	int type;
+	uint32_t v; /* instruction, or index of the target item */
+};
+
+static size_t assemble(const struct item *it, size_t n, uint8_t *out)
+{
+	uint32_t *addr, a, off, s, j1, j2;
+	size_t i, len;
+
+	addr = xmalloc((n + 1) * sizeof(*addr));
+	for (a = 0, i = 0; i < n; i++)
+	{
+		addr[i] = a;
+		a += (it[i].type == ITEM_INSN) ? 2 : 4;
+	};
+
+	for (len = 0, i = 0; i < n; i++)
+		switch (it[i].type)
+		{
+		case ITEM_INSN:
+			out[len++] = it[i].v;
+			out[len++] = it[i].v >> 8;
+			break;
+		case ITEM_BL:
+			off = addr[it[i].v] - (addr[i] + 4);
+			s = (off >> 24) & 1;
+			j1 = !(((off >> 23) & 1) ^ s);
+			j2 = !(((off >> 22) & 1) ^ s);
+			a = 0xf000 | (s << 10) | ((off >> 12) & 0x3ff);
+			out[len++] = a;
+			out[len++] = a >> 8;
+			a = 0xd000 | (j1 << 13) | (j2 << 11) | ((off >> 1) & 0x7ff);
+			out[len++] = a;
+			out[len++] = a >> 8;
+			break;
+		default:
+			a = BASE + addr[it[i].v] + 1;
+			out[len++] = a;
+			out[len++] = a >> 8;
+			out[len++] = a >> 16;
+			out[len++] = a >> 24;
+		};
+
+	free(addr);
+	return len;
+}
+
+static void random_item(struct item *it, size_t targets, uint64_t *seed)
+{
+	static const uint16_t ops[] = {0x4600, 0x6800, 0x6000, 0x3000, 0x2000, 0xb500, 0xbd00, 0x4280,
+								   0xd000, 0xe000, 0x1c00, 0x1800, 0x7800, 0x7000, 0x4770, 0xbf00};
+	uint64_t r = rnd(seed);
+
+	if (r % 12 == 0)
+	{
+		it->type = ITEM_BL;
+		it->v = (r >> 8) % targets;
+	}
+	else if (r % 48 == 1)
+	{
+		it->type = ITEM_LIT;
+		it->v = (r >> 8) % targets;
+	}
+	else
+	{
+		it->type = ITEM_INSN;
+		it->v = ops[(r >> 8) % 16] | ((r >> 16) & 0x3f);
+	};
+}
+
+static void gen_thumb(struct corpus *c, size_t size, uint64_t seed)
+{
+	struct item *old, *new;
+	size_t n, m, i, k, at, len, *moved;
+
+	n = size * 10 / 25;
+	old = xmalloc(n * sizeof(*old));
+	new = xmalloc((n + 8 * 64) * sizeof(*new));
+	moved = xmalloc(n * sizeof(*moved));
+	for (i = 0; i < n; i++)
+		random_item(&old[i], n, &seed);
+
+	/* Insert a few runs of code and patch a few instructions */
+	for (m = 0, i = 0, k = 0; k < 8; k++)
+	{
+		at = n * (k + 1) / 9 + rnd(&seed) % 1000;
+		for (; i < at; i++)
+		{
+			moved[i] = m;
+			new[m++] = old[i];
+		};
+		for (len = 8 + rnd(&seed) % 56; len > 0; len--)
+			random_item(&new[m++], n, &seed);
+	};
+	for (; i < n; i++)
+	{
+		moved[i] = m;
+		new[m++] = old[i];
+	};
+	for (k = 0; k < 64; k++)
+		if (new[i = rnd(&seed) % m].type == ITEM_INSN)
+			new[i].v ^= 0x0100;
+	/* Targets are items of old, follow them to where they are in new */
+	for (i = 0; i < m; i++)
+		if (new[i].type != ITEM_INSN)
+			new[i].v = moved[new[i].v];
+
+	c->old = xmalloc(4 * n);
+	c->new = xmalloc(4 * m);
+	c->oldsize = assemble(old, n, c->old);
+	c->newsize = assemble(new, m, c->new);
+
+	free(old);
+	free(new);
+	free(moved);
+}
+
+/* An image of flash erased to 0xFF with code at the start and a block
+ * of data half way */
+static void gen_image(struct corpus *c, size_t size, uint64_t seed)
+{
+	struct corpus code;
+	size_t i;
+
+	gen_thumb(&code, size / 8, seed);
+
+	c->oldsize = c->newsize = size;
+	c->old = xmalloc(size);
+	c->new = xmalloc(size);
+	memset(c->old, 0xff, size);
+	memset(c->new, 0xff, size);
+	memcpy(c->old, code.old, code.oldsize);
+	memcpy(c->new, code.new, code.newsize);
+	for (i = 0; i < size / 16; i++)
+		c->old[size / 2 + i] = c->new[size / 2 + i] = rnd(&seed) % 16;
+	for (i = 0; i < 32; i++)
+		c->new[size / 2 + rnd(&seed) % (size / 16)] ^= 0x20;
+
+	free(code.old);
+	free(code.new);
+}
+
+/* Configuration text, with some values changed and some lines added
+ * and removed */
+static void gen_text(struct corpus *c, size_t size, uint64_t seed)
+{
+	static const char *words[] = {"net", "wifi", "uart", "spi", "led", "timeout", "retry",
+								  "baud", "mode", "level", "gain", "offset", "name", "enable"};
+	char line[128], changed[128];
+	uint64_t r;
+	int n;
+
+	c->old = xmalloc(size + 128);
+	c->new = xmalloc(2 * size + 256);
+	c->oldsize = c->newsize = 0;
+	while (c->oldsize < size)
+	{
+		r = rnd(&seed);
+		n = snprintf(line, sizeof(line), "%s.%s%d = %d\n", words[r % 14], words[(r >> 8) % 14],
+					 (int)((r >> 16) % 100), (int)((r >> 24) % 100000));
+		memcpy(c->old + c->oldsize, line, n);
+		c->oldsize += n;
+
+		r = rnd(&seed);
+		if (r % 200 == 0)
+			continue;
+		if (r % 50 == 1)
+		{
+			n = snprintf(changed, sizeof(changed), "%.*s%d\n", (int)(strchr(line, '=') - line + 2), line,
+						 (int)((r >> 8) % 100000));
+			memcpy(line, changed, n);
+		};
+		memcpy(c->new + c->newsize, line, n);
+		c->newsize += n;
+		if (r % 200 == 2)
+		{
+			n = snprintf(line, sizeof(line), "%s.new = %d\n", words[(r >> 8) % 14], (int)((r >> 16) % 1000));
+			memcpy(c->new + c->newsize, line, n);
+			c->newsize += n;
+		};
+	};
+}
+
+static void save(const char *path, const uint8_t *buf, size_t len)
+{
+	FILE *f;
+
+	if (((f = fopen(path, "wb")) == NULL) ||
+		(fwrite(buf, 1, len, f) != len) ||
+		(fclose(f) != 0))
+		err(1, "%s", path);
+}
+
+static int same(const char *path1, const char *path2)
+{
+	static uint8_t buf1[65536], buf2[65536];
+	FILE *f1, *f2;
+	size_t n1, n2;
+	int ok;
+
+	f1 = fopen(path1, "rb");
+	f2 = fopen(path2, "rb");
+	ok = (f1 != NULL) && (f2 != NULL);
+	while (ok)
+	{
+		n1 = fread(buf1, 1, sizeof(buf1), f1);
+		n2 = fread(buf2, 1, sizeof(buf2), f2);
+		ok = (n1 == n2) && (memcmp(buf1, buf2, n1) == 0);
+		if (n1 == 0)
+			break;
+	};
+	if (f1 != NULL)
+		fclose(f1);
+	if (f2 != NULL)
+		fclose(f2);
+	return ok;
+}
+
+/* The peak RSS of a child includes what it was forked from, the files
+ * are made in a child of their own to keep this process small */
+static void generate(void (*gen)(struct corpus *, size_t, uint64_t), size_t size, uint64_t seed,
+					 const char *old, const char *new)
+{
+	struct corpus c;
+	pid_t pid;
+	int status;
+
+	if ((pid = fork()) < 0)
+		err(1, "fork");
+	if (pid == 0)
+	{
+		gen(&c, size, seed);
+		save(old, c.old, c.oldsize);
+		save(new, c.new, c.newsize);
+		_exit(0);
+	};
+	if ((waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+		errx(1, "%s: not generated\n", old);
+}
+
+static ssize_t read_patch(void *opaque, off_t pos, void *buf, size_t len)
+{
+	return pread(*(int *)opaque, buf, len, pos);
+}
+
+/* The least RAM bspatch takes for the patch at path, as its header
+ * tells the library */
+static long minram(const char *path)
+{
+	struct bspatch_header h;
+	struct stat st;
+	int fd;
+	struct bspatch_stream s = {&fd, read_patch, NULL, NULL};
+
+	if (((fd = open(path, O_RDONLY)) < 0) || (fstat(fd, &st) != 0))
+		err(1, "%s", path);
+	if (bspatch_header(&h, &s, st.st_size) != BSPATCH_OK)
+		errx(1, "%s: corrupt patch\n", path);
+	close(fd);
+
+	return bspatch_worksize(&h, 0, 0);
+}
+
+/* Runs argv, returns the wall time and the peak RSS in KiB */
+static double run(char *const argv[], long *rss)
+{
+	struct timespec t0, t1;
+	struct rusage ru;
+	pid_t pid;
+	int status;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if ((pid = fork()) < 0)
+		err(1, "fork");
+	if (pid == 0)
+	{
+		execv(argv[0], argv);
+		err(127, "%s", argv[0]);
+	};
+	if (wait4(pid, &status, 0, &ru) != pid)
+		err(1, "wait4");
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+		errx(1, "%s failed\n", argv[0]);
+
+	*rss = ru.ru_maxrss;
+	return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+/* Reads the sort, scan and compression wall times from bsdiff --stats */
+static void phases(const char *path, double t[3])
+{
+	static char buf[65536];
+	const char *p;
+	FILE *f;
+	size_t n;
+	double x;
+
+	if ((f = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	buf[n] = '\0';
+	fclose(f);
+
+	t[0] = t[1] = t[2] = 0;
+	if ((p = strstr(buf, "\"sort\": {\"wall\": ")) != NULL)
+		sscanf(p + 17, "%lf", &t[0]);
+	if ((p = strstr(buf, "\"scan\": {\"wall\": ")) != NULL)
+		sscanf(p + 17, "%lf", &t[1]);
+	for (p = buf; (p = strstr(p, "\"time\": {\"wall\": ")) != NULL; p++)
+		if (sscanf(p + 17, "%lf", &x) == 1)
+			t[2] += x;
+}
+
+static void cleandir(const char *dir)
+{
+	char path[PATH_MAX];
+	struct dirent *e;
+	DIR *d;
+
+	if ((d = opendir(dir)) == NULL)
+		return;
+	while ((e = readdir(d)) != NULL)
+		if (e->d_name[0] != '.')
+		{
+			snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+			unlink(path);
+		};
+	closedir(d);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct
+	{
+		const char *name;
+		void (*gen)(struct corpus *, size_t, uint64_t);
+		size_t size;
+	} corpora[] = {
+		{"thumb", gen_thumb, 1 << 20},
+		{"image", gen_image, 4 << 20},
+		{"text", gen_text, 1 << 20}};
+	static const int windows[] = {512, 4096, 32768};
+	char dir[] = "/tmp/bsbench.XXXXXX";
+	char bsdiff[PATH_MAX], bspatch[PATH_MAX], cache[PATH_MAX];
+	char old[PATH_MAX], new[PATH_MAX], patch[PATH_MAX], out[PATH_MAX], stats[PATH_MAX];
+	char wopt[16], mopt[32];
+	const char *bindir = (argc > 1) ? argv[1] : ".";
+	double tdiff, tcached, tpatch, phase[3];
+	long rdiff, rcached, rpatch, ram[3];
+	struct stat sto, stn, stp;
+	int i, w, r;
+
+	if (argc > 2)
+		errx(1, "usage: %s [bindir]\n", argv[0]);
+
+	snprintf(bsdiff, sizeof(bsdiff), "%s/bsdiff", bindir);
+	snprintf(bspatch, sizeof(bspatch), "%s/bspatch", bindir);
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+	snprintf(cache, sizeof(cache), "%s/cache", dir);
+	if (mkdir(cache, 0700) != 0)
+		err(1, "%s", cache);
+
+	printf("corpus,oldsize,newsize,window,ram,patch_bytes,bsdiff_s,sort_s,scan_s,compress_s,bsdiff_cached_s,bsdiff_rss_kb,bspatch_s,bspatch_rss_kb\n");
+
+	for (i = 0; i < 3; i++)
+	{
+		snprintf(old, sizeof(old), "%s/%s.old", dir, corpora[i].name);
+		snprintf(new, sizeof(new), "%s/%s.new", dir, corpora[i].name);
+		snprintf(patch, sizeof(patch), "%s/%s.patch", dir, corpora[i].name);
+		snprintf(out, sizeof(out), "%s/%s.out", dir, corpora[i].name);
+		snprintf(stats, sizeof(stats), "%s/%s.json", dir, corpora[i].name);
+		generate(corpora[i].gen, corpora[i].size, i + 1, old, new);
+		if ((stat(old, &sto) != 0) || (stat(new, &stn) != 0))
+			err(1, "%s", corpora[i].name);
+
+		for (w = 0; w < 3; w++)
+		{
+			/* Once sorting, once with the suffix array cached */
+			snprintf(wopt, sizeof(wopt), "%d", windows[w]);
+			cleandir(cache);
+			tdiff = run((char *[]){bsdiff, "-w", wopt, "-C", cache, "--stats", stats, old, new, patch, NULL}, &rdiff);
+			phases(stats, phase);
+			tcached = run((char *[]){bsdiff, "-w", wopt, "-C", cache, old, new, patch, NULL}, &rcached);
+			if (stat(patch, &stp) != 0)
+				err(1, "%s", patch);
+
+			/* No budget, the least bspatch takes and 64 KiB more */
+			ram[0] = 0;
+			ram[1] = minram(patch);
+			ram[2] = ram[1] + 65536;
+			for (r = 0; r < 3; r++)
+			{
+				unlink(out);
+				snprintf(mopt, sizeof(mopt), "%ld", ram[r]);
+				if (ram[r] == 0)
+					tpatch = run((char *[]){bspatch, old, out, patch, NULL}, &rpatch);
+				else
+					tpatch = run((char *[]){bspatch, "-m", mopt, old, out, patch, NULL}, &rpatch);
+				if (!same(out, new))
+					errx(1, "%s: patched file differs\n", corpora[i].name);
+
+				printf("%s,%lld,%lld,%d,%ld,%lld,%.3f,%.3f,%.3f,%.3f,%.3f,%ld,%.3f,%ld\n",
+					   corpora[i].name, (long long)sto.st_size, (long long)stn.st_size,
+					   windows[w], ram[r], (long long)stp.st_size,
+					   tdiff, phase[0], phase[1], phase[2], tcached, rdiff, tpatch, rpatch);
+				fflush(stdout);
+			};
+		};
+
+		unlink(old);
+		unlink(new);
+		unlink(patch);
+		unlink(out);
+		unlink(stats);
+	};
+
+	cleandir(cache);
+	rmdir(cache);
+	rmdir(dir);
+
+	return 0;
+}
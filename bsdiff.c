@@ -26,214 +26,347 @@
  */
 
 #include <sys/types.h>
-#include <err.h>
-#include <fcntl.h>
-#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
+#include <time.h>
 #include "uzlib.h"
+#include "crc32.h"
+#include "filter.h"
+#include "lzr.h"
+#include "eqmask.h"
+#include "sufsort.h"
+#include "bsdiff.h"
 
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
-#define BLOCK_SIZE 512
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+#define WINDOW 512		 /* default bytes a patch section may refer back */
+#define MAX_WINDOW 32768 /* the most deflate allows */
+#define HEADER_SIZE 52
+#define FLAG_INPLACE 1 /* see scan() */
+#define FLAG_CRC 2
+#define FLAG_VARINT 4
+#define FLAG_INDEX 8
+#define FLAG_CODEC 16
+#define FLAG_FILTER 32
+#define INDEX_ENTRY 44
+
+/* The scan loops below compare 64 bytes at a time with eqmask() and
+ * walk the bits of the mask, skipping blocks where nothing can change */
+static off_t matchlen(const uint8_t *old, off_t oldsize, const uint8_t *new, off_t newsize)
+{
+	off_t i, n;
+	uint64_t m;
+
+	n = MIN(oldsize, newsize);
+	for (i = 0; i + 64 <= n; i += 64)
+		if ((m = ~eqmask(old + i, new + i)) != 0)
+			return i + __builtin_ctzll(m);
 
-static void split(off_t *I, off_t *V, off_t start, off_t len, off_t h)
+	for (; i < n; i++)
+		if (old[i] != new[i])
+			break;
+
+	return i;
+}
+
+/* Number of equal bytes in old[0..n) and new[0..n) */
+static off_t countmatch(const uint8_t *old, const uint8_t *new, off_t n)
 {
-	off_t i, j, k, x, tmp, jj, kk;
+	off_t i, c;
+
+	c = 0;
+	for (i = 0; i + 64 <= n; i += 64)
+		c += __builtin_popcountll(eqmask(old + i, new + i));
+	for (; i < n; i++)
+		c += (old[i] == new[i]);
+
+	return c;
+}
 
-	if (len < 16)
+/* Length of the prefix with the most matches over mismatches, the
+ * first one if several tie. Each byte adds one to the score if equal
+ * and takes one away if not. */
+static off_t forward(const uint8_t *old, const uint8_t *new, off_t n)
+{
+	off_t i, v, best, lenf;
+	uint64_t m;
+	int j;
+
+	v = 0;
+	best = 0;
+	lenf = 0;
+	for (i = 0; i + 64 <= n; i += 64)
 	{
-		for (k = start; k < start + len; k += j)
+		m = eqmask(old + i, new + i);
+		if (m == ~(uint64_t)0)
 		{
-			j = 1;
-			x = V[I[k] + h];
-			for (i = 1; k + i < start + len; i++)
+			if ((v += 64) > best)
 			{
-				if (V[I[k + i] + h] < x)
-				{
-					x = V[I[k + i] + h];
-					j = 0;
-				};
-				if (V[I[k + i] + h] == x)
+				best = v;
+				lenf = i + 64;
+			};
+		}
+		else if (m == 0)
+		{
+			v -= 64;
+		}
+		else
+		{
+			for (j = 0; j < 64; j++)
+			{
+				v += ((m >> j) & 1) ? 1 : -1;
+				if (v > best)
 				{
-					tmp = I[k + j];
-					I[k + j] = I[k + i];
-					I[k + i] = tmp;
-					j++;
+					best = v;
+					lenf = i + j + 1;
 				};
 			};
-			for (i = 0; i < j; i++)
-				V[I[k + i]] = k + j - 1;
-			if (j == 1)
-				I[k] = -1;
 		};
-		return;
 	};
 
-	x = V[I[start + len / 2] + h];
-	jj = 0;
-	kk = 0;
-	for (i = start; i < start + len; i++)
+	for (; i < n; i++)
 	{
-		if (V[I[i] + h] < x)
-			jj++;
-		if (V[I[i] + h] == x)
-			kk++;
+		v += (old[i] == new[i]) ? 1 : -1;
+		if (v > best)
+		{
+			best = v;
+			lenf = i + 1;
+		};
 	};
-	jj += start;
-	kk += jj;
 
-	i = start;
-	j = 0;
-	k = 0;
-	while (i < jj)
+	return lenf;
+}
+
+/* As forward() but for the bytes before old and new, going back */
+static off_t backward(const uint8_t *old, const uint8_t *new, off_t n)
+{
+	off_t i, v, best, lenb;
+	uint64_t m;
+	int j;
+
+	v = 0;
+	best = 0;
+	lenb = 0;
+	for (i = 0; i + 64 <= n; i += 64)
 	{
-		if (V[I[i] + h] < x)
+		m = eqmask(old - i - 64, new - i - 64);
+		if (m == ~(uint64_t)0)
 		{
-			i++;
+			if ((v += 64) > best)
+			{
+				best = v;
+				lenb = i + 64;
+			};
 		}
-		else if (V[I[i] + h] == x)
+		else if (m == 0)
 		{
-			tmp = I[i];
-			I[i] = I[jj + j];
-			I[jj + j] = tmp;
-			j++;
+			v -= 64;
 		}
 		else
 		{
-			tmp = I[i];
-			I[i] = I[kk + k];
-			I[kk + k] = tmp;
-			k++;
+			for (j = 63; j >= 0; j--)
+			{
+				v += ((m >> j) & 1) ? 1 : -1;
+				if (v > best)
+				{
+					best = v;
+					lenb = i + 64 - j;
+				};
+			};
 		};
 	};
 
-	while (jj + j < kk)
+	for (; i < n; i++)
 	{
-		if (V[I[jj + j] + h] == x)
+		v += (old[-i - 1] == new[-i - 1]) ? 1 : -1;
+		if (v > best)
 		{
-			j++;
-		}
-		else
-		{
-			tmp = I[jj + j];
-			I[jj + j] = I[kk + k];
-			I[kk + k] = tmp;
-			k++;
+			best = v;
+			lenb = i + 1;
 		};
 	};
 
-	if (jj > start)
-		split(I, V, start, jj - start, h);
-
-	for (i = 0; i < kk - jj; i++)
-		V[I[jj + i]] = kk - 1;
-	if (jj == kk - 1)
-		I[jj] = -1;
-
-	if (start + len > kk)
-		split(I, V, kk, start + len - kk, h);
+	return lenb;
 }
 
-static void qsufsort(off_t *I, off_t *V, uint8_t *old, off_t oldsize)
+/* Where to split an overlap of n bytes between the forward extension
+ * old1/new1 and the backward one old2/new2. Counts matches of the
+ * first less matches of the second, only a block where the two
+ * differ can move the split. */
+static off_t split(const uint8_t *old1, const uint8_t *new1,
+				   const uint8_t *old2, const uint8_t *new2, off_t n)
 {
-	off_t buckets[256];
-	off_t i, h, len;
-
-	for (i = 0; i < 256; i++)
-		buckets[i] = 0;
-	for (i = 0; i < oldsize; i++)
-		buckets[old[i]]++;
-	for (i = 1; i < 256; i++)
-		buckets[i] += buckets[i - 1];
-	for (i = 255; i > 0; i--)
-		buckets[i] = buckets[i - 1];
-	buckets[0] = 0;
-
-	for (i = 0; i < oldsize; i++)
-		I[++buckets[old[i]]] = i;
-	I[0] = oldsize;
-	for (i = 0; i < oldsize; i++)
-		V[i] = buckets[old[i]];
-	V[oldsize] = 0;
-	for (i = 1; i < 256; i++)
-		if (buckets[i] == buckets[i - 1] + 1)
-			I[buckets[i]] = -1;
-	I[0] = -1;
-
-	for (h = 1; I[0] != -(oldsize + 1); h += h)
+	off_t i, v, best, lens;
+	uint64_t m1, m2;
+	int j;
+
+	v = 0;
+	best = 0;
+	lens = 0;
+	for (i = 0; i + 64 <= n; i += 64)
 	{
-		len = 0;
-		for (i = 0; i < oldsize + 1;)
+		m1 = eqmask(old1 + i, new1 + i);
+		m2 = eqmask(old2 + i, new2 + i);
+		if (m1 == m2)
+			continue;
+
+		for (j = 0; j < 64; j++)
 		{
-			if (I[i] < 0)
+			v += (int)((m1 >> j) & 1) - (int)((m2 >> j) & 1);
+			if (v > best)
 			{
-				len -= I[i];
-				i -= I[i];
-			}
-			else
-			{
-				if (len)
-					I[i - len] = -len;
-				len = V[I[i]] + 1 - i;
-				split(I, V, i, len, h);
-				i += len;
-				len = 0;
+				best = v;
+				lens = i + j + 1;
 			};
 		};
-		if (len)
-			I[i - len] = -len;
 	};
 
-	for (i = 0; i < oldsize + 1; i++)
-		I[V[i]] = i;
+	for (; i < n; i++)
+	{
+		v += (old1[i] == new1[i]) - (old2[i] == new2[i]);
+		if (v > best)
+		{
+			best = v;
+			lens = i + 1;
+		};
+	};
+
+	return lens;
 }
 
-static off_t matchlen(uint8_t *old, off_t oldsize, uint8_t *new, off_t newsize)
+/* Suffix array with the range of every byte pair, so that search()
+ * can skip the first probes. Suffixes are bucketed like the sort
+ * does, a single last byte b as key b * 257 and a pair b, c as key
+ * b * 257 + c + 1. */
+#define PAIRS 65792 /* 256 * 257 */
+
+int sufindex_init(struct sufindex *ix, const struct sufarray *sa,
+				  const uint8_t *old, off_t oldsize)
 {
-	off_t i;
+	off_t i, k, n;
 
-	for (i = 0; (i < oldsize) && (i < newsize); i++)
-		if (old[i] != new[i])
-			break;
+	eqmask_init();
+	ix->crc = crc32_update(0, old, oldsize);
 
-	return i;
+	/* start has PAIRS + 1 entries, one for each key and the end */
+	if ((ix->start = calloc(PAIRS + 1, sizeof(off_t))) == NULL)
+		return -1;
+
+	for (i = 0; i < oldsize; i++)
+		ix->start[old[i] * 257 + ((i + 1 < oldsize) ? old[i + 1] + 1 : 0)]++;
+
+	/* Rank 0 is the empty suffix */
+	for (k = 0, n = 1; k <= PAIRS; k++)
+	{
+		i = ix->start[k];
+		ix->start[k] = n;
+		n += i;
+	};
+
+	ix->sa = sa;
+	ix->last = (oldsize > 0) ? ix->start[old[oldsize - 1] * 257] : -1;
+
+	return 0;
+}
+
+void sufindex_free(struct sufindex *ix)
+{
+	free(ix->start);
 }
 
-static off_t search(off_t *I, uint8_t *old, off_t oldsize,
-					uint8_t *new, off_t newsize, off_t st, off_t en, off_t *pos)
+/* Binary search for the longest match of new in old. The probes are
+ * the same as those of the original recursive search, but a probe
+ * outside the bucket of new's first two bytes is decided by the table
+ * alone. Inside, the bytes known to be shared with both ends of the
+ * range are not compared again. The shared length is only tracked
+ * for LCPSTEP more bytes per probe, memcmp is faster on the rest of a
+ * long match. An array out of order, from a damaged cache file, only
+ * gives worse matches; nothing past old is read. */
+#define LCPSTEP 64
+
+static off_t search(const struct sufindex *ix, const uint8_t *old, off_t oldsize,
+					const uint8_t *new, off_t newsize, off_t *pos, uint64_t *probes)
 {
-	off_t x, y;
+	const struct sufarray *sa = ix->sa;
+	off_t st, en, x, y, l, n, skip, lo, hi, k;
+	off_t lst, len; /* bytes known to match at st and en */
+	int less;
+
+	lo = 0;
+	hi = oldsize + 1;
+	if (newsize >= 2)
+	{
+		k = new[0] * 257 + new[1] + 1;
+		lo = ix->start[k];
+		hi = ix->start[k + 1];
+	};
+
+	st = 0;
+	en = oldsize;
+	lst = 0;
+	len = 0;
 
-	if (en - st < 2)
+	while (en - st >= 2)
 	{
-		x = matchlen(old + I[st], oldsize - I[st], new, newsize);
-		y = matchlen(old + I[en], oldsize - I[en], new, newsize);
+		x = st + (en - st) / 2;
+		l = 0;
 
-		if (x > y)
+		if (((x < lo) || (x >= hi)) && (x != ix->last))
 		{
-			*pos = I[st];
-			return x;
+			less = (x < lo);
 		}
 		else
 		{
-			*pos = I[en];
-			return y;
+			(*probes)++;
+			y = sufarray_get(sa, x);
+			n = MIN(oldsize - y, newsize);
+			skip = MIN(lst, len);
+			if ((x >= lo) && (x < hi) && (newsize >= 2))
+				skip = MAX(skip, 2);
+			skip = MIN(skip, n);
+
+			l = skip + matchlen(old + y + skip, MIN(n - skip, LCPSTEP),
+								new + skip, LCPSTEP);
+			if (l == n)
+				less = 0;
+			else if (l < skip + LCPSTEP)
+				less = (old[y + l] < new[l]);
+			else
+				less = (memcmp(old + y + l, new + l, n - l) < 0);
+		};
+
+		if (less)
+		{
+			st = x;
+			lst = l;
 		}
+		else
+		{
+			en = x;
+			len = l;
+		};
 	};
 
-	x = st + (en - st) / 2;
-	if (memcmp(old + I[x], new, MIN(oldsize - I[x], newsize)) < 0)
+	*probes += 2;
+	y = sufarray_get(sa, st);
+	lst = MIN(lst, oldsize - y);
+	lst += matchlen(old + y + lst, oldsize - y - lst, new + lst, newsize - lst);
+	y = sufarray_get(sa, en);
+	len = MIN(len, oldsize - y);
+	len += matchlen(old + y + len, oldsize - y - len, new + len, newsize - len);
+
+	if (lst > len)
 	{
-		return search(I, old, oldsize, new, newsize, x, en, pos);
+		*pos = sufarray_get(sa, st);
+		return lst;
 	}
 	else
 	{
-		return search(I, old, oldsize, new, newsize, st, x, pos);
+		*pos = sufarray_get(sa, en);
+		return len;
 	};
-
-	/* Dummy return to make eclipse happy */
-	return 0;
 }
 
 static void offtout(off_t x, uint8_t *buf)
@@ -272,167 +405,406 @@ static void offtout(off_t x, uint8_t *buf)
 		buf[7] |= 0x80;
 }
 
-static void uzWriteOpen(int sf, int df)
+/* LEB128, returns the length, at most 10 bytes */
+static int varintout(uint64_t x, uint8_t *buf)
 {
-	/* Write uzlib header */
-	uint8_t header[10] = {0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x03};
-	if (write(df, header, 10) != 10)
-		errx(1, "write header\n");
+	int n;
 
-	//fseek(sf, 0, SEEK_SET);
+	for (n = 0; x >= 0x80; x >>= 7)
+		buf[n++] = (x & 0x7F) | 0x80;
+	buf[n++] = x;
+
+	return n;
 }
 
-static void uzWriteClose(int sf, int df)
+static void le32out(uint32_t x, uint8_t *buf)
 {
-	// TODO: add checksum
-	// int sflen = ftell(sf);
-	// char *source = (char*)malloc(sflen);
-	// fseek(sf, 0, SEEK_SET);
-	// fread(source, 1, sflen, sf);
-	// uint32_t crc = ~uzlib_crc32(source, sflen, ~0);
-	// fwrite(&crc, sizeof(crc), 1, df);
-	// free(source);
+	buf[0] = x;
+	buf[1] = x >> 8;
+	buf[2] = x >> 16;
+	buf[3] = x >> 24;
 }
 
-static size_t uzWrite(int sf, int df, uint8_t *buffer, size_t length)
+/* A section of the patch, compressed with its codec. Deflate and lzr
+ * refer back at most dict bytes, no more than the window bspatch
+ * keeps. Input is gathered in buf behind that much history and
+ * compressed SECTION_CHUNK bytes at a time. */
+#define SECTION_CHUNK 65536
+#define LZR_DEPTH 32 /* matches lzr tries at each position */
+
+struct section
+{
+	const struct bsdiff_stream *io;
+	off_t pos; /* where the output goes */
+	int error; /* a write failed */
+	int codec;
+	size_t dict;
+	struct uzlib_comp comp;
+	struct lzr_enc *lz;
+	uint8_t *buf;
+	size_t hist, len; /* bytes of history and of input in buf */
+	uint32_t crc, size; /* of all input, for the gzip trailer */
+};
+
+/* Writes output at pos, a failed write is kept until sectionClose() */
+static void sectionOut(struct section *s, const void *buf, size_t len)
 {
-	int i;
-	/* TODO: Store decompressed data for later, needed by crc32 to create ckecksum */
+	if ((s->error == 0) && (s->io->write(s->io->opaque, s->pos, buf, len) != 0))
+		s->error = 1;
+	s->pos += len;
+}
 
-	/* Compress data and write to the destination file */
-    struct uzlib_comp comp = {0};
-    comp.dict_size = BLOCK_SIZE;
-    comp.hash_bits = 12;
-    size_t hash_size = sizeof(uzlib_hash_entry_t) * (1 << comp.hash_bits);
-    comp.hash_table = malloc(hash_size);
-    memset(comp.hash_table, 0, hash_size);
+static void lzrOut(void *opaque, const uint8_t *buf, size_t len)
+{
+	sectionOut(opaque, buf, len);
+}
 
-    zlib_start_block(&comp.out);
-    uzlib_compress(&comp, buffer, length);
-    zlib_finish_block(&comp.out);
+static void sectionFlush(struct section *s)
+{
+	size_t i, shift;
 
-	if ((i = write(df, comp.out.outbuf, comp.out.outlen)) != comp.out.outlen)
+	switch (s->codec)
 	{
-		err(1, "write outbuf: fd: %i, inlen: %li, outlen: %i, writelen: %i\n", df, length, comp.out.outlen, i);
+	case BSDIFF_DEFLATE:
+		s->crc = crc32_update(s->crc, s->buf + s->hist, s->len);
+		s->size += s->len;
+		uzlib_compress(&s->comp, s->buf + s->hist, s->len);
+		sectionOut(s, s->comp.out.outbuf, s->comp.out.outlen);
+		s->comp.out.outlen = 0;
+		break;
+	case BSDIFF_STORED:
+		sectionOut(s, s->buf + s->hist, s->len);
+		break;
+	case BSDIFF_LZR:
+		lzr_compress(s->lz, s->buf, s->hist, s->len);
+		break;
+	};
+
+	/* Keep the last dict bytes, the hash table of deflate points into
+		them and has to move along */
+	shift = s->hist + s->len - MIN(s->hist + s->len, s->dict);
+	memmove(s->buf, s->buf + shift, s->hist + s->len - shift);
+	if (s->codec == BSDIFF_DEFLATE)
+		for (i = 0; i < ((size_t)1 << s->comp.hash_bits); i++)
+			if (s->comp.hash_table[i] != NULL)
+				s->comp.hash_table[i] = (s->comp.hash_table[i] < s->buf + shift) ? NULL : s->comp.hash_table[i] - shift;
+
+	s->hist += s->len - shift;
+	s->len = 0;
+}
+
+/* Starts a section at pos, returns -1 if out of memory */
+static int sectionOpen(struct section *s, const struct bsdiff_stream *io, off_t pos,
+					   int codec, const struct bsdiff_options *opt)
+{
+	uint8_t header[10] = {0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x03};
+	int hash_bits;
+
+	/* A bigger dictionary gets a bigger hash table, from 12 bits at 512
+		bytes to 16 bits from 8 KiB */
+	s->dict = (opt->dict > 0) ? MIN(opt->dict, opt->window) : opt->window;
+	for (hash_bits = 12; (hash_bits < 16) && (512u << (hash_bits - 12)) < s->dict;)
+		hash_bits++;
+	if (opt->hash_bits > 0)
+		hash_bits = opt->hash_bits;
+
+	memset(&s->comp, 0, sizeof(s->comp));
+	s->lz = NULL;
+	s->buf = malloc(s->dict + SECTION_CHUNK);
+	if (s->buf == NULL)
+		return -1;
+	if (codec == BSDIFF_DEFLATE)
+	{
+		s->comp.dict_size = s->dict;
+		s->comp.hash_bits = hash_bits;
+		if ((s->comp.hash_table = calloc(1 << hash_bits, sizeof(uzlib_hash_entry_t))) == NULL)
+		{
+			free(s->buf);
+			return -1;
+		};
 	}
+	else if (codec == BSDIFF_LZR)
+	{
+		if (((s->lz = malloc(sizeof(*s->lz))) == NULL) ||
+			(lzr_enc_init(s->lz, s->dict, hash_bits, LZR_DEPTH, lzrOut, s) != 0))
+		{
+			free(s->lz);
+			free(s->buf);
+			return -1;
+		};
+	}
+	else
+		s->dict = 0;
+
+	s->io = io;
+	s->pos = pos;
+	s->error = 0;
+	s->codec = codec;
+	s->hist = 0;
+	s->len = 0;
+	s->crc = 0;
+	s->size = 0;
+
+	/* Deflate is a gzip member */
+	if (codec == BSDIFF_DEFLATE)
+	{
+		sectionOut(s, header, 10);
+		zlib_start_block(&s->comp.out);
+	};
+
+	return 0;
+}
+
+/* Ends a section, returns -1 if any of its writes failed */
+static int sectionClose(struct section *s)
+{
+	uint8_t trailer[8];
 
-	free(comp.hash_table);
+	sectionFlush(s);
+	if (s->codec == BSDIFF_DEFLATE)
+	{
+		zlib_finish_block(&s->comp.out);
+		sectionOut(s, s->comp.out.outbuf, s->comp.out.outlen);
 
-	return comp.out.outlen;
+		/* Write gzip trailer, CRC-32 and size of the input */
+		le32out(s->crc, trailer);
+		le32out(s->size, trailer + 4);
+		sectionOut(s, trailer, 8);
+
+		free(s->comp.out.outbuf);
+		free(s->comp.hash_table);
+	}
+	else if (s->codec == BSDIFF_LZR)
+	{
+		lzr_enc_finish(s->lz);
+		free(s->lz);
+	};
+	free(s->buf);
+
+	return s->error ? -1 : 0;
 }
 
-int main(int argc, char *argv[])
+static void sectionWrite(struct section *s, const uint8_t *buffer, size_t length)
 {
-	int fd, ndb, neb;
-	uint8_t *old, *new;
-	off_t oldsize, newsize;
-	off_t *I, *V;
-	off_t scan, pos, len;
-	off_t lastscan, lastpos, lastoffset;
-	off_t oldscore, scsc;
-	off_t s, Sf, lenf, Sb, lenb;
-	off_t overlap, Ss, lens;
-	off_t i;
-	off_t *dblen = NULL, *eblen = NULL;
-	off_t dbsum, ebsum;
-	uint8_t *db, *eb;
-	uint8_t header[36], cb[25];
-	int sf, df;
-
-	if (argc != 4)
-		errx(1, "usage: %s oldfile newfile patchfile\n", argv[0]);
-
-	/* Allocate oldsize+1 bytes instead of oldsize bytes to ensure
-		that we never try to malloc(0) and get a NULL pointer */
-	if (((fd = open(argv[1], O_RDONLY, 0)) < 0) ||
-		((oldsize = lseek(fd, 0, SEEK_END)) == -1) ||
-		((old = malloc(oldsize + 1)) == NULL) ||
-		(lseek(fd, 0, SEEK_SET) != 0) ||
-		(read(fd, old, oldsize) != oldsize) ||
-		(close(fd) == -1))
-		err(1, "%s", argv[1]);
-
-	if (((I = malloc((oldsize + 1) * sizeof(off_t))) == NULL) ||
-		((V = malloc((oldsize + 1) * sizeof(off_t))) == NULL))
-		err(1, NULL);
+	size_t n;
 
-	qsufsort(I, V, old, oldsize);
+	while (length > 0)
+	{
+		n = MIN(length, SECTION_CHUNK - s->len);
+		memcpy(s->buf + s->hist + s->len, buffer, n);
+		s->len += n;
+		buffer += n;
+		length -= n;
+
+		if (s->len == SECTION_CHUNK)
+			sectionFlush(s);
+	};
+}
 
-	free(V);
+/* Writes the diff string new[i] - old[i], computed straight into the
+ * input buffer */
+static void sectionWriteDiff(struct section *s, const uint8_t *old, const uint8_t *new, size_t length)
+{
+	size_t i, n;
+	uint8_t *p;
 
-	/* Allocate newsize+1 bytes instead of newsize bytes to ensure
-		that we never try to malloc(0) and get a NULL pointer */
-	if (((fd = open(argv[2], O_RDONLY, 0)) < 0) ||
-		((newsize = lseek(fd, 0, SEEK_END)) == -1) ||
-		((new = malloc(newsize + 1)) == NULL) ||
-		(lseek(fd, 0, SEEK_SET) != 0) ||
-		(read(fd, new, newsize) != newsize) ||
-		(close(fd) == -1))
-		err(1, "%s", argv[2]);
+	while (length > 0)
+	{
+		n = MIN(length, SECTION_CHUNK - s->len);
+		p = s->buf + s->hist + s->len;
+		for (i = 0; i < n; i++)
+			p[i] = new[i] - old[i];
+		s->len += n;
+		old += n;
+		new += n;
+		length -= n;
+
+		if (s->len == SECTION_CHUNK)
+			sectionFlush(s);
+	};
+}
 
-	if (((db = malloc(newsize + 1)) == NULL) ||
-		((eb = malloc(newsize + 1)) == NULL))
-		err(1, NULL);
+/* The scan of new[from..to), see diff() */
+struct chunk
+{
+	off_t from, to;
+	off_t startpos; /* position in old the scan starts at */
+	off_t endpos;	/* ... and where the last diff string ends */
+	off_t (*ctrl)[3];
+	off_t nctrl, ctrlsize;
+	int error; /* out of memory */
+	uint64_t searches, probes;
+	double cpu;
+};
+
+/* Costs of the parts of a patch in 1/16 bits, as optimal() sees them */
+struct costs
+{
+	off_t triple;		/* a ctrl triple */
+	off_t seek;			/* ... and each bit of its seek */
+	off_t same, differ; /* a diff byte that is 0, or not */
+	off_t extra;		/* an extra byte */
+};
 
-	dbsum = 0;
-	ebsum = 0;
+struct scan
+{
+	const struct sufindex *ix;
+	const uint8_t *old, *new;
+	off_t oldsize;
+	int inplace;
+	off_t lookbehind; /* how far behind new old may be read in place */
+	struct chunk *chunks;
+	struct costs cost; /* for optimal() */
+};
+
+static double seconds(clockid_t clock)
+{
+	struct timespec t;
 
-	/* Temporary file containing uncompressed data, 
-		used by uzlib for creating crc32 checksum */
-	// if ((sf = fopen("crc32", "wb+")) == NULL)
-	// 	err(1, "%s", "crc32");
+	clock_gettime(clock, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
 
-	/* Create the patch file (destination file) */
-	if ((df = open(argv[3], O_CREAT | O_RDWR, 0666)) < 0)
+/* Times wall and CPU, the CPU of this thread or of the process */
+static void timer_start(struct bsdiff_time *t, clockid_t cpu)
+{
+	t->wall = -seconds(CLOCK_MONOTONIC);
+	t->cpu = -seconds(cpu);
+}
+
+static void timer_stop(struct bsdiff_time *t, clockid_t cpu)
+{
+	t->wall += seconds(CLOCK_MONOTONIC);
+	t->cpu += seconds(cpu);
+}
+
+static void timer_add(struct bsdiff_time *sum, const struct bsdiff_time *t)
+{
+	sum->wall += t->wall;
+	sum->cpu += t->cpu;
+}
+
+/* Runs fn(arg, 0), fn(arg, 1) ... fn(arg, njobs - 1) on up to threads
+ * threads, the calling one included */
+struct pool
+{
+	void (*fn)(void *arg, int job);
+	void *arg;
+	int njobs, next;
+	pthread_mutex_t lock;
+};
+
+static void *pool_thread(void *arg)
+{
+	struct pool *pool = arg;
+	int job;
+
+	for (;;)
 	{
-		errx(1, "open(%s)\n", argv[3]);
-	}
+		pthread_mutex_lock(&pool->lock);
+		job = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
 
-	/* Header is
-		0	12	 "JWE/BSDIFF40"
-		12	8	length of uzipped ctrl block
-		20	8	length of uzipped diff block
-		28	8	length of new file */
-	/* File is
-		0	36	Header
-		36	??	uzlib ctrl block
-		??	??	uzlib diff block
-		??	??	uzlib extra block */
+		if (job >= pool->njobs)
+			return NULL;
 
-	memcpy(header, "JWE/BSDIFF40", 12);
-	offtout(0, header + 12);
-	offtout(0, header + 20);
-	offtout(newsize, header + 28);
+		pool->fn(pool->arg, job);
+	};
+}
 
-	if (write(df, header, 36) != 36)
+static void parallel(int threads, int njobs, void (*fn)(void *, int), void *arg)
+{
+	struct pool pool;
+	pthread_t *tids;
+	int t;
+
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.njobs = njobs;
+	pool.next = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+
+	threads = MIN(threads, njobs);
+	if ((tids = malloc(threads * sizeof(pthread_t))) == NULL)
+		threads = 1;
+
+	/* Carry on with fewer threads if they can not be started */
+	for (t = 1; t < threads; t++)
+		if (pthread_create(&tids[t], NULL, pool_thread, &pool) != 0)
+			break;
+	pool_thread(&pool);
+	while (--t > 0)
+		pthread_join(tids[t], NULL);
+
+	pthread_mutex_destroy(&pool.lock);
+	free(tids);
+}
+
+/* Appends a ctrl triple to c, growing it as needed */
+static int ctrlpush(struct chunk *c, off_t x, off_t y, off_t z)
+{
+	off_t(*ctrl)[3];
+
+	if (c->nctrl == c->ctrlsize)
 	{
-		errx(1, "write(%s)\n", argv[3]);
-	}
+		c->ctrlsize = (c->ctrlsize > 0) ? 2 * c->ctrlsize : 1024;
+		if ((ctrl = realloc(c->ctrl, c->ctrlsize * sizeof(*c->ctrl))) == NULL)
+			return -1;
+		c->ctrl = ctrl;
+	};
+	c->ctrl[c->nctrl][0] = x;
+	c->ctrl[c->nctrl][1] = y;
+	c->ctrl[c->nctrl][2] = z;
+	c->nctrl++;
 
-	/* Compute the differences, write ctrl as we go */
-	uzWriteOpen(sf, df);
+	return 0;
+}
 
-	scan = 0;
+/* Finds the ctrl triples for one chunk of new. The diff and extra
+ * bytes follow from them and are only made when written. */
+static void scan(void *arg, int job)
+{
+	struct scan *sc = arg;
+	struct chunk *c = &sc->chunks[job];
+	const uint8_t *old = sc->old, *new = sc->new;
+	off_t oldsize = sc->oldsize, end = c->to;
+	off_t scan, pos, len;
+	off_t lastscan, lastpos, lastoffset;
+	off_t oldscore, scsc;
+	off_t lenf, lenb;
+	off_t overlap, lens;
+	double cpu;
+
+	cpu = seconds(CLOCK_THREAD_CPUTIME_ID);
+
+	/* Later chunks start where the first match points to, rather
+		than at the beginning of old */
+	if (c->from > 0)
+	{
+		search(sc->ix, old, oldsize, new + c->from, end - c->from,
+			   &c->startpos, &c->probes);
+		c->searches++;
+	};
+
+	scan = c->from;
 	len = 0;
-	lastscan = 0;
-	lastpos = 0;
-	lastoffset = 0;
-	ndb = 0;
-	neb = 0;
+	lastscan = c->from;
+	lastpos = c->startpos;
+	lastoffset = lastpos - lastscan;
 
-	while (scan < newsize)
+	while (scan < end)
 	{
 		oldscore = 0;
 
-		for (scsc = scan += len; scan < newsize; scan++)
+		for (scsc = scan += len; scan < end; scan++)
 		{
-			len = search(I, old, oldsize, new + scan, newsize - scan,
-						 0, oldsize, &pos);
+			len = search(sc->ix, old, oldsize, new + scan, end - scan, &pos, &c->probes);
+			c->searches++;
 
-			for (; scsc < scan + len; scsc++)
-				if ((scsc + lastoffset < oldsize) &&
-					(old[scsc + lastoffset] == new[scsc]))
-					oldscore++;
+			if (MIN(scan + len, oldsize - lastoffset) > scsc)
+				oldscore += countmatch(old + scsc + lastoffset, new + scsc,
+									   MIN(scan + len, oldsize - lastoffset) - scsc);
+			scsc = MAX(scsc, scan + len);
 
 			if (((len == oldscore) && (len != 0)) ||
 				(len > oldscore + 8))
@@ -443,83 +815,40 @@ int main(int argc, char *argv[])
 				oldscore--;
 		};
 
-		if ((len != oldscore) || (scan == newsize))
+		if ((len != oldscore) || (scan == end))
 		{
-			s = 0;
-			Sf = 0;
-			lenf = 0;
-			for (i = 0; (lastscan + i < scan) && (lastpos + i < oldsize);)
-			{
-				if (old[lastpos + i] == new[lastscan + i])
-					s++;
-				i++;
-				if (s * 2 - i > Sf * 2 - lenf)
-				{
-					Sf = s;
-					lenf = i;
-				};
-			};
+			lenf = forward(old + lastpos, new + lastscan,
+						   MIN(scan - lastscan, oldsize - lastpos));
 
 			lenb = 0;
-			if (scan < newsize)
-			{
-				s = 0;
-				Sb = 0;
-				for (i = 1; (scan >= lastscan + i) && (pos >= i); i++)
-				{
-					if (old[pos - i] == new[scan - i])
-						s++;
-					if (s * 2 - i > Sb * 2 - lenb)
-					{
-						Sb = s;
-						lenb = i;
-					};
-				};
-			};
+			if (scan < end)
+				lenb = backward(old + pos, new + scan, MIN(scan - lastscan, pos));
 
 			if (lastscan + lenf > scan - lenb)
 			{
 				overlap = (lastscan + lenf) - (scan - lenb);
-				s = 0;
-				Ss = 0;
-				lens = 0;
-				for (i = 0; i < overlap; i++)
-				{
-					if (new[lastscan + lenf - overlap + i] ==
-						old[lastpos + lenf - overlap + i])
-						s++;
-					if (new[scan - lenb + i] ==
-						old[pos - lenb + i])
-						s--;
-					if (s > Ss)
-					{
-						Ss = s;
-						lens = i + 1;
-					};
-				};
+				lens = split(old + lastpos + lenf - overlap,
+							 new + lastscan + lenf - overlap,
+							 old + pos - lenb, new + scan - lenb, overlap);
 
 				lenf += lens - overlap;
 				lenb -= lens;
 			};
 
-			for (i = 0; i < lenf; i++)
-				db[dbsum + i] = new[lastscan + i] - old[lastpos + i];
-			for (i = 0; i < (scan - lenb) - (lastscan + lenf); i++)
-				eb[ebsum + i] = new[lastscan + lenf + i];
+			/* Patching in place overwrites old as new is written,
+				bspatch keeps only lookbehind bytes of it. A diff string
+				further back than that goes to extra instead. */
+			if (sc->inplace && (lastpos < lastscan - sc->lookbehind))
+				lenf = 0;
 
-			dblen = (off_t *)realloc(dblen, (ndb + 1) * sizeof(off_t));
-			eblen = (off_t *)realloc(eblen, (neb + 1) * sizeof(off_t));
-			dblen[ndb] = lenf;
-			eblen[neb] = (scan - lenb) - (lastscan + lenf);
-
-			dbsum += dblen[ndb];
-			ebsum += eblen[neb];
+			if (ctrlpush(c, lenf, (scan - lenb) - (lastscan + lenf),
+						 (pos - lenb) - (lastpos + lenf)) != 0)
+			{
+				c->error = 1;
+				return;
+			};
 
-			offtout(dblen[ndb++], &cb[0]);
-			offtout(eblen[neb++], &cb[8]);
-			offtout((pos - lenb) - (lastpos + lenf), &cb[16]);
-			cb[24] = ~cb[23];
-			uzWrite(sf, df, cb, 24);
+			c->endpos = lastpos + lenf;
 
 			lastscan = scan - lenb;
 			lastpos = pos - lenb;
@@ -527,89 +856,1225 @@ int main(int argc, char *argv[])
 		};
 	};
 
-	uzWriteClose(sf, df);
+	c->cpu = seconds(CLOCK_THREAD_CPUTIME_ID) - cpu;
+}
+
+#define SLOTS 8				  /* offsets into old optimal() follows at once */
+#define NOWHERE ((off_t)1 << 60) /* cost of a state that can not be reached */
+#define FROM_DIFF 0x80			  /* extra after the cheapest diff state */
+
+/* An offset into old that optimal() may follow from new[pos] on */
+struct candidate
+{
+	off_t pos, offset;
+};
+
+static int candcmp(const void *a, const void *b)
+{
+	const struct candidate *x = a, *y = b;
+
+	return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+/* A slot of optimal() taking another offset at new[pos] */
+struct retarget
+{
+	off_t pos, before;
+	int slot;
+};
+
+/* A run of diff or extra bytes that optimal() settled on */
+struct run
+{
+	off_t pos, len;
+	off_t offset; /* old - new of a diff run, NOWHERE for extra */
+	int triple;	  /* a diff run that starts a triple */
+};
+
+/* Bits in the magnitude of x */
+static int bitlen(off_t x)
+{
+	return (x == 0) ? 0 : 64 - __builtin_clzll((x < 0) ? -x : x);
+}
 
-	/* Compute size of compressed ctrl data */
-	/* Compute size of compressed ctrl data */
-	if ((len = lseek(df, 0, SEEK_CUR)) < 0)
+/* Finds the ctrl triples for one chunk of new like scan(), but by cost.
+ * Every byte of new is either a diff byte against old at one of a few
+ * offsets the searches turned up, or an extra byte, and starting a
+ * triple costs as much as one takes in the patch. The cheapest way
+ * through is found front to back and traced back from the end. */
+static void optimal(void *arg, int job)
+{
+	struct scan *sc = arg;
+	struct chunk *c = &sc->chunks[job];
+	const struct costs *cost = &sc->cost;
+	const uint8_t *old = sc->old, *new = sc->new;
+	off_t oldsize = sc->oldsize, from = c->from, n = c->to - c->from;
+	off_t offset[SLOTS], state[SLOTS], extra, extraoff, best, jd, je, start, m;
+	off_t i, p, len, pos, last, oldpos, at;
+	struct candidate *cands = NULL, *ctmp;
+	struct retarget *log = NULL, *tmp;
+	struct run *runs = NULL, *r, *rtmp;
+	size_t ncands = 0, candsize = 0, nlog = 0, logsize = 0, nruns = 0, runsize = 0, k;
+	uint8_t *cheapest;
+	uint16_t *flags;
+	int s, b, cur, fl;
+	double cpu;
+
+	cpu = seconds(CLOCK_THREAD_CPUTIME_ID);
+	c->error = 1; /* until it is done */
+
+	cheapest = malloc(n + 1);
+	flags = malloc((n + 1) * sizeof(*flags));
+	if ((cheapest == NULL) || (flags == NULL))
+		goto done;
+
+	/* Search where the last match ends, as scan() does, and take the
+		offsets of long enough matches from where they would start
+		with mismatches in them */
+	for (i = 0, last = 0; i < n; i += MAX(len, 1))
 	{
-		errx(1, "lseek\n");
-	}
+		len = search(sc->ix, old, oldsize, new + from + i, n - i, &pos, &c->probes);
+		c->searches++;
+		if ((len * (cost->extra - cost->same) <= cost->triple / 2) ||
+			(sc->inplace && (pos - from - i < -sc->lookbehind)))
+			continue;
 
-	offtout(len - 36, header + 12);
+		if (ncands == candsize)
+		{
+			candsize = (candsize > 0) ? 2 * candsize : 1024;
+			if ((ctmp = realloc(cands, candsize * sizeof(*cands))) == NULL)
+				goto done;
+			cands = ctmp;
+		};
+		cands[ncands].pos = i - backward(old + pos, new + from + i, MIN(i - last, pos));
+		cands[ncands].offset = pos - from - i;
+		ncands++;
+		last = i;
+	};
+	if (ncands > 0)
+		qsort(cands, ncands, sizeof(*cands), candcmp);
 
-	/* Write compressed diff data, write in chunks to 
-	 * keep the RAM usage of bspatch low */
-	int wrptr = 0, wrlen = 0;
-	uint8_t savebyte;
-	uzWriteOpen(sf, df);
+	for (s = 0; s < SLOTS; s++)
+	{
+		offset[s] = NOWHERE;
+		state[s] = NOWHERE;
+	};
+	extra = 0;
+	extraoff = c->startpos - from;
 
-	for (i = 0; i < ndb; i++)
+	for (i = 0, k = 0; i < n; i++)
 	{
-		//printf("dblen[%i]=%i\n", i, dblen[i]);
-		while (dblen[i] > 0)
+		for (; (k < ncands) && (cands[k].pos <= i); k++)
 		{
-			wrlen = MIN(dblen[i], BLOCK_SIZE);
-			savebyte = db[wrptr + wrlen];
-			db[wrptr + wrlen] = ~savebyte;
-			uzWrite(sf, df, &db[wrptr], wrlen);
-			db[wrptr + wrlen] = savebyte;
-			wrptr += wrlen;
-			dblen[i] -= wrlen;
+			for (s = 0; (s < SLOTS) && (offset[s] != cands[k].offset); s++)
+				;
+			if (s < SLOTS)
+				continue;
+
+			/* A new offset takes the slot of the dearest one */
+			for (b = 0, s = 1; s < SLOTS; s++)
+				if (state[s] > state[b])
+					b = s;
+			if (nlog == logsize)
+			{
+				logsize = (logsize > 0) ? 2 * logsize : 1024;
+				if ((tmp = realloc(log, logsize * sizeof(*log))) == NULL)
+					goto done;
+				log = tmp;
+			};
+			log[nlog].pos = i;
+			log[nlog].before = offset[b];
+			log[nlog].slot = b;
+			nlog++;
+			offset[b] = cands[k].offset;
+			state[b] = NOWHERE;
+		};
+
+		for (b = 0, s = 1; s < SLOTS; s++)
+			if (state[s] < state[b])
+				b = s;
+		best = state[b];
+		fl = 0;
+
+		/* Each diff state goes on, or starts a triple after the
+			cheapest diff state or after extra, seeking from where
+			that was in old */
+		for (s = 0; s < SLOTS; s++)
+		{
+			p = from + i + offset[s];
+			if ((offset[s] == NOWHERE) || (p < 0) || (p >= oldsize))
+			{
+				state[s] = NOWHERE;
+				continue;
+			};
+			m = (old[p] == new[from + i]) ? cost->same : cost->differ;
+			jd = best + cost->seek * bitlen(offset[s] - offset[b]);
+			je = extra + cost->seek * bitlen(offset[s] - extraoff);
+			start = MIN(jd, je) + cost->triple;
+			if (start < state[s])
+			{
+				state[s] = start + m;
+				fl |= (je <= jd) ? 0x101 << s : 1 << s;
+			}
+			else
+				state[s] += m;
+		};
+
+		if (best < extra)
+		{
+			extra = best + cost->extra;
+			extraoff = offset[b];
+			b |= FROM_DIFF;
 		}
-	}
-	uzWriteClose(sf, df);
+		else
+			extra += cost->extra;
+
+		cheapest[i] = b;
+		flags[i] = fl;
+	};
 
-	/* Compute size of compressed diff data */
-	if ((newsize = lseek(df, 0, SEEK_CUR)) == -1)
+	/* Trace the cheapest way back into runs, last one first */
+	for (cur = SLOTS, s = 0; s < SLOTS; s++)
+		if (state[s] < ((cur == SLOTS) ? extra : state[cur]))
+			cur = s;
+	for (i = n - 1; i >= 0; i--)
 	{
-		errx(1, "lseek\n");
+		while ((nlog > 0) && (log[nlog - 1].pos > i))
+		{
+			nlog--;
+			offset[log[nlog].slot] = log[nlog].before;
+		};
+
+		at = (cur == SLOTS) ? NOWHERE : offset[cur];
+		if ((nruns == 0) || (runs[nruns - 1].offset != at) || runs[nruns - 1].triple)
+		{
+			if (nruns == runsize)
+			{
+				runsize = (runsize > 0) ? 2 * runsize : 1024;
+				if ((rtmp = realloc(runs, runsize * sizeof(*runs))) == NULL)
+					goto done;
+				runs = rtmp;
+			};
+			runs[nruns].offset = at;
+			runs[nruns].len = 0;
+			runs[nruns].triple = 0;
+			nruns++;
+		};
+		r = &runs[nruns - 1];
+		r->pos = i;
+		r->len++;
+
+		if (cur == SLOTS)
+		{
+			if (cheapest[i] & FROM_DIFF)
+				cur = cheapest[i] & ~FROM_DIFF;
+		}
+		else if (flags[i] & (1 << cur))
+		{
+			r->triple = 1;
+			cur = (flags[i] & (0x100 << cur)) ? SLOTS : cheapest[i] & ~FROM_DIFF;
+		};
+	};
+
+	/* A triple for each diff run that starts one, with the extra
+		runs after it. The first chunk has to start at 0 in old, a
+		later one starts where its first diff run is. */
+	oldpos = c->startpos;
+	if (from > 0)
+		for (r = runs + nruns; r > runs; r--)
+			if (r[-1].offset != NOWHERE)
+			{
+				oldpos = c->startpos = from + r[-1].pos + r[-1].offset;
+				break;
+			};
+	while (nruns > 0)
+	{
+		r = &runs[--nruns];
+		if (r->offset != NOWHERE)
+		{
+			p = from + r->pos + r->offset;
+			if ((c->nctrl == 0) && (p != oldpos) && (ctrlpush(c, 0, 0, 0) != 0))
+				goto done;
+			if (c->nctrl > 0)
+				c->ctrl[c->nctrl - 1][2] = p - oldpos;
+			if (ctrlpush(c, r->len, 0, 0) != 0)
+				goto done;
+			oldpos = p + r->len;
+		}
+		else
+		{
+			if ((c->nctrl == 0) && (ctrlpush(c, 0, 0, 0) != 0))
+				goto done;
+			c->ctrl[c->nctrl - 1][1] += r->len;
+		};
+	};
+	c->endpos = oldpos;
+	c->error = 0;
+
+done:
+	free(cheapest);
+	free(flags);
+	free(runs);
+	free(cands);
+	free(log);
+	c->cpu += seconds(CLOCK_THREAD_CPUTIME_ID) - cpu;
+}
+
+/* Writes the ctrl, diff and extra sections of chunks[k0..k1) at pos
+ * with codec[], len[] gets their lengths. The last seek of a chunk goes
+ * to where the next one starts in old. Returns 0, or -1 if a write
+ * failed. */
+static int writesections(const struct bsdiff_stream *out, off_t pos,
+						 const struct bsdiff_options *opt, const int codec[3],
+						 const uint8_t *old, const uint8_t *new,
+						 struct chunk *chunks, int k0, int k1,
+						 off_t len[3], struct bsdiff_stats *st)
+{
+	struct section uz;
+	struct bsdiff_time t;
+	off_t newpos, oldpos, i, z;
+	uint8_t cb[4096];
+	int k, n;
+
+	/* Write ctrl a batch of triples at a time */
+	timer_start(&t, CLOCK_THREAD_CPUTIME_ID);
+	if (sectionOpen(&uz, out, pos, codec[0], opt) != 0)
+		return -1;
+	for (n = 0, k = k0; k < k1; k++)
+	{
+		if (k + 1 < k1)
+			chunks[k].ctrl[chunks[k].nctrl - 1][2] =
+				chunks[k + 1].startpos - chunks[k].endpos;
+
+		for (i = 0; i < chunks[k].nctrl; i++)
+		{
+			if (n > (int)sizeof(cb) - 30)
+			{
+				sectionWrite(&uz, cb, n);
+				st->raw[0] += n;
+				n = 0;
+			};
+			z = chunks[k].ctrl[i][2];
+			n += varintout(chunks[k].ctrl[i][0], cb + n);
+			n += varintout(chunks[k].ctrl[i][1], cb + n);
+			n += varintout((z < 0) ? ((uint64_t)-z << 1) - 1 : (uint64_t)z << 1, cb + n);
+		};
+	};
+	sectionWrite(&uz, cb, n);
+	st->raw[0] += n;
+	if (sectionClose(&uz) != 0)
+		return -1;
+	len[0] = uz.pos - pos;
+	timer_stop(&t, CLOCK_THREAD_CPUTIME_ID);
+	timer_add(&st->ctrl, &t);
+
+	/* Write compressed diff data, replaying ctrl the way bspatch does */
+	timer_start(&t, CLOCK_THREAD_CPUTIME_ID);
+	if (sectionOpen(&uz, out, pos + len[0], codec[1], opt) != 0)
+		return -1;
+	newpos = chunks[k0].from;
+	oldpos = chunks[k0].startpos;
+	for (k = k0; k < k1; k++)
+		for (i = 0; i < chunks[k].nctrl; i++)
+		{
+			sectionWriteDiff(&uz, old + oldpos, new + newpos, chunks[k].ctrl[i][0]);
+			newpos += chunks[k].ctrl[i][0] + chunks[k].ctrl[i][1];
+			oldpos += chunks[k].ctrl[i][0] + chunks[k].ctrl[i][2];
+		};
+	if (sectionClose(&uz) != 0)
+		return -1;
+	len[1] = uz.pos - pos - len[0];
+	timer_stop(&t, CLOCK_THREAD_CPUTIME_ID);
+	timer_add(&st->diff, &t);
+
+	/* Write compressed extra data */
+	timer_start(&t, CLOCK_THREAD_CPUTIME_ID);
+	if (sectionOpen(&uz, out, pos + len[0] + len[1], codec[2], opt) != 0)
+		return -1;
+	newpos = chunks[k0].from;
+	for (k = k0; k < k1; k++)
+		for (i = 0; i < chunks[k].nctrl; i++)
+		{
+			sectionWrite(&uz, new + newpos + chunks[k].ctrl[i][0], chunks[k].ctrl[i][1]);
+			newpos += chunks[k].ctrl[i][0] + chunks[k].ctrl[i][1];
+		};
+	if (sectionClose(&uz) != 0)
+		return -1;
+	len[2] = uz.pos - pos - len[0] - len[1];
+	timer_stop(&t, CLOCK_THREAD_CPUTIME_ID);
+	timer_add(&st->extra, &t);
+
+	for (k = 0; k < 3; k++)
+		st->packed[k] += len[k];
+
+	return 0;
+}
+
+int bsdiff_codec(const char *name)
+{
+	if (strcmp(name, "deflate") == 0)
+		return BSDIFF_DEFLATE;
+	if (strcmp(name, "stored") == 0)
+		return BSDIFF_STORED;
+	if (strcmp(name, "lzr") == 0)
+		return BSDIFF_LZR;
+	if (strcmp(name, "smallest") == 0)
+		return BSDIFF_SMALLEST;
+	if (strcmp(name, "fast") == 0)
+		return BSDIFF_FAST;
+
+	return -1;
+}
+
+static int nowrite(void *opaque, off_t pos, const void *buf, size_t len)
+{
+	(void)opaque;
+	(void)pos;
+	(void)buf;
+	(void)len;
+	return 0;
+}
+
+/* Compresses the sections of chunks with codec[] and throws the output
+ * away, each chunk on its own with an index. size[] gets how long they
+ * would be and the time this takes is added to st. Returns 0, or -1 if
+ * out of memory. */
+static int measure(const struct bsdiff_options *opt, const int codec[3],
+				   const uint8_t *old, const uint8_t *new, struct chunk *chunks, int nchunks,
+				   int step, off_t size[3], struct bsdiff_stats *st)
+{
+	static const struct bsdiff_stream null = {NULL, nowrite};
+	struct bsdiff_stats trial;
+	off_t len[3];
+	int i, k;
+
+	memset(&trial, 0, sizeof(trial));
+	for (i = 0; i < 3; i++)
+		size[i] = 0;
+	for (k = 0; k < nchunks; k += step)
+	{
+		if (writesections(&null, 0, opt, codec, old, new, chunks, k, k + step, len, &trial) != 0)
+			return -1;
+		for (i = 0; i < 3; i++)
+			size[i] += len[i];
+	};
+	timer_add(&st->ctrl, &trial.ctrl);
+	timer_add(&st->diff, &trial.diff);
+	timer_add(&st->extra, &trial.extra);
+
+	return 0;
+}
+
+/* Picks the codec of each section that opt leaves to bsdiff() by
+ * measuring the sections with every codec it may have. Returns 0, or
+ * -1 if out of memory. */
+static int pickcodecs(const struct bsdiff_options *opt, const uint8_t *old, const uint8_t *new,
+					  struct chunk *chunks, int nchunks, int step, int codec[3], struct bsdiff_stats *st)
+{
+	off_t size[3], best[3];
+	int c, i, n, want[3], try[3];
+
+	for (i = 0; i < 3; i++)
+	{
+		codec[i] = opt->codec[i];
+		best[i] = -1;
+	};
+
+	for (c = BSDIFF_DEFLATE; c <= BSDIFF_LZR; c++)
+	{
+		/* lzr is the slowest to decode, fast leaves it out. Sections
+			that are not tried are stored, which costs nothing. */
+		for (n = 0, i = 0; i < 3; i++)
+		{
+			want[i] = (opt->codec[i] == BSDIFF_SMALLEST) ||
+					  ((opt->codec[i] == BSDIFF_FAST) && (c != BSDIFF_LZR));
+			try[i] = want[i] ? c : BSDIFF_STORED;
+			n += want[i];
+		};
+		if (n == 0)
+			continue;
+
+		if (measure(opt, try, old, new, chunks, nchunks, step, size, st) != 0)
+			return -1;
+
+		for (i = 0; i < 3; i++)
+			if (want[i] && ((best[i] < 0) || (size[i] < best[i])))
+			{
+				best[i] = size[i];
+				codec[i] = c;
+			};
+	};
+
+	return 0;
+}
+
+/* Parses new again with optimal(), which costs each part of the patch
+ * at what it took in the greedy parse of chunks. Keeps whichever parse
+ * makes the smaller patch, with codec[] picked again for it, and puts
+ * the sizes of the greedy sections in st. Returns 0, or -1 if out of
+ * memory. */
+static int reparse(const struct bsdiff_options *opt, struct scan *sc, int nchunks, int step,
+				   int codec[3], struct bsdiff_stats *st)
+{
+	struct chunk *chunks = sc->chunks, *greedy;
+	off_t size[3], same, ndiff, nextra, triples, newpos, oldpos, i;
+	int k, try[3], ret;
+
+	if (measure(opt, codec, sc->old, sc->new, chunks, nchunks, step, st->greedy, st) != 0)
+		return -1;
+
+	/* Extra bytes and triples cost what they took on average in the
+		greedy parse, starting from a guess as a few of them say
+		little. A diff byte that is not 0 costs a literal and breaks up
+		a run of 0s, which is about two extra bytes, a triple as much
+		again in what it breaks up. */
+	same = ndiff = nextra = triples = 0;
+	for (k = 0; k < nchunks; k++)
+	{
+		newpos = chunks[k].from;
+		oldpos = chunks[k].startpos;
+		for (i = 0; i < chunks[k].nctrl; i++)
+		{
+			same += countmatch(sc->old + oldpos, sc->new + newpos, chunks[k].ctrl[i][0]);
+			ndiff += chunks[k].ctrl[i][0];
+			nextra += chunks[k].ctrl[i][1];
+			newpos += chunks[k].ctrl[i][0] + chunks[k].ctrl[i][1];
+			oldpos += chunks[k].ctrl[i][0] + chunks[k].ctrl[i][2];
+		};
+		triples += chunks[k].nctrl;
+	};
+	sc->cost.extra = (128 * st->greedy[2] + 128 * 1024) / (nextra + 1024);
+	sc->cost.triple = 2 * (128 * st->greedy[0] + 512 * 16) / (triples + 16);
+	sc->cost.seek = 16;
+	sc->cost.differ = 2 * sc->cost.extra;
+	sc->cost.same = MAX(1, (128 * st->greedy[1] - (ndiff - same) * sc->cost.differ) / (same + 1));
+
+	if ((greedy = malloc(nchunks * sizeof(*greedy))) == NULL)
+		return -1;
+	memcpy(greedy, chunks, nchunks * sizeof(*greedy));
+	for (k = 0; k < nchunks; k++)
+	{
+		chunks[k].ctrl = NULL;
+		chunks[k].nctrl = chunks[k].ctrlsize = 0;
+	};
+
+	st->scan.wall -= seconds(CLOCK_MONOTONIC);
+	parallel(opt->threads, nchunks, optimal, sc);
+	st->scan.wall += seconds(CLOCK_MONOTONIC);
+
+	ret = -1;
+	for (k = 0; (k < nchunks) && !chunks[k].error; k++)
+		;
+	if ((k == nchunks) &&
+		(pickcodecs(opt, sc->old, sc->new, chunks, nchunks, step, try, st) == 0) &&
+		(measure(opt, try, sc->old, sc->new, chunks, nchunks, step, size, st) == 0))
+		ret = 0;
+
+	/* Go back to the greedy parse if it is as small */
+	if ((ret != 0) ||
+		(size[0] + size[1] + size[2] >= st->greedy[0] + st->greedy[1] + st->greedy[2]))
+	{
+		for (k = 0; k < nchunks; k++)
+		{
+			free(chunks[k].ctrl);
+			chunks[k].ctrl = greedy[k].ctrl;
+			chunks[k].nctrl = greedy[k].nctrl;
+			chunks[k].ctrlsize = greedy[k].ctrlsize;
+			chunks[k].startpos = greedy[k].startpos;
+			chunks[k].endpos = greedy[k].endpos;
+		};
 	}
-	offtout(newsize - len, header + 20);
-
-	/* Write compressed extra data, write in chunks to 
-	 * keep the RAM usage of bspatch low */
-	uzWriteOpen(sf, df);
-	wrptr = 0, wrlen = 0;
-	for (i = 0; i < neb; i++)
-	{
-		while (eblen[i] > 0)
-		{
-			wrlen = MIN(eblen[i], BLOCK_SIZE);
-			savebyte = eb[wrptr + wrlen];
-			eb[wrptr + wrlen] = ~savebyte;
-			uzWrite(sf, df, &eb[wrptr], wrlen);
-			eb[wrptr + wrlen] = savebyte;
-			wrptr += wrlen;
-			eblen[i] -= wrlen;
+	else
+	{
+		for (k = 0; k < nchunks; k++)
+			free(greedy[k].ctrl);
+		for (i = 0; i < 3; i++)
+			codec[i] = try[i];
+	};
+	free(greedy);
+
+	return ret;
+}
+
+/* new is cut in chunks of at least chunksize that are scanned in
+ * parallel. Each cut can cost a few bytes of patch compared to a
+ * serial scan. The cuts depend on newsize and chunksize only, so the
+ * patch is the same on any number of threads. With an index, new is
+ * cut in chunks of indexchunk instead, each with sections of its own. */
+off_t bsdiff(const struct sufindex *ix, const uint8_t *old, off_t oldsize,
+			 const uint8_t *new, off_t newsize,
+			 const struct bsdiff_options *opt, const struct bsdiff_stream *out)
+{
+	int k, nchunks, step, ret, flags, codec[3];
+	off_t len[3], pos, i, indexchunk;
+	uint8_t header[HEADER_SIZE + 32], entry[INDEX_ENTRY];
+	int hdrlen;
+	struct chunk *chunks;
+	struct scan sc;
+	struct bsdiff_stats st;
+	const uint8_t *raw = new;
+	uint8_t *filtered = NULL;
+
+	memset(&st, 0, sizeof(st));
+
+	/* An index can not be patched in place, and codecs and the filter
+		have to be known */
+	if (((opt->indexchunk > 0) && (opt->lookbehind >= 0)) ||
+		(opt->codec[0] < 0) || (opt->codec[0] > BSDIFF_FAST) ||
+		(opt->codec[1] < 0) || (opt->codec[1] > BSDIFF_FAST) ||
+		(opt->codec[2] < 0) || (opt->codec[2] > BSDIFF_FAST) ||
+		(opt->filter < FILTER_NONE) || (opt->filter > FILTER_THUMB))
+	{
+		errno = EINVAL;
+		return -1;
+	};
+
+	/* new is diffed filtered, its CRCs are of it as it is */
+	if (opt->filter != FILTER_NONE)
+	{
+		if ((filtered = malloc(newsize + 1)) == NULL)
+			return -1;
+		memcpy(filtered, new, newsize);
+		filter_apply(opt->filter, 0, newsize, filtered, 0, newsize, 0, newsize);
+		new = filtered;
+	};
+
+	/* The chunks of an index start at a block of the filter, where
+		bspatch can start undoing it */
+	nchunks = 1;
+	indexchunk = opt->indexchunk;
+	if ((indexchunk > 0) && (opt->filter != FILTER_NONE))
+		indexchunk = (indexchunk + FILTER_BLOCK - 1) / FILTER_BLOCK * FILTER_BLOCK;
+	if (indexchunk > 0)
+		nchunks = MAX(1, (newsize + indexchunk - 1) / indexchunk);
+	else
+		nchunks = MAX(1, newsize / opt->chunksize);
+	if ((chunks = calloc(nchunks, sizeof(struct chunk))) == NULL)
+	{
+		free(filtered);
+		return -1;
+	};
+	for (k = 0; k < nchunks; k++)
+		if ((indexchunk > 0) && (opt->filter != FILTER_NONE))
+		{
+			chunks[k].from = MIN(k * indexchunk, newsize);
+			chunks[k].to = MIN((k + 1) * indexchunk, newsize);
 		}
+		else
+		{
+			chunks[k].from = newsize * k / nchunks;
+			chunks[k].to = newsize * (k + 1) / nchunks;
+		};
+
+	sc.ix = ix;
+	sc.old = old;
+	sc.new = new;
+	sc.oldsize = oldsize;
+	sc.chunks = chunks;
+	/* bspatch reads old back to the start of its block to undo the
+		filter, so in place the scan stays that much further ahead */
+	sc.inplace = (opt->lookbehind >= 0);
+	sc.lookbehind = opt->lookbehind - ((opt->filter != FILTER_NONE) ? FILTER_BLOCK : 0);
+	st.scan.wall = -seconds(CLOCK_MONOTONIC);
+	parallel(opt->threads, nchunks, scan, &sc);
+	st.scan.wall += seconds(CLOCK_MONOTONIC);
+
+	ret = -1;
+	for (k = 0; k < nchunks; k++)
+		if (chunks[k].error)
+		{
+			errno = ENOMEM;
+			goto done;
+		};
+
+	step = (opt->indexchunk > 0) ? 1 : nchunks;
+	if (pickcodecs(opt, old, new, chunks, nchunks, step, codec, &st) != 0)
+		goto done;
+	if (opt->optimal && (reparse(opt, &sc, nchunks, step, codec, &st) != 0))
+		goto done;
+
+	for (k = 0; k < nchunks; k++)
+	{
+		st.scan.cpu += chunks[k].cpu;
+		st.searches += chunks[k].searches;
+		st.probes += chunks[k].probes;
+		st.triples += chunks[k].nctrl;
+		for (i = 0; i < chunks[k].nctrl; i++)
+		{
+			st.raw[1] += chunks[k].ctrl[i][0];
+			st.raw[2] += chunks[k].ctrl[i][1];
+		};
+	};
+	for (k = 0; k < 3; k++)
+		st.codec[k] = codec[k];
+
+	/* Header is
+		0	12	 "JWE/BSDIFF42"
+		12	8	length of uzipped ctrl block
+		20	8	length of uzipped diff block
+		28	8	length of new file
+		36	8	window, how far back each block refers at most
+		44	8	flags
+		52	8	lookbehind, with FLAG_INPLACE only
+		??	4	CRC-32 of old file, with FLAG_CRC
+		??	4	CRC-32 of new file, with FLAG_CRC
+		??	8	number of chunks, with FLAG_INDEX
+		??	4	codecs of the ctrl, diff and extra blocks and a 0,
+				with FLAG_CODEC
+		??	4	filter and three 0s, with FLAG_FILTER */
+	/* File is
+		0	52..84	Header
+		??	??	ctrl block
+		??	??	diff block
+		??	??	extra block
+		each block compressed with its codec, deflate without
+		FLAG_CODEC. A deflate block is one gzip member, a deflate
+		stream with a gzip header and trailer, a stored one the bytes
+		as they are, and an lzr one an lzr stream, see lzr.h. Each ctrl
+		triple is three varints, the seek zigzag coded.
+		With FLAG_FILTER the blocks are of old and new filtered, see
+		filter.h, and the CRCs of them as they are.
+		With FLAG_INDEX the lengths in the header are 0, and the
+		header is followed by an entry per chunk of
+		0	8	where the chunk starts in new
+		8	8	where its ctrl starts reading old
+		16	8	position of its ctrl block in the patch
+		24	8	... of its diff block
+		32	8	... of its extra block
+		40	4	CRC-32 of the chunk of new
+		and the blocks of each chunk in turn. */
+
+	memcpy(header, "JWE/BSDIFF42", 12);
+	offtout(0, header + 12);
+	offtout(0, header + 20);
+	offtout(newsize, header + 28);
+	offtout(opt->window, header + 36);
+	hdrlen = HEADER_SIZE;
+	flags = FLAG_CRC | FLAG_VARINT;
+	if (opt->lookbehind >= 0)
+	{
+		flags |= FLAG_INPLACE;
+		offtout(opt->lookbehind, header + hdrlen);
+		hdrlen += 8;
+	};
+	le32out(ix->crc, header + hdrlen);
+	le32out(crc32_update(0, raw, newsize), header + hdrlen + 4);
+	hdrlen += 8;
+	if (opt->indexchunk > 0)
+	{
+		flags |= FLAG_INDEX;
+		offtout(nchunks, header + hdrlen);
+		hdrlen += 8;
+	};
+	if ((codec[0] != BSDIFF_DEFLATE) || (codec[1] != BSDIFF_DEFLATE) || (codec[2] != BSDIFF_DEFLATE))
+	{
+		flags |= FLAG_CODEC;
+		for (k = 0; k < 3; k++)
+			header[hdrlen + k] = codec[k];
+		header[hdrlen + 3] = 0;
+		hdrlen += 4;
+	};
+	if (opt->filter != FILTER_NONE)
+	{
+		flags |= FLAG_FILTER;
+		header[hdrlen] = opt->filter;
+		header[hdrlen + 1] = header[hdrlen + 2] = header[hdrlen + 3] = 0;
+		hdrlen += 4;
+	};
+	offtout(flags, header + 44);
+
+	if (out->write(out->opaque, 0, header, hdrlen) != 0)
+		goto done;
+
+	if (flags & FLAG_INDEX)
+	{
+		/* Each chunk after the index, which says where it is */
+		pos = hdrlen + (off_t)nchunks * INDEX_ENTRY;
+		for (k = 0; k < nchunks; k++)
+		{
+			if (writesections(out, pos, opt, codec, old, new, chunks, k, k + 1, len, &st) != 0)
+				goto done;
+			offtout(chunks[k].from, entry);
+			offtout(chunks[k].startpos, entry + 8);
+			offtout(pos, entry + 16);
+			offtout(pos + len[0], entry + 24);
+			offtout(pos + len[0] + len[1], entry + 32);
+			le32out(crc32_update(0, raw + chunks[k].from, chunks[k].to - chunks[k].from), entry + 40);
+			if (out->write(out->opaque, hdrlen + (off_t)k * INDEX_ENTRY, entry, INDEX_ENTRY) != 0)
+				goto done;
+			pos += len[0] + len[1] + len[2];
+		};
 	}
-	uzWriteClose(sf, df);
+	else
+	{
+		if (writesections(out, hdrlen, opt, codec, old, new, chunks, 0, nchunks, len, &st) != 0)
+			goto done;
+		pos = hdrlen + len[0] + len[1] + len[2];
+
+		/* Write the header again with the lengths */
+		offtout(len[0], header + 12);
+		offtout(len[1], header + 20);
+		if (out->write(out->opaque, 0, header, hdrlen) != 0)
+			goto done;
+	};
+
+	if (opt->stats != NULL)
+		*opt->stats = st;
+	ret = 0;
+
+done:
+	/* Free the memory we used */
+	for (k = 0; k < nchunks; k++)
+		free(chunks[k].ctrl);
+	free(chunks);
+	free(filtered);
 
-	/* Seek to the beginning, write the header, and close the file */
-	if (lseek(df, 0, SEEK_SET))
+	return (ret == 0) ? pos : -1;
+}
+
+#ifdef BSDIFF_EXECUTABLE
+
+#include <err.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define OPT_STATS 256 /* long options without a short one */
+#define OPT_HASH_BITS 257
+#define OPT_DICT 258
+
+/* An input file, mapped if possible and read into memory otherwise */
+struct input
+{
+	uint8_t *p;
+	off_t size;
+	int mapped;
+};
+
+/* Maps path read-only with the access pattern given as advice. Files
+ * that can not be mapped, such as empty ones, are read instead. */
+static void input_open(struct input *in, const char *path, int advice)
+{
+	int fd;
+	off_t len;
+	ssize_t n;
+	void *map;
+
+	if (((fd = open(path, O_RDONLY, 0)) < 0) ||
+		((in->size = lseek(fd, 0, SEEK_END)) == -1))
+		err(1, "%s", path);
+
+	map = MAP_FAILED;
+	if (in->size > 0)
+		map = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map != MAP_FAILED)
 	{
-		errx(1, "lseek\n");
+		madvise(map, in->size, advice);
+		madvise(map, in->size, MADV_WILLNEED);
+		in->p = map;
+		in->mapped = 1;
 	}
+	else
+	{
+		/* Allocate size+1 bytes instead of size bytes to ensure
+			that we never try to malloc(0) and get a NULL pointer */
+		if (((in->p = malloc(in->size + 1)) == NULL) ||
+			(lseek(fd, 0, SEEK_SET) != 0))
+			err(1, "%s", path);
+		for (len = 0; len < in->size; len += n)
+			if ((n = read(fd, in->p + len, in->size - len)) <= 0)
+				errx(1, "%s: short read\n", path);
+		in->mapped = 0;
+	};
+
+	if (close(fd) == -1)
+		err(1, "%s", path);
+}
+
+static void input_close(struct input *in)
+{
+	if (in->mapped)
+		munmap(in->p, in->size);
+	else
+		free(in->p);
+}
+
+static int file_write(void *opaque, off_t pos, const void *buf, size_t len)
+{
+	int fd = *(int *)opaque;
+	ssize_t n;
 
-	if (write(df, header, 36) != 36)
+	for (; len > 0; len -= n, pos += n, buf = (const uint8_t *)buf + n)
+		if ((n = pwrite(fd, buf, len, pos)) <= 0)
+			return -1;
+
+	return 0;
+}
+
+/* What --stats reports for each new file */
+struct filestats
+{
+	struct bsdiff_time load;
+	off_t newsize, patchsize;
+	struct bsdiff_stats diff;
+};
+
+/* What diff() works with, the same for all new files */
+struct batch
+{
+	const struct sufindex *ix;
+	uint8_t *old;
+	off_t oldsize;
+	char **files; /* newfile, patchfile pairs */
+	struct bsdiff_options opt;
+	struct filestats *stats; /* one per file, or NULL */
+};
+
+/* Diffs one new file against the sorted old file and writes the patch.
+ * Only reads old and ix, so several can run at the same time. */
+static void diff(const struct batch *b, int job)
+{
+	const char *newfile = b->files[2 * job], *patchfile = b->files[2 * job + 1];
+	struct filestats fs;
+	struct bsdiff_options opt = b->opt;
+	struct input in;
+	int df;
+	struct bsdiff_stream out = {&df, file_write};
+	off_t len;
+
+	/* new is scanned front to back */
+	timer_start(&fs.load, CLOCK_THREAD_CPUTIME_ID);
+	input_open(&in, newfile, MADV_SEQUENTIAL);
+	timer_stop(&fs.load, CLOCK_THREAD_CPUTIME_ID);
+	opt.stats = &fs.diff;
+
+	/* Create the patch file (destination file) */
+	if ((df = open(patchfile, O_CREAT | O_RDWR, 0666)) < 0)
 	{
-		errx(1, "write(%s)\n", argv[3]);
+		errx(1, "open(%s)\n", patchfile);
 	}
 
+	if ((len = bsdiff(b->ix, b->old, b->oldsize, in.p, in.size, &opt, &out)) < 0)
+		err(1, "%s", patchfile);
+
+	/* Cut off what is left of an earlier patch */
+	if (ftruncate(df, len) != 0)
+		err(1, "%s", patchfile);
+
 	if (close(df))
 	{
-		errx(1, "close(%s)\n", argv[3]);
+		errx(1, "close(%s)\n", patchfile);
 	}
 
+	fs.newsize = in.size;
+	fs.patchsize = len;
+	if (b->stats != NULL)
+		b->stats[job] = fs;
+
+	input_close(&in);
+}
+
+static void batch_job(void *arg, int job)
+{
+	diff(arg, job);
+}
+
+static void json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s != '\0'; s++)
+		if ((*s == '"') || (*s == '\\'))
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	fputc('"', f);
+}
+
+static void json_time(FILE *f, const char *name, const struct bsdiff_time *t)
+{
+	fprintf(f, "\"%s\": {\"wall\": %.6f, \"cpu\": %.6f}", name, t->wall, t->cpu);
+}
+
+/* Writes what --stats reports as JSON, to stdout for "-". algo is
+ * "cache" when the suffix array was not sorted but loaded. */
+static void write_stats(const char *path, char *argv[], int nfiles, off_t oldsize,
+						const char *algo, int cached, const struct bsdiff_time t[4],
+						const struct filestats *fs)
+{
+	static const char *sections[] = {"ctrl", "diff", "extra"};
+	static const char *codecs[] = {"deflate", "stored", "lzr"};
+	const struct bsdiff_time *st[3];
+	struct rusage ru;
+	FILE *f;
+	int i, k;
+
+	if ((f = (strcmp(path, "-") == 0) ? stdout : fopen(path, "w")) == NULL)
+		err(1, "%s", path);
+	getrusage(RUSAGE_SELF, &ru);
+
+	fprintf(f, "{\n  \"old\": ");
+	json_string(f, argv[0]);
+	fprintf(f, ",\n  \"oldsize\": %lld,\n  ", (long long)oldsize);
+	fprintf(f, "\"algorithm\": \"%s\",\n  \"cached\": %s,\n  ", algo, cached ? "true" : "false");
+	json_time(f, "total", &t[0]);
+	fprintf(f, ",\n  ");
+	json_time(f, "load", &t[1]);
+	fprintf(f, ",\n  ");
+	json_time(f, "sort", &t[2]);
+	fprintf(f, ",\n  ");
+	json_time(f, "index", &t[3]);
+	fprintf(f, ",\n  \"peak_rss_kb\": %ld,\n  \"files\": [", ru.ru_maxrss);
+
+	for (i = 0; i < nfiles; i++)
+	{
+		fprintf(f, "%s\n    {\"new\": ", (i > 0) ? "," : "");
+		json_string(f, argv[2 * i + 1]);
+		fprintf(f, ", \"patch\": ");
+		json_string(f, argv[2 * i + 2]);
+		fprintf(f, ", \"newsize\": %lld, \"patchsize\": %lld,\n     ",
+				(long long)fs[i].newsize, (long long)fs[i].patchsize);
+		json_time(f, "load", &fs[i].load);
+		fprintf(f, ", ");
+		json_time(f, "scan", &fs[i].diff.scan);
+		fprintf(f, ",\n     \"searches\": %llu, \"probes_per_search\": %.2f, \"triples\": %lld",
+				(unsigned long long)fs[i].diff.searches,
+				fs[i].diff.searches ? (double)fs[i].diff.probes / fs[i].diff.searches : 0.0,
+				(long long)fs[i].diff.triples);
+		st[0] = &fs[i].diff.ctrl;
+		st[1] = &fs[i].diff.diff;
+		st[2] = &fs[i].diff.extra;
+		for (k = 0; k < 3; k++)
+		{
+			fprintf(f, ",\n     \"%s\": {\"codec\": \"%s\", \"raw\": %lld, \"compressed\": %lld, ", sections[k],
+					codecs[fs[i].diff.codec[k]], (long long)fs[i].diff.raw[k], (long long)fs[i].diff.packed[k]);
+			json_time(f, "time", st[k]);
+			if (fs[i].diff.greedy[0] + fs[i].diff.greedy[1] + fs[i].diff.greedy[2] > 0)
+				fprintf(f, ", \"greedy\": %lld", (long long)fs[i].diff.greedy[k]);
+			fprintf(f, "}");
+		};
+		fprintf(f, "}");
+	};
+	fprintf(f, "\n  ]\n}\n");
+
+	if ((f != stdout) ? (fclose(f) != 0) : (fflush(f) != 0))
+		err(1, "%s", path);
+}
+
+static void usage(const char *prog)
+{
+	errx(1, "usage: %s [-a sais|qsufsort|parallel] [-j jobs] [-S chunksize] [-C cachedir] [-w window] [-i lookbehind] [-P chunksize] [-z codec[,codec,codec]] [-f thumb] [-O] [--hash-bits bits] [--dict bytes] [--stats file] oldfile newfile patchfile [newfile patchfile ...]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int nfiles;
+	struct input in;
+	uint8_t *old;
+	off_t oldsize;
+	struct sufarray I;
+	struct sufindex ix;
+	struct batch batch;
+	int ch, algo = -1, threads = 1;
+	long long chunksize = 8 << 20;
+	int window = WINDOW;
+	long long lookbehind = -1, indexchunk = 0;
+	int codec[3] = {BSDIFF_DEFLATE, BSDIFF_DEFLATE, BSDIFF_DEFLATE};
+	int hash_bits = 0, dict = 0, optimal = 0, filter = FILTER_NONE, k;
+	uint8_t *filtered = NULL;
+	uint32_t crc = 0;
+	char *name;
+	const char *prog = argv[0], *cachedir = NULL, *statsfile = NULL;
+	char cachepath[PATH_MAX];
+	uint64_t hash;
+	struct bsdiff_time t[4]; /* total, load, sort and index */
+	static const char *algos[] = {"qsufsort", "sais", "parallel"};
+	int cached = 0;
+	const struct option longopts[] = {
+		{"algorithm", required_argument, NULL, 'a'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"cache", required_argument, NULL, 'C'},
+		{"scan-chunk", required_argument, NULL, 'S'},
+		{"window", required_argument, NULL, 'w'},
+		{"in-place", required_argument, NULL, 'i'},
+		{"index", required_argument, NULL, 'P'},
+		{"codec", required_argument, NULL, 'z'},
+		{"optimal", no_argument, NULL, 'O'},
+		{"filter", required_argument, NULL, 'f'},
+		{"hash-bits", required_argument, NULL, OPT_HASH_BITS},
+		{"dict", required_argument, NULL, OPT_DICT},
+		{"stats", required_argument, NULL, OPT_STATS},
+		{NULL, 0, NULL, 0}};
+
+	timer_start(&t[0], CLOCK_PROCESS_CPUTIME_ID);
+
+	while ((ch = getopt_long(argc, argv, "a:j:C:S:w:i:P:z:Of:", longopts, NULL)) != -1)
+	{
+		switch (ch)
+		{
+		case 'a':
+			if ((algo = sufsort_algo(optarg)) < 0)
+				errx(1, "unknown algorithm: %s\n", optarg);
+			break;
+		case 'j':
+			if ((threads = atoi(optarg)) < 1)
+				errx(1, "invalid number of jobs: %s\n", optarg);
+			break;
+		case 'C':
+			cachedir = optarg;
+			break;
+		case 'S':
+			if ((chunksize = atoll(optarg)) < 1)
+				errx(1, "invalid chunk size: %s\n", optarg);
+			break;
+		case 'w':
+			if (((window = atoi(optarg)) < 1) || (window > MAX_WINDOW))
+				errx(1, "window must be 1 to %d bytes: %s\n", MAX_WINDOW, optarg);
+			break;
+		case 'i':
+			if ((lookbehind = atoll(optarg)) < 0)
+				errx(1, "invalid lookbehind: %s\n", optarg);
+			break;
+		case 'P':
+			if ((indexchunk = atoll(optarg)) < 1)
+				errx(1, "invalid chunk size: %s\n", optarg);
+			break;
+		case 'z':
+			/* One codec for all sections, or one each */
+			for (k = 0; (k < 3) && ((name = strsep(&optarg, ",")) != NULL); k++)
+				if ((codec[k] = bsdiff_codec(name)) < 0)
+					errx(1, "unknown codec: %s\n", name);
+			if ((optarg != NULL) || ((k != 1) && (k != 3)))
+				errx(1, "give one codec or three: %s\n", argv[optind - 1]);
+			if (k == 1)
+				codec[1] = codec[2] = codec[0];
+			break;
+		case 'O':
+			optimal = 1;
+			break;
+		case 'f':
+			if ((filter = filter_type(optarg)) < 0)
+				errx(1, "unknown filter: %s\n", optarg);
+			break;
+		case OPT_HASH_BITS:
+			if (((hash_bits = atoi(optarg)) < 8) || (hash_bits > 20))
+				errx(1, "hash bits must be 8 to 20: %s\n", optarg);
+			break;
+		case OPT_DICT:
+			if (((dict = atoi(optarg)) < 1) || (dict > MAX_WINDOW))
+				errx(1, "dict must be 1 to %d bytes: %s\n", MAX_WINDOW, optarg);
+			break;
+		case OPT_STATS:
+			statsfile = optarg;
+			break;
+		default:
+			usage(prog);
+		};
+	};
+	argc -= optind;
+	argv += optind;
+
+	if ((argc < 3) || (argc % 2 == 0))
+		usage(prog);
+	if ((indexchunk > 0) && (lookbehind >= 0))
+		errx(1, "-P and -i can not be combined\n");
+
+	/* Sort on all threads unless told otherwise */
+	if (algo < 0)
+		algo = (threads > 1) ? SUFSORT_PARALLEL : SUFSORT_SAIS;
+
+	/* old is sorted and searched all over, one mapping is shared by
+		every diff */
+	timer_start(&t[1], CLOCK_PROCESS_CPUTIME_ID);
+	input_open(&in, argv[0], MADV_RANDOM);
+	old = in.p;
+	oldsize = in.size;
+
+	/* With a filter a copy of old is filtered, and sorted and diffed
+		instead. The patch has the CRC of old as it is. */
+	if (filter != FILTER_NONE)
+	{
+		crc = crc32_update(0, old, oldsize);
+		if ((filtered = malloc(oldsize + 1)) == NULL)
+			err(1, NULL);
+		memcpy(filtered, old, oldsize);
+		filter_apply(filter, 0, oldsize, filtered, 0, oldsize, 0, oldsize);
+		old = filtered;
+	};
+	timer_stop(&t[1], CLOCK_PROCESS_CPUTIME_ID);
+
+	/* Reuse the suffix array of an old file seen before, the cache
+		file is named after the content hash */
+	timer_start(&t[2], CLOCK_PROCESS_CPUTIME_ID);
+	if (cachedir != NULL)
+	{
+		hash = sufarray_hash(old, oldsize);
+		if (snprintf(cachepath, sizeof(cachepath), "%s/%016llx.sa",
+					 cachedir, (unsigned long long)hash) >= (int)sizeof(cachepath))
+			errx(1, "%s: path too long\n", cachedir);
+	};
+
+	cached = (cachedir != NULL) && (sufarray_load(&I, cachepath, hash, oldsize) == 0);
+	if (!cached)
+	{
+		if (sufsort(&I, old, oldsize, algo, threads) != 0)
+			err(1, NULL);
+		if ((cachedir != NULL) && (sufarray_save(&I, cachepath, hash) != 0))
+			warn("%s", cachepath);
+	};
+
+	timer_stop(&t[2], CLOCK_PROCESS_CPUTIME_ID);
+
+	timer_start(&t[3], CLOCK_PROCESS_CPUTIME_ID);
+	if (sufindex_init(&ix, &I, old, oldsize) != 0)
+		err(1, NULL);
+	if (filter != FILTER_NONE)
+		ix.crc = crc;
+	timer_stop(&t[3], CLOCK_PROCESS_CPUTIME_ID);
+
+	/* Diff the new files, up to one per thread. Threads left over
+		split the scan of each file. */
+	nfiles = (argc - 1) / 2;
+	batch.ix = &ix;
+	batch.old = old;
+	batch.oldsize = oldsize;
+	batch.files = argv + 1;
+	batch.opt.threads = MAX(1, threads / MIN(threads, nfiles));
+	batch.opt.chunksize = chunksize;
+	batch.opt.window = window;
+	batch.opt.lookbehind = lookbehind;
+	batch.opt.indexchunk = indexchunk;
+	for (k = 0; k < 3; k++)
+		batch.opt.codec[k] = codec[k];
+	batch.opt.hash_bits = hash_bits;
+	batch.opt.dict = dict;
+	batch.opt.optimal = optimal;
+	batch.opt.filter = filter;
+	batch.stats = NULL;
+	if ((statsfile != NULL) && ((batch.stats = calloc(nfiles, sizeof(struct filestats))) == NULL))
+		err(1, NULL);
+	parallel(threads, nfiles, batch_job, &batch);
+
+	if (statsfile != NULL)
+	{
+		timer_stop(&t[0], CLOCK_PROCESS_CPUTIME_ID);
+		write_stats(statsfile, argv, nfiles, oldsize,
+					cached ? "cache" : algos[algo], cached, t, batch.stats);
+		free(batch.stats);
+	};
+
 	/* Free the memory we used */
-	free(db);
-	free(eb);
-	free(dblen);
-	free(eblen);
-	free(I);
-	free(old);
-	free(new);
+	sufindex_free(&ix);
+	sufarray_free(&I);
+	input_close(&in);
+	free(filtered);
 
 	return 0;
 }
+
+#endif /* BSDIFF_EXECUTABLE */
@@ -0,0 +1,119 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright      2018 Johan Westlund
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BSDIFF_H
+#define BSDIFF_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sufsort.h"
+
+/* The suffix array of an old file with the ranks where each one and
+ * two byte prefix starts. Built once per old file, it is only read by
+ * bsdiff(), which can run on several new files at the same time. */
+struct sufindex
+{
+	const struct sufarray *sa;
+	off_t *start; /* first rank of each prefix */
+	off_t last;	  /* rank of the one byte suffix */
+	uint32_t crc; /* of old */
+};
+
+/* Returns 0 on success, -1 if out of memory */
+int sufindex_init(struct sufindex *ix, const struct sufarray *sa,
+				  const uint8_t *old, off_t oldsize);
+
+void sufindex_free(struct sufindex *ix);
+
+/* Where the patch goes. It is written front to back, except for the
+ * header and the index, which are written again when the sizes of the
+ * sections are known. */
+struct bsdiff_stream
+{
+	void *opaque;
+
+	/* Writes len bytes of patch at pos, returns 0 or -1 on error */
+	int (*write)(void *opaque, off_t pos, const void *buf, size_t len);
+};
+
+/* Wall and CPU seconds */
+struct bsdiff_time
+{
+	double wall, cpu;
+};
+
+/* Where bsdiff() spent its time and what it wrote */
+struct bsdiff_stats
+{
+	struct bsdiff_time scan;			   /* CPU of all threads */
+	struct bsdiff_time ctrl, diff, extra; /* compressing each section */
+	uint64_t searches, probes;			   /* suffixes compared in all searches */
+	off_t triples;
+	off_t raw[3], packed[3]; /* bytes of ctrl, diff and extra */
+	int codec[3];			 /* ... and the codec each has */
+	off_t greedy[3];		 /* packed bytes of the greedy parse, with optimal */
+};
+
+/* Codecs of the sections of a patch, as its header records them */
+#define BSDIFF_DEFLATE 0 /* uzlib, fixed Huffman codes only */
+#define BSDIFF_STORED 1	 /* not compressed, no window in bspatch */
+#define BSDIFF_LZR 2	 /* lzr.h, smaller but slower to decode */
+/* ... or let bsdiff() try them on the section and keep */
+#define BSDIFF_SMALLEST 3 /* the one that gives the fewest bytes */
+#define BSDIFF_FAST 4	  /* ... of stored and deflate */
+
+/* Parses a codec name, returns -1 if unknown */
+int bsdiff_codec(const char *name);
+
+struct bsdiff_options
+{
+	int threads;	  /* to scan new with */
+	off_t chunksize;  /* least bytes of new per chunk scanned */
+	size_t window;	  /* how far back a section may refer, 1 to 32768 */
+	off_t lookbehind; /* for patching in place, or -1 */
+	off_t indexchunk; /* bytes of new per chunk of an index, or 0 for none.
+						 Not with lookbehind. */
+	struct bsdiff_stats *stats; /* filled in if not NULL */
+	int codec[3];	  /* of ctrl, diff and extra, 0 is deflate */
+	int hash_bits;	  /* of the deflate and lzr match finders, or 0 for
+						 12 to 16 by dict */
+	size_t dict;	  /* how far back they look, or 0 for window */
+	int optimal;	  /* parse new by what the patch costs rather than
+						 greedily, slower. Kept if it is smaller. */
+	int filter;		  /* FILTER_THUMB of filter.h, or 0 */
+};
+
+/* Diffs new against the old file of ix and writes the patch. Returns
+ * the size of the patch, or -1 if out of memory or a write failed.
+ * With a filter, old and ix are of old run through filter_apply()
+ * first, but ix->crc is of old as it is. new is filtered here. */
+off_t bsdiff(const struct sufindex *ix, const uint8_t *old, off_t oldsize,
+			 const uint8_t *new, off_t newsize,
+			 const struct bsdiff_options *opt, const struct bsdiff_stream *out);
+
+#endif /* BSDIFF_H */
@@ -25,17 +25,35 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-#include <err.h>
-#include <unistd.h>
-#include <fcntl.h>
+#include <sys/types.h>
 #include <stdint.h>
+#include <string.h>
 #include "uzlib.h"
+#include "crc32.h"
+#include "lzr.h"
+#include "filter.h"
+#include "bspatch.h"
 
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
-#define RAM_SIZE 512 // Actual RAM usage is RAM size x 4 (oldfile, newfile, patch)
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+#define MAX_WINDOW 32768
+#define MIN_BUFFER 32
+#define MAX_BUFFER (1 << 20)
+#define HEADER_SIZE 52
+#define FLAG_INPLACE 1
+#define FLAG_CRC 2
+#define FLAG_VARINT 4
+#define FLAG_INDEX 8
+#define FLAG_CODEC 16
+#define FLAG_FILTER 32
+#define CODEC_DEFLATE 0
+#define CODEC_STORED 1
+#define CODEC_LZR 2
+#define INDEX_ENTRY 44
+#define JOURNAL_ID 44
+
+/* Longest ctrl triple, three varints of up to 10 bytes */
+#define CTRL_MAX 30
 
 static off_t offtin(uint8_t *buf)
 {
@@ -63,231 +81,1570 @@ static off_t offtin(uint8_t *buf)
 	return y;
 }
 
-/* Reads compressed data until decompressed length */
-size_t uzRead(int fd, uint8_t *buffer, int length)
+/* Reads a LEB128 varint at *p, before end. Returns -1 if it does not
+ * end there or does not fit in 63 bits. */
+static int varintin(const uint8_t **p, const uint8_t *end, uint64_t *x)
 {
-	int i, ret = TINF_OK, rd_length = 0, dst_len = 0, src_len = 0;
-	struct uzlib_uncomp d;
+	int shift;
+
+	*x = 0;
+	for (shift = 0; (*p < end) && (shift < 63); shift += 7)
+	{
+		*x |= (uint64_t)(**p & 0x7F) << shift;
+		if (!(*(*p)++ & 0x80))
+			return (*x >> 63) ? -1 : 0;
+	};
 
-	uint8_t *src = (uint8_t *)malloc(RAM_SIZE);
-	
-	/* Read in more source from file */
-	if ((rd_length = read(fd, src, RAM_SIZE)) < 0)
-		err(1, "reading src");
-		
+	return -1;
+}
 
-	uzlib_uncompress_init(&d, NULL, 0);
-	d.source = src;
-    d.source_limit = src + RAM_SIZE - 4;
-    d.source_read_cb = NULL;
-	d.dest_start = d.dest = buffer;
-	d.dest_limit = d.dest + 1;
+static uint32_t le32in(const uint8_t *buf)
+{
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
 
-	do
+/* A section of the patch, read through its codec. The decoder state,
+ * the last window bytes of output, which deflate and lzr may refer
+ * back to, and the input read ahead are kept between reads. A stored
+ * section is read straight from the patch. The sections are read
+ * through the same read_patch, each from its own part. */
+struct section
+{
+	union
 	{
-		ret = uzlib_uncompress(&d);
-	} while (ret == TINF_OK);
+		struct uzlib_uncomp uz;
+		struct lzr_dec lz;
+	} d; /* first, the fill functions get a pointer to it */
+	int codec;
+	const struct bspatch_stream *io;
+	off_t pos, end; /* next byte to read and end of the section */
+	uint8_t *buf;	/* input */
+	size_t bufsize;
+	int error;		/* read_patch failed */
+	int done;		/* the end of the section has been reached */
+};
 
-	if (ret != TINF_DONE)
-		printf("Error during decompression 1: %d\n", ret);
+/* Reads the next buffer of input, returns its length or 0 at the end
+ * of the section or on error */
+static ssize_t fill(struct section *s)
+{
+	ssize_t n;
 
-	dst_len = d.dest - buffer;
-	src_len = d.source - src;
+	if (s->pos >= s->end)
+		return 0;
+	if ((n = s->io->read_patch(s->io->opaque, s->pos, s->buf, MIN(s->bufsize, (size_t)(s->end - s->pos)))) <= 0)
+	{
+		s->error = (n < 0);
+		return 0;
+	};
+	s->pos += n;
 
-	/* adjust file pointer */
-	int fp = lseek(fd, src_len - rd_length, SEEK_CUR);
+	return n;
+}
 
-	if (dst_len != length)
-	{
-		errx(1, "Length error: %i %i\n", dst_len, length);
-	}
+/* Refills the input of a decoder when it has used it up */
+static int uzFill(struct uzlib_uncomp *d)
+{
+	struct section *s = (struct section *)d;
+	ssize_t n;
 
-	free(src);
+	if ((n = fill(s)) == 0)
+		return -1;
+	d->source = s->buf + 1;
+	d->source_limit = s->buf + n;
 
-	return dst_len;
+	return s->buf[0];
 }
 
-/* Opens and validates compressed data */
-int uzReadOpen(int fd)
+static int lzrFill(struct lzr_dec *d)
 {
-	struct uzlib_uncomp d;
-	uint8_t header[10];
+	struct section *s = (struct section *)d;
+	ssize_t n;
 
-	/* Read header = 10 because FLG = 0 */
-	if (read(fd, header, 10) != 10)
+	if ((n = fill(s)) == 0)
 		return -1;
+	d->src = s->buf + 1;
+	d->src_end = s->buf + n;
+
+	return s->buf[0];
+}
+
+/* Reads a section until decompressed length, or less at its end. *n
+ * is the length read. */
+static int sectionReadSome(struct section *s, uint8_t *buffer, size_t length, size_t *n)
+{
+	ssize_t r;
+	int ret;
 
-    uzlib_uncompress_init(&d, NULL, 0);
+	*n = 0;
+	if (s->done)
+		return BSPATCH_OK;
 
-    d.source = header;
-    d.source_limit = header + 10 - 4;
-    d.source_read_cb = NULL;
+	switch (s->codec)
+	{
+	case CODEC_DEFLATE:
+		s->d.uz.dest_start = s->d.uz.dest = buffer;
+		s->d.uz.dest_limit = buffer + length;
+		ret = uzlib_uncompress(&s->d.uz);
+		if (s->error)
+			return BSPATCH_EIO;
+		if ((ret != TINF_OK) && (ret != TINF_DONE))
+			return BSPATCH_ECORRUPT;
+		s->done = (ret == TINF_DONE);
+		*n = s->d.uz.dest - buffer;
+		break;
+	case CODEC_STORED:
+		length = MIN(length, (size_t)(s->end - s->pos));
+		for (; *n < length; *n += r, s->pos += r)
+		{
+			if ((r = s->io->read_patch(s->io->opaque, s->pos, buffer + *n, length - *n)) < 0)
+				return BSPATCH_EIO;
+			if (r == 0)
+				return BSPATCH_ECORRUPT;
+		};
+		s->done = (s->pos == s->end);
+		break;
+	case CODEC_LZR:
+		ret = lzr_decode(&s->d.lz, buffer, length, n);
+		if (s->error)
+			return BSPATCH_EIO;
+		if (ret != LZR_OK)
+			return BSPATCH_ECORRUPT;
+		s->done = (*n < length);
+		break;
+	};
 
-	return uzlib_gzip_parse_header(&d);
+	return BSPATCH_OK;
 }
 
-int main(int argc, char *argv[])
+/* Reads a section until decompressed length */
+static int sectionRead(struct section *s, uint8_t *buffer, size_t length)
 {
+	size_t n;
+	int ret;
 
-	int fd_old, fd_new, fd_patch;
-	int uzfctrl, uzfdata, uzfextra;
-	
-	ssize_t oldsize, newsize;
-	ssize_t uzctrllen, uzdatalen;
-	uint8_t header[36];
-	off_t oldpos, newpos;
-	off_t ctrl[3];
-	off_t lenread;
-	off_t i;
+	if ((ret = sectionReadSome(s, buffer, length, &n)) != BSPATCH_OK)
+		return ret;
 
-	uint8_t old[RAM_SIZE]; // TODO: malloc
-	uint8_t ctr[RAM_SIZE];
-	uint8_t diff[RAM_SIZE];
-	uint8_t extra[RAM_SIZE];
+	return (n == length) ? BSPATCH_OK : BSPATCH_ECORRUPT;
+}
 
-	uzlib_init();
+/* Sets up reading a section at pos..end of the patch with codec, dict
+ * holds the window, probs the model of lzr and buf the input */
+static void sectionInit(struct section *s, const struct bspatch_stream *io, int codec, off_t pos, off_t end,
+						uint8_t *dict, size_t window, uint16_t *probs, uint8_t *buf, size_t bufsize)
+{
+	if (codec == CODEC_DEFLATE)
+	{
+		uzlib_uncompress_init(&s->d.uz, dict, window);
+		s->d.uz.source = NULL;
+		s->d.uz.source_limit = NULL;
+		s->d.uz.source_read_cb = uzFill;
+	}
+	else if (codec == CODEC_LZR)
+	{
+		lzr_dec_init(&s->d.lz, probs, dict, window);
+		s->d.lz.fill = lzrFill;
+	};
 
-	if (argc != 4)
-		errx(1, "usage: %s oldfile newfile patchfile\n", argv[0]);
+	s->codec = codec;
+	s->io = io;
+	s->pos = pos;
+	s->end = end;
+	s->buf = buf;
+	s->bufsize = bufsize;
+	s->error = 0;
+	s->done = 0;
+}
 
-	/* Open patch file */
-	if ((fd_patch = open(argv[3], O_RDONLY)) < 0)
-		err(1, "%s", argv[3]);
+/* Reads and validates the start of a section, the gzip header of
+ * deflate */
+static int sectionStart(struct section *s)
+{
+	int ret;
+
+	if (s->codec == CODEC_STORED)
+		return BSPATCH_OK;
+	if (s->codec == CODEC_DEFLATE)
+		ret = (uzlib_gzip_parse_header(&s->d.uz) == TINF_OK) ? BSPATCH_OK : BSPATCH_ECORRUPT;
+	else
+		ret = (lzr_dec_start(&s->d.lz) == LZR_OK) ? BSPATCH_OK : BSPATCH_ECORRUPT;
+
+	return s->error ? BSPATCH_EIO : ret;
+}
+
+int bspatch_header(struct bspatch_header *h, const struct bspatch_stream *s, off_t patchsize)
+{
+	uint8_t header[HEADER_SIZE + 32];
+	off_t ctrllen, difflen, hdrlen, len, flags;
+	int i;
+	ssize_t n;
 
 	/*
 	 File format:
-	 0		12	"JWE/BSDIFF40"
+	 0		12	"JWE/BSDIFF42"
 	 12		8	X	sizeof control block
 	 20		8	Y	sizeof diff block
 	 28		8		sizeof newfile
-	 36		X	uzlib(control block)
-	 36+X	Y	uzlib(diff block)
-	 36+X+Y	?	uzlib(extra block)
-	 with control block a set of triples (x,y,z) meaning "add x bytes
+	 36		8	W	window
+	 44		8		flags
+	 52		8		lookbehind, with FLAG_INPLACE only
+	 ??		4		CRC-32 of oldfile, with FLAG_CRC
+	 ??		4		CRC-32 of newfile, with FLAG_CRC
+	 ??		8	N	number of chunks, with FLAG_INDEX
+	 ??		4		codecs of the blocks and a 0, with FLAG_CODEC
+	 ??		4		filter and three 0s, with FLAG_FILTER
+	 H		X	control block
+	 H+X	Y	diff block
+	 H+X+Y	?	extra block
+	 with each block compressed with its codec, deflate without
+	 FLAG_CODEC: one gzip header and one deflate stream, the bytes as
+	 they are for stored, or an lzr stream, which like deflate refers
+	 back at most W bytes, and
+	 the control block a set of triples (x,y,z) meaning "add x bytes
 	 from oldfile to x bytes from the diff block; copy y bytes from the
-	 extra block; seek forwards in oldfile by z bytes".
+	 extra block; seek forwards in oldfile by z bytes". With
+	 FLAG_VARINT each triple is three LEB128 varints, z zigzag coded
+	 ((z << 1) ^ (z >> 63)), without it three 8-byte offtout() values.
+	 H is 52, plus the fields of the flags. A deflate block may end in a
+	 gzip trailer, which is not read, the CRC of newfile covers it all.
+	 With FLAG_INDEX, X and Y are 0 and the header is followed by N
+	 entries of INDEX_ENTRY bytes, see readindex(), each chunk of
+	 newfile with its own blocks.
+	 With FLAG_FILTER, oldfile and newfile are patched as filter.h
+	 converts them, the CRCs are of them as they are.
 	 */
 
-	/* Read bsdiff header */
-	if (read(fd_patch, header, 36) < 36)
-		err(1, "read(%s)", argv[3]);
+	/* Read bsdiff header, and the fields of its flags */
+	hdrlen = HEADER_SIZE;
+	for (len = 0; len < hdrlen; len += n)
+	{
+		if ((n = s->read_patch(s->opaque, len, header + len, hdrlen - len)) < 0)
+			return BSPATCH_EIO;
+		if (n == 0)
+			return BSPATCH_ECORRUPT;
+		if ((len < HEADER_SIZE) && (len + n >= HEADER_SIZE))
+		{
+			flags = offtin(header + 44);
+			hdrlen += ((flags & FLAG_INPLACE) ? 8 : 0) + ((flags & FLAG_CRC) ? 8 : 0) +
+					  ((flags & FLAG_INDEX) ? 8 : 0) + ((flags & FLAG_CODEC) ? 4 : 0) +
+					  ((flags & FLAG_FILTER) ? 4 : 0);
+		};
+	};
 
 	/* Check for appropriate magic */
-	if (memcmp(header, "JWE/BSDIFF40", 12) != 0)
-		errx(1, "Corrupt patch\n");
+	if (memcmp(header, "JWE/BSDIFF42", 12) != 0)
+		return BSPATCH_ECORRUPT;
 
 	/* Read lengths from header */
-	uzctrllen = offtin(header + 12);
-	uzdatalen = offtin(header + 20);
-	newsize = offtin(header + 28);
+	ctrllen = offtin(header + 12);
+	difflen = offtin(header + 20);
+	h->newsize = offtin(header + 28);
+	h->window = offtin(header + 36);
+	h->flags = offtin(header + 44);
+	h->lookbehind = 0;
+	len = HEADER_SIZE;
+	if (h->flags & FLAG_INPLACE)
+	{
+		h->lookbehind = offtin(header + len);
+		len += 8;
+	};
+	h->oldcrc = h->newcrc = 0;
+	if (h->flags & FLAG_CRC)
+	{
+		h->oldcrc = le32in(header + len);
+		h->newcrc = le32in(header + len + 4);
+		len += 8;
+	};
+	h->chunks = 0;
+	if (h->flags & FLAG_INDEX)
+	{
+		h->chunks = offtin(header + len);
+		if ((h->chunks < 1) || (h->chunks > (patchsize - hdrlen) / INDEX_ENTRY) ||
+			(h->flags & FLAG_INPLACE))
+			return BSPATCH_ECORRUPT;
+		len += 8;
+	};
+	h->codec[0] = h->codec[1] = h->codec[2] = CODEC_DEFLATE;
+	if (h->flags & FLAG_CODEC)
+	{
+		for (i = 0; i < 3; i++)
+			if ((h->codec[i] = header[len + i]) > CODEC_LZR)
+				return BSPATCH_ECORRUPT;
+		if (header[len + 3] != 0)
+			return BSPATCH_ECORRUPT;
+		len += 4;
+	};
+	h->filter = FILTER_NONE;
+	if (h->flags & FLAG_FILTER)
+	{
+		if (((h->filter = header[len]) > FILTER_THUMB) ||
+			(header[len + 1] != 0) || (header[len + 2] != 0) || (header[len + 3] != 0))
+			return BSPATCH_ECORRUPT;
+		len += 4;
+	};
+	h->index = hdrlen;
+	hdrlen += h->chunks * INDEX_ENTRY;
 
-	if ((uzctrllen < 0) || (uzdatalen < 0) || (newsize < 0))
-		errx(1, "Corrupt patch\n");
+	if ((ctrllen < 0) || (difflen < 0) || (h->newsize < 0) ||
+		(hdrlen + ctrllen + difflen > patchsize) ||
+		(h->window < 1) || (h->window > MAX_WINDOW) ||
+		(h->flags & ~(FLAG_INPLACE | FLAG_CRC | FLAG_VARINT | FLAG_INDEX | FLAG_CODEC | FLAG_FILTER)) ||
+		(h->lookbehind < 0))
+		return BSPATCH_ECORRUPT;
 
-	/* Close patch file and re-open it with uzlib at the right places */
-	if (close(fd_patch))
-		err(1, "close(%s)", argv[3]);
+	h->ctrl = hdrlen;
+	h->diff = h->ctrl + ctrllen;
+	h->extra = h->diff + difflen;
+	h->end = patchsize;
 
-	if (((uzfctrl = open(argv[3], O_RDONLY)) < 0) || (lseek(uzfctrl, 36, SEEK_SET) != 36) || (uzReadOpen(uzfctrl) != TINF_OK))
-		err(1, "%s", argv[3]);
+	return BSPATCH_OK;
+}
 
-	if (((uzfdata = open(argv[3], O_RDONLY)) < 0) || (lseek(uzfdata, 36 + uzctrllen, SEEK_SET) != 36 + uzctrllen) || (uzReadOpen(uzfdata) != TINF_OK))
-		err(1, "%s", argv[3]);
+/* Bytes of work the decoders of the sections take, the model of each
+ * lzr section and the window of each but stored ones */
+static size_t decoders(const struct bspatch_header *h)
+{
+	size_t size = 0;
+	int i;
 
-	if (((uzfextra = open(argv[3], O_RDONLY)) < 0) || (lseek(uzfextra, 36 + uzctrllen + uzdatalen, SEEK_SET) != 36 + uzctrllen + uzdatalen) || (uzReadOpen(uzfextra) != TINF_OK))
-		err(1, "%s", argv[3]);
+	for (i = 0; i < 3; i++)
+		size += (h->codec[i] == CODEC_LZR) ? LZR_PROBS * sizeof(uint16_t) + h->window :
+				(h->codec[i] == CODEC_DEFLATE) ? (size_t)h->window : 0;
 
-	if (((fd_old = open(argv[1], O_RDONLY)) < 0) || ((oldsize = lseek(fd_old, 0, SEEK_END)) == -1) || (lseek(fd_old, 0, SEEK_SET) != 0))
-		err(1, "%s", argv[1]);
+	return size;
+}
 
-	if ((fd_new = open(argv[2], O_CREAT | O_RDWR, 0666)) < 0)
-		err(1, "%s", argv[2]);
+/* With a filter, the old buffer has room on either side for the
+ * windows at its ends, and the extra one before for the bytes of new
+ * held back */
+static size_t slack(const struct bspatch_header *h)
+{
+	return (h->filter != FILTER_NONE) ? 3 * FILTER_WIDTH : 0;
+}
+
+size_t bspatch_worksize(const struct bspatch_header *h, int inplace, size_t bufsize)
+{
+	bufsize = MIN(MAX(bufsize, MIN_BUFFER), MAX_BUFFER);
 
-	int64_t max_length = 0;
-	oldpos = 0;
-	newpos = 0;
+	return decoders(h) + (inplace ? h->lookbehind : 0) + slack(h) + 7 * bufsize;
+}
+
+/* The ctrl section is decoded a buffer at a time, *pos..*end of buf
+ * is what is left of it */
+static int readctrl(struct section *s, int flags, uint8_t *buf, size_t bufsize,
+					size_t *pos, size_t *end, off_t ctrl[3])
+{
+	const uint8_t *p;
+	uint64_t x;
+	size_t n;
+	int ret, i;
 
-	while (newpos < newsize)
+	/* Refill unless the next triple is surely in the buffer */
+	if (*end - *pos < CTRL_MAX)
 	{
-		/* Read control data */
-		if (uzRead(uzfctrl, ctr, 24) != 24)
-			errx(1, "Corrupt patch: 1\n");
+		memmove(buf, buf + *pos, *end - *pos);
+		*end -= *pos;
+		*pos = 0;
+		if ((ret = sectionReadSome(s, buf + *end, bufsize - *end, &n)) != BSPATCH_OK)
+			return ret;
+		*end += n;
+	};
+
+	p = buf + *pos;
+	if (!(flags & FLAG_VARINT))
+	{
+		if (*end - *pos < 24)
+			return BSPATCH_ECORRUPT;
 		for (i = 0; i < 3; i++)
+			ctrl[i] = offtin((uint8_t *)p + 8 * i);
+		*pos += 24;
+		return BSPATCH_OK;
+	};
+
+	/* Lengths, then the seek zigzag coded */
+	for (i = 0; i < 3; i++)
+	{
+		if (varintin(&p, buf + *end, &x) != 0)
+			return BSPATCH_ECORRUPT;
+		ctrl[i] = x;
+	};
+	ctrl[2] = (x & 1) ? -(off_t)(x >> 1) - 1 : (off_t)(x >> 1);
+	*pos = p - buf;
+
+	return BSPATCH_OK;
+}
+
+/* Patching in place writes new over old. The original bytes of the
+ * last lookbehind positions written are kept in a ring, the patch
+ * reads old no further behind newpos than that. Otherwise newpos is
+ * 0 and all of old is read with read_old. */
+static int readold(const struct bspatch_stream *s, off_t newpos, uint8_t *ring, off_t lookbehind,
+				   off_t pos, uint8_t *buf, off_t len)
+{
+	if (pos < newpos - lookbehind)
+		return BSPATCH_ECORRUPT;
+
+	for (; (len > 0) && (pos < newpos); len--)
+		*buf++ = ring[pos++ % lookbehind];
+
+	if ((len > 0) && (s->read_old(s->opaque, pos, buf, len) != 0))
+		return BSPATCH_EIO;
+
+	return BSPATCH_OK;
+}
+
+/* Saves what is left of old at newpos..newpos+len in the ring, before
+ * it is overwritten */
+static int saveold(const struct bspatch_stream *s, off_t oldsize, uint8_t *ring, off_t lookbehind,
+				   off_t newpos, off_t len)
+{
+	off_t pos, end, n;
+
+	end = MIN(newpos + len, oldsize);
+	for (pos = MAX(newpos, newpos + len - lookbehind); pos < end; pos += n)
+	{
+		n = MIN(end - pos, lookbehind - pos % lookbehind);
+		if (s->read_old(s->opaque, pos, ring + pos % lookbehind, n) != 0)
+			return BSPATCH_EIO;
+	};
+
+	return BSPATCH_OK;
+}
+
+/* What one run of apply() reads and writes */
+struct part
+{
+	off_t ctrl, diff, extra, end; /* the sections in the patch */
+	off_t oldpos;				  /* where ctrl starts reading old */
+	off_t newpos, newend;		  /* what it writes of new */
+};
+
+/* Reads the index entry of chunk k,
+	0	8	where the chunk starts in new
+	8	8	where its ctrl starts reading old
+	16	8	position of its ctrl block in the patch
+	24	8	... of its diff block
+	32	8	... of its extra block
+	40	4	CRC-32 of the chunk of new
+ * It ends where the next one starts, or at the end of new and the patch */
+static int readindex(const struct bspatch_stream *s, const struct bspatch_header *h, off_t k,
+					 struct part *p, uint32_t *crc)
+{
+	uint8_t entry[2 * INDEX_ENTRY];
+	off_t len, size;
+	ssize_t n;
+
+	size = (k + 1 < h->chunks) ? 2 * INDEX_ENTRY : INDEX_ENTRY;
+	for (len = 0; len < size; len += n)
+	{
+		if ((n = s->read_patch(s->opaque, h->index + k * INDEX_ENTRY + len, entry + len, size - len)) < 0)
+			return BSPATCH_EIO;
+		if (n == 0)
+			return BSPATCH_ECORRUPT;
+	};
+
+	p->newpos = offtin(entry);
+	p->oldpos = offtin(entry + 8);
+	p->ctrl = offtin(entry + 16);
+	p->diff = offtin(entry + 24);
+	p->extra = offtin(entry + 32);
+	*crc = le32in(entry + 40);
+	p->newend = (k + 1 < h->chunks) ? offtin(entry + INDEX_ENTRY) : h->newsize;
+	p->end = (k + 1 < h->chunks) ? offtin(entry + INDEX_ENTRY + 16) : h->end;
+
+	/* The chunks cover new, and their blocks are in order */
+	if (((k == 0) && (p->newpos != 0)) ||
+		(p->newpos < 0) || (p->newpos > p->newend) || (p->newend > h->newsize) ||
+		(p->ctrl < h->ctrl) || (p->ctrl > p->diff) || (p->diff > p->extra) ||
+		(p->extra > p->end) || (p->end > h->end))
+		return BSPATCH_ECORRUPT;
+
+	return BSPATCH_OK;
+}
+
+int bspatch_checkold(const struct bspatch_stream *s, const struct bspatch_header *h,
+					 off_t oldsize, void *work, size_t worksize)
+{
+	off_t pos, len;
+	uint32_t crc;
+
+	if (!(h->flags & FLAG_CRC))
+		return BSPATCH_OK;
+	if (worksize == 0)
+		return BSPATCH_ENOMEM;
+
+	for (crc = 0, pos = 0; pos < oldsize; pos += len)
+	{
+		len = MIN(oldsize - pos, (off_t)worksize);
+		if (s->read_old(s->opaque, pos, work, len) != 0)
+			return BSPATCH_EIO;
+		crc = crc32_update(crc, work, len);
+	};
+
+	return (crc == h->oldcrc) ? BSPATCH_OK : BSPATCH_EOLD;
+}
+
+/* Where apply() is. With the sections, the ctrl left in its buffer
+ * and the ring, this is all there is to a checkpoint. */
+struct state
+{
+	off_t k; /* chunk, 0 without an index */
+	off_t oldpos, newpos;
+	off_t ctrl[3]; /* what is left of the triple */
+	uint32_t crc;  /* of new so far, or of the chunk */
+};
+
+/* The buffers apply() takes from work */
+struct buffers
+{
+	struct section sec[3]; /* ctrl, diff and extra */
+	uint8_t *ring, *old, *diff, *extra, *ctr, *input;
+	size_t bufsize, ctrpos, ctrend;
+	off_t lookbehind;
+	int filter;
+	off_t oldnext, oldanchor;	/* where the last read of old ended and
+								   where the scan of the filter goes on */
+	uint8_t held[FILTER_WIDTH]; /* new not written yet, a window may */
+	size_t nheld;				/* start in it */
+};
+
+/* Reads old as the filter converts it. The scan of the filter goes on
+ * from the last read if this one follows it, or else starts over at
+ * the block of pos, with b->old to read through. buf has FILTER_WIDTH
+ * bytes of room on either side, for the windows at its ends. */
+static int readfiltered(const struct bspatch_stream *s, struct buffers *b, off_t oldsize,
+						off_t newpos, off_t pos, uint8_t *buf, off_t len)
+{
+	off_t from, end;
+	int ret;
+
+	if (b->filter == FILTER_NONE)
+		return readold(s, newpos, b->ring, b->lookbehind, pos, buf, len);
+
+	from = b->oldanchor;
+	if (pos != b->oldnext)
+		for (from = pos - pos % FILTER_BLOCK; from + FILTER_WIDTH <= pos;)
 		{
-			ctrl[i] = offtin(&ctr[i << 3]);
-		}
+			end = MIN(from + (off_t)b->bufsize, oldsize);
+			if ((ret = readold(s, newpos, b->ring, b->lookbehind, from, b->old, end - from)) != BSPATCH_OK)
+				return ret;
+			from = filter_apply(b->filter, 0, oldsize, b->old, from, end, from, pos);
+		};
+
+	end = MIN(pos + len + FILTER_WIDTH - 1, oldsize);
+	buf -= pos - from;
+	if ((ret = readold(s, newpos, b->ring, b->lookbehind, from, buf, end - from)) != BSPATCH_OK)
+		return ret;
+	b->oldanchor = filter_apply(b->filter, 0, oldsize, buf, from, end, from, pos + len);
+	b->oldnext = pos + len;
+
+	return BSPATCH_OK;
+}
+
+/* Writes len bytes of new at newpos and adds them to the CRC. With a
+ * filter, the bytes held back go first and buf has room for them
+ * before it. What may still be the start of a window is held back in
+ * turn, until size, where none is. */
+static int writenew(const struct bspatch_stream *s, struct buffers *b, off_t newpos, off_t size,
+					uint8_t *buf, off_t len, uint32_t *crc)
+{
+	off_t end = newpos + len;
+
+	if (b->filter != FILTER_NONE)
+	{
+		newpos -= b->nheld;
+		buf -= b->nheld;
+		memcpy(buf, b->held, b->nheld);
+		len = filter_apply(b->filter, 1, size, buf, newpos, end, newpos, end) - newpos;
+		if (end == size)
+			len = end - newpos;
+		b->nheld = end - newpos - len;
+		memcpy(b->held, buf + len, b->nheld);
+	};
+
+	if ((len > 0) && (s->write_new(s->opaque, newpos, buf, len) != 0))
+		return BSPATCH_EIO;
+	*crc = crc32_update(*crc, buf, len);
+
+	return BSPATCH_OK;
+}
+
+static void le32out(uint32_t x, uint8_t *buf)
+{
+	buf[0] = x;
+	buf[1] = x >> 8;
+	buf[2] = x >> 16;
+	buf[3] = x >> 24;
+}
+
+/* A checkpoint is written through a small buffer, and ends in the
+ * CRC-32 of what comes before it */
+struct jout
+{
+	const struct bspatch_journal *j;
+	off_t pos;
+	uint32_t crc;
+	size_t n;
+	int error;
+	uint8_t buf[64];
+};
+
+static void jflush(struct jout *o)
+{
+	if ((o->n > 0) && (o->j->write(o->j->opaque, o->pos, o->buf, o->n) != 0))
+		o->error = 1;
+	o->pos += o->n;
+	o->n = 0;
+}
+
+static void jput(struct jout *o, const void *buf, size_t len)
+{
+	o->crc = crc32_update(o->crc, buf, len);
+	if (o->n + len > sizeof(o->buf))
+		jflush(o);
+	if (len > sizeof(o->buf))
+	{
+		if (o->j->write(o->j->opaque, o->pos, buf, len) != 0)
+			o->error = 1;
+		o->pos += len;
+		return;
+	};
+	memcpy(o->buf + o->n, buf, len);
+	o->n += len;
+}
 
-		/* Sanity-check */
-		if (newpos + ctrl[0] > newsize)
-			errx(1, "Corrupt patch: 2\n");
+static void jput4(struct jout *o, uint32_t x)
+{
+	uint8_t buf[4];
+
+	le32out(x, buf);
+	jput(o, buf, 4);
+}
+
+static void jput8(struct jout *o, off_t x)
+{
+	jput4(o, (uint64_t)x);
+	jput4(o, (uint64_t)x >> 32);
+}
+
+/* Reads the journal. error is set if it fails or ends too soon. */
+struct jin
+{
+	const struct bspatch_journal *j;
+	off_t pos;
+	int error;
+};
+
+static void jget(struct jin *in, void *buf, size_t len)
+{
+	ssize_t n;
+
+	for (; (len > 0) && !in->error; len -= n, in->pos += n, buf = (uint8_t *)buf + n)
+		if ((n = in->j->read(in->j->opaque, in->pos, buf, len)) <= 0)
+			in->error = 1;
+}
+
+static uint32_t jget4(struct jin *in)
+{
+	uint8_t buf[4] = {0};
+
+	jget(in, buf, 4);
+	return le32in(buf);
+}
+
+static off_t jget8(struct jin *in)
+{
+	uint64_t x;
+
+	x = jget4(in);
+	return x | ((uint64_t)jget4(in) << 32);
+}
 
-		while (ctrl[0])
+/* Checks the CRC at the end of the journal. Returns 1 if it holds a
+ * whole checkpoint, 0 if it is empty or torn. */
+static int jcheck(const struct bspatch_journal *j, int *ret)
+{
+	uint8_t buf[68];
+	uint32_t crc = 0;
+	size_t n = 0;
+	off_t pos = 0;
+	ssize_t r;
+
+	while ((r = j->read(j->opaque, pos, buf + n, sizeof(buf) - n)) > 0)
+	{
+		pos += r;
+		n += r;
+		if (n > 4)
 		{
-			max_length = MIN(ctrl[0], RAM_SIZE);
+			crc = crc32_update(crc, buf, n - 4);
+			memmove(buf, buf + n - 4, 4);
+			n = 4;
+		};
+	};
+
+	*ret = (r < 0) ? BSPATCH_EIO : BSPATCH_OK;
+	return (r == 0) && (pos > 16) && (crc == le32in(buf));
+}
 
-			/* Read old data */
-			if (read(fd_old, old, max_length) != max_length)
-				err(1, "read");
+static void treeout(struct jout *o, const TINF_TREE *t)
+{
+	uint8_t buf[2 * 304];
+	int i;
 
-			/* Read diff string */
-			lenread = uzRead(uzfdata, diff, max_length);
-			if (lenread != max_length)
-			{
-				errx(1, "lenread: %li != max_length: %li\n", lenread, max_length);
-			}
+	for (i = 0; i < 16; i++)
+	{
+		buf[2 * i] = t->table[i];
+		buf[2 * i + 1] = t->table[i] >> 8;
+	};
+	for (i = 0; i < 288; i++)
+	{
+		buf[32 + 2 * i] = t->trans[i];
+		buf[32 + 2 * i + 1] = t->trans[i] >> 8;
+	};
+	jput(o, buf, sizeof(buf));
+}
 
-			/* Add old data to diff string */
-			for (i = 0; i < max_length; i++)
-				if ((oldpos + i >= 0) && (oldpos + i < oldsize))
-				{
-					old[i] += diff[i];
-				}
+static void treein(struct jin *in, TINF_TREE *t)
+{
+	uint8_t buf[2 * 304];
+	int i;
+
+	jget(in, buf, sizeof(buf));
+	for (i = 0; i < 16; i++)
+		t->table[i] = buf[2 * i] | (buf[2 * i + 1] << 8);
+	for (i = 0; i < 288; i++)
+		t->trans[i] = buf[32 + 2 * i] | (buf[32 + 2 * i + 1] << 8);
+}
 
-			/* Adjust pointers */
-			newpos += max_length;
-			oldpos += max_length;
+/* The decoder state of a section, its window and where in the patch
+ * it reads next. The input read ahead is read again. */
+static void uzSave(struct jout *o, const struct section *s)
+{
+	const struct uzlib_uncomp *d = &s->d.uz;
 
-			/* Adjust ctrl */
-			ctrl[0] -= max_length;
+	jput8(o, s->pos - (d->source_limit - d->source));
+	jput4(o, d->tag);
+	jput4(o, d->bitcount);
+	jput4(o, d->checksum);
+	jput4(o, d->checksum_type | (d->eof << 8) | (s->done << 16));
+	jput4(o, d->btype);
+	jput4(o, d->bfinal);
+	jput4(o, d->curlen);
+	jput4(o, d->lzOff);
+	jput4(o, d->dict_idx);
+	treeout(o, &d->ltree);
+	treeout(o, &d->dtree);
+	jput(o, d->dict_ring, d->dict_size);
+}
 
-			/* Write to new */
-			write(fd_new, old, max_length);
-		}
+static void uzRestore(struct jin *in, struct section *s, off_t start)
+{
+	struct uzlib_uncomp *d = &s->d.uz;
+	uint32_t x;
+
+	s->pos = jget8(in);
+	d->source = d->source_limit = NULL;
+	d->tag = jget4(in);
+	d->bitcount = jget4(in);
+	d->checksum = jget4(in);
+	x = jget4(in);
+	d->checksum_type = x;
+	d->eof = (x >> 8) & 1;
+	s->done = (x >> 16) & 1;
+	d->btype = jget4(in);
+	d->bfinal = jget4(in);
+	d->curlen = jget4(in);
+	d->lzOff = jget4(in);
+	d->dict_idx = jget4(in);
+	treein(in, &d->ltree);
+	treein(in, &d->dtree);
+	jget(in, d->dict_ring, d->dict_size);
 
-		/* Sanity-check */
-		if (newpos + ctrl[1] > newsize)
-			errx(1, "Corrupt patch: 4\n");
+	if ((s->pos < start) || (s->pos > s->end) || (d->bitcount > 32) ||
+		(d->dict_idx >= d->dict_size) ||
+		((d->curlen > 0) && ((d->lzOff < 0) || (d->lzOff >= (int)d->dict_size))))
+		in->error = 1;
+}
 
-		while (ctrl[1])
+static void lzrSave(struct jout *o, const struct section *s)
+{
+	const struct lzr_dec *d = &s->d.lz;
+	uint8_t buf[2 * 64];
+	int i, k;
+
+	jput8(o, s->pos - (d->src_end - d->src));
+	jput8(o, d->total);
+	jput4(o, d->range);
+	jput4(o, d->code);
+	jput4(o, d->state | (s->done << 8) | (d->done << 16));
+	jput4(o, d->rep0);
+	jput4(o, d->len);
+	jput4(o, d->idx);
+	for (i = 0; i < LZR_PROBS; i += k)
+	{
+		for (k = 0; (k < 64) && (i + k < LZR_PROBS); k++)
 		{
-			max_length = MIN(ctrl[1], RAM_SIZE);
+			buf[2 * k] = d->probs[i + k];
+			buf[2 * k + 1] = d->probs[i + k] >> 8;
+		};
+		jput(o, buf, 2 * k);
+	};
+	jput(o, d->ring, d->dict);
+}
 
-			/* Read extra string */
-			lenread = uzRead(uzfextra, extra, max_length);
-			if (lenread != max_length)
-				errx(1, "Corrupt patch: 5\n");
+static void lzrRestore(struct jin *in, struct section *s, off_t start)
+{
+	struct lzr_dec *d = &s->d.lz;
+	uint8_t buf[2 * 64];
+	uint32_t x;
+	int i, k;
 
-			/* Adjust pointers */
-			newpos += max_length;
+	s->pos = jget8(in);
+	d->src = d->src_end = NULL;
+	d->total = jget8(in);
+	d->range = jget4(in);
+	d->code = jget4(in);
+	x = jget4(in);
+	d->state = x & 0xFF;
+	s->done = (x >> 8) & 1;
+	d->done = (x >> 16) & 1;
+	d->rep0 = jget4(in);
+	d->len = jget4(in);
+	d->idx = jget4(in);
+	for (i = 0; i < LZR_PROBS; i += k)
+	{
+		k = MIN(64, LZR_PROBS - i);
+		jget(in, buf, 2 * k);
+		for (k = 0; (k < 64) && (i + k < LZR_PROBS); k++)
+			if ((d->probs[i + k] = buf[2 * k] | (buf[2 * k + 1] << 8)) >= 2048)
+				in->error = 1;
+	};
+	jget(in, d->ring, d->dict);
 
-			/* Adjust ctrl */
-			ctrl[1] -= max_length;
+	if ((s->pos < start) || (s->pos > s->end) || (d->state > 3) || (d->idx >= d->dict) ||
+		(d->rep0 > d->dict) || (d->rep0 > d->total) || ((d->len > 0) && (d->rep0 == 0)))
+		in->error = 1;
+}
 
-			/* Write to new */
-			write(fd_new, extra, max_length);
+/* Each codec saves what it needs, a stored section only where it is */
+static void sectionSave(struct jout *o, const struct section *s)
+{
+	if (s->codec == CODEC_DEFLATE)
+		uzSave(o, s);
+	else if (s->codec == CODEC_LZR)
+		lzrSave(o, s);
+	else
+	{
+		jput8(o, s->pos);
+		jput4(o, s->done);
+	};
+}
+
+static void sectionRestore(struct jin *in, struct section *s, off_t start)
+{
+	if (s->codec == CODEC_DEFLATE)
+		uzRestore(in, s, start);
+	else if (s->codec == CODEC_LZR)
+		lzrRestore(in, s, start);
+	else
+	{
+		s->pos = jget8(in);
+		s->done = jget4(in) & 1;
+		if ((s->pos < start) || (s->pos > s->end))
+			in->error = 1;
+	};
+}
+
+/* Checkpoint is
+	0	12	"JWE/JOURNAL1"
+	12	32	newsize, patch size, flags and CRCs of the patch it is for
+	44	52	struct state
+	96	?	each section, see sectionSave()
+	?	8+?	ctrl left in its buffer
+	?	4+?	with a filter, the bytes of new held back
+	?	?	in place, the ring, and the interval of old after newpos
+			that is overwritten before the next checkpoint
+	?	4	CRC-32 of it all */
+static void journalid(uint8_t id[JOURNAL_ID], const struct bspatch_header *h)
+{
+	memcpy(id, "JWE/JOURNAL1", 12);
+	le32out((uint64_t)h->newsize, id + 12);
+	le32out((uint64_t)h->newsize >> 32, id + 16);
+	le32out((uint64_t)h->end, id + 20);
+	le32out((uint64_t)h->end >> 32, id + 24);
+	le32out((uint64_t)h->flags, id + 28);
+	le32out((uint64_t)h->flags >> 32, id + 32);
+	le32out(h->oldcrc, id + 36);
+	le32out(h->newcrc, id + 40);
+}
+
+static int checkpoint(const struct bspatch_stream *s, const struct bspatch_header *h,
+					  const struct bspatch_journal *j, const struct state *st,
+					  struct buffers *b, off_t oldsize, int inplace)
+{
+	struct jout o;
+	uint8_t id[JOURNAL_ID];
+	off_t pos, end, len;
+	int i;
+
+	o.j = j;
+	o.pos = 0;
+	o.crc = 0;
+	o.n = 0;
+	o.error = 0;
+
+	journalid(id, h);
+	jput(&o, id, JOURNAL_ID);
+	jput8(&o, st->k);
+	jput8(&o, st->oldpos);
+	jput8(&o, st->newpos);
+	for (i = 0; i < 3; i++)
+		jput8(&o, st->ctrl[i]);
+	jput4(&o, st->crc);
+	for (i = 0; i < 3; i++)
+		sectionSave(&o, &b->sec[i]);
+	jput8(&o, b->ctrend - b->ctrpos);
+	jput(&o, b->ctr + b->ctrpos, b->ctrend - b->ctrpos);
+	if (b->filter != FILTER_NONE)
+	{
+		jput4(&o, b->nheld);
+		jput(&o, b->held, b->nheld);
+	};
+
+	if (inplace)
+	{
+		jput(&o, b->ring, b->lookbehind);
+		end = MIN(st->newpos + j->interval, oldsize);
+		jput8(&o, MAX(end - st->newpos, 0));
+		for (pos = st->newpos; pos < end; pos += len)
+		{
+			len = MIN(end - pos, (off_t)b->bufsize);
+			if (s->read_old(s->opaque, pos, b->old, len) != 0)
+				return BSPATCH_EIO;
+			jput(&o, b->old, len);
+		};
+	};
+
+	jput4(&o, o.crc);
+	jflush(&o);
+
+	if (o.error || (j->commit(j->opaque) != 0))
+		return BSPATCH_EIO;
+
+	return BSPATCH_OK;
+}
+
+/* Restores what checkpoint() saved after the state, and the old that
+ * was overwritten since */
+static int resume(const struct bspatch_stream *s, const struct part *p,
+				  struct jin *in, const struct state *st, struct buffers *b, off_t oldsize, int inplace)
+{
+	off_t start[3] = {p->ctrl, p->diff, p->extra};
+	off_t pos, end, len;
+	int i;
+
+	for (i = 0; i < 3; i++)
+		sectionRestore(in, &b->sec[i], start[i]);
+	b->ctrpos = 0;
+	if ((len = jget8(in)) < 0)
+		return BSPATCH_ECORRUPT;
+	if (len > (off_t)b->bufsize)
+		return BSPATCH_ENOMEM;
+	b->ctrend = len;
+	jget(in, b->ctr, b->ctrend);
+	if (b->filter != FILTER_NONE)
+	{
+		if (((b->nheld = jget4(in)) >= FILTER_WIDTH) || (b->nheld > (size_t)(st->newpos - p->newpos)))
+			return BSPATCH_ECORRUPT;
+		jget(in, b->held, b->nheld);
+	};
+
+	if (inplace)
+	{
+		jget(in, b->ring, b->lookbehind);
+		end = st->newpos + jget8(in);
+		if (in->error || (end < st->newpos) || (end > MAX(oldsize, st->newpos)))
+			return BSPATCH_ECORRUPT;
+		for (pos = st->newpos; pos < end; pos += len)
+		{
+			len = MIN(end - pos, (off_t)b->bufsize);
+			jget(in, b->old, len);
+			if (!in->error && (s->write_new(s->opaque, pos, b->old, len) != 0))
+				return BSPATCH_EIO;
+		};
+	};
+
+	return in->error ? BSPATCH_ECORRUPT : BSPATCH_OK;
+}
+
+/* Writes p->newpos..p->newend of new. With a journal a checkpoint is
+ * written every interval bytes, and in resumes from one. */
+static int apply(const struct bspatch_stream *s, const struct bspatch_header *h, const struct part *p,
+				 off_t oldsize, int inplace, const struct bspatch_journal *j, struct jin *in,
+				 struct state *st, void *work, size_t worksize)
+{
+	struct buffers b;
+	uint8_t *mem, *buf;
+	uint16_t *probs = work;
+	off_t window = h->window;
+	off_t start[4] = {p->ctrl, p->diff, p->extra, p->end};
+	off_t next, len, i;
+	int ret;
+
+	b.lookbehind = inplace ? h->lookbehind : 0;
+	b.filter = h->filter;
+
+	/* The decoders and the ring have to fit, the rest goes to the old,
+		diff, extra and ctrl buffers and the input of each section. The
+		models of lzr come first, they are 16 bits. */
+	if (worksize < bspatch_worksize(h, inplace, 0))
+		return BSPATCH_ENOMEM;
+	b.bufsize = MIN((worksize - decoders(h) - b.lookbehind - slack(h)) / 7, MAX_BUFFER);
+
+	for (mem = work, i = 0; i < 3; i++)
+		if (h->codec[i] == CODEC_LZR)
+			mem += LZR_PROBS * sizeof(uint16_t);
+	b.ring = (uint8_t *)work + decoders(h);
+	b.old = b.ring + b.lookbehind + slack(h) / 3;
+	b.diff = b.old + b.bufsize + slack(h) / 3;
+	b.extra = b.diff + b.bufsize + slack(h) / 3;
+	b.ctr = b.extra + b.bufsize;
+	b.input = b.ctr + b.bufsize;
+
+	uzlib_init();
+	b.oldnext = -1;
+	b.oldanchor = 0;
+	b.nheld = 0;
+
+	for (i = 0; i < 3; i++)
+	{
+		sectionInit(&b.sec[i], s, h->codec[i], start[i], start[i + 1], mem, window, probs,
+					b.input + i * b.bufsize, b.bufsize);
+		if (h->codec[i] == CODEC_LZR)
+			probs += LZR_PROBS;
+		if (h->codec[i] != CODEC_STORED)
+			mem += window;
+	};
+
+	if (in != NULL)
+	{
+		if ((ret = resume(s, p, in, st, &b, oldsize, inplace)) != BSPATCH_OK)
+			return ret;
+		next = st->newpos + MAX(j->interval, 1);
+	}
+	else
+	{
+		for (i = 0; i < 3; i++)
+			if ((ret = sectionStart(&b.sec[i])) != BSPATCH_OK)
+				return ret;
+		b.ctrpos = b.ctrend = 0;
+		st->oldpos = p->oldpos;
+		st->newpos = p->newpos;
+		st->ctrl[0] = st->ctrl[1] = st->ctrl[2] = 0;
+		st->crc = 0;
+		next = (j != NULL) ? st->newpos : p->newend;
+	};
+
+	while (st->newpos < p->newend)
+	{
+		/* Checkpoint before what is written next */
+		if (st->newpos >= next)
+		{
+			if ((ret = checkpoint(s, h, j, st, &b, oldsize, inplace)) != BSPATCH_OK)
+				return ret;
+			next = st->newpos + MAX(j->interval, 1);
+		};
+
+		if ((st->ctrl[0] == 0) && (st->ctrl[1] == 0))
+		{
+			/* Seek, and read control data */
+			st->oldpos += st->ctrl[2];
+			if ((ret = readctrl(&b.sec[0], h->flags, b.ctr, b.bufsize, &b.ctrpos, &b.ctrend, st->ctrl)) != BSPATCH_OK)
+				return ret;
+
+			/* Sanity-check */
+			if ((st->ctrl[0] < 0) || (st->ctrl[1] < 0) ||
+				(st->newpos + st->ctrl[0] + st->ctrl[1] > p->newend) ||
+				((st->ctrl[0] > 0) && ((st->oldpos < 0) || (st->oldpos + st->ctrl[0] > oldsize))))
+				return BSPATCH_ECORRUPT;
+			continue;
+		};
+
+		if (st->ctrl[0] > 0)
+		{
+			len = MIN(MIN(st->ctrl[0], (off_t)b.bufsize), next - st->newpos);
+
+			/* Read old data and diff string */
+			if (((ret = readfiltered(s, &b, oldsize, inplace ? st->newpos : 0,
+									 st->oldpos, b.old, len)) != BSPATCH_OK) ||
+				((ret = sectionRead(&b.sec[1], b.diff, len)) != BSPATCH_OK))
+				return ret;
+
+			/* Add old data to diff string */
+			for (i = 0; i < len; i++)
+				b.old[i] += b.diff[i];
+			buf = b.old;
+			st->oldpos += len;
+			st->ctrl[0] -= len;
 		}
+		else
+		{
+			len = MIN(MIN(st->ctrl[1], (off_t)b.bufsize), next - st->newpos);
+
+			/* Read extra string */
+			if ((ret = sectionRead(&b.sec[2], b.extra, len)) != BSPATCH_OK)
+				return ret;
+			buf = b.extra;
+			st->ctrl[1] -= len;
+		};
+
+		/* Write to new */
+		if (inplace && ((ret = saveold(s, oldsize, b.ring, b.lookbehind, st->newpos, len)) != BSPATCH_OK))
+			return ret;
+		if ((ret = writenew(s, &b, st->newpos, p->newend, buf, len, &st->crc)) != BSPATCH_OK)
+			return ret;
+		st->newpos += len;
+	};
+
+	/* And once all is written */
+	if (j != NULL)
+		return checkpoint(s, h, j, st, &b, oldsize, inplace);
+
+	return BSPATCH_OK;
+}
+
+int bspatch_chunk(const struct bspatch_stream *s, const struct bspatch_header *h, off_t k,
+				  off_t oldsize, void *work, size_t worksize)
+{
+	struct part p;
+	struct state st;
+	uint32_t crc;
+	int ret;
+
+	if ((k < 0) || (k >= h->chunks))
+		return BSPATCH_ECORRUPT;
+
+	if (((ret = readindex(s, h, k, &p, &crc)) != BSPATCH_OK) ||
+		((ret = apply(s, h, &p, oldsize, 0, NULL, NULL, &st, work, worksize)) != BSPATCH_OK))
+		return ret;
+
+	return (st.crc == crc) ? BSPATCH_OK : BSPATCH_ECRC;
+}
 
-		oldpos += ctrl[2];
+int bspatch_journaled(const struct bspatch_stream *s, const struct bspatch_header *h,
+					  off_t oldsize, int inplace, const struct bspatch_journal *j,
+					  void *work, size_t worksize)
+{
+	struct part p;
+	struct state st;
+	struct jin jin, *in = NULL;
+	uint8_t id[JOURNAL_ID], buf[JOURNAL_ID];
+	uint32_t crc;
+	int i, ret;
+
+	if (inplace && !(h->flags & FLAG_INPLACE))
+		return BSPATCH_EINPLACE;
+	if (worksize < bspatch_worksize(h, inplace, 0))
+		return BSPATCH_ENOMEM;
 
-		/* Adjust file pointer */
-		int off = lseek(fd_old, ctrl[2], SEEK_CUR);
+	/* Resume from the checkpoint if there is one for this patch */
+	if ((j != NULL) && jcheck(j, &ret))
+	{
+		journalid(id, h);
+		jin.j = j;
+		jin.pos = 0;
+		jin.error = 0;
+		jget(&jin, buf, JOURNAL_ID);
+		if (!jin.error && (memcmp(buf, id, JOURNAL_ID) == 0))
+		{
+			st.k = jget8(&jin);
+			st.oldpos = jget8(&jin);
+			st.newpos = jget8(&jin);
+			for (i = 0; i < 3; i++)
+				st.ctrl[i] = jget8(&jin);
+			st.crc = jget4(&jin);
+			if (jin.error || (st.k < 0) || (st.k >= MAX(h->chunks, 1)))
+				return BSPATCH_ECORRUPT;
+			in = &jin;
+		};
 	};
+	if ((j != NULL) && (ret != BSPATCH_OK))
+		return ret;
+
+	/* Check old before anything is written */
+	if ((in == NULL) && ((ret = bspatch_checkold(s, h, oldsize, work, worksize)) != BSPATCH_OK))
+		return ret;
+
+	/* With an index, one chunk after the other */
+	if (h->chunks > 0)
+	{
+		for (st.k = (in != NULL) ? st.k : 0; st.k < h->chunks; st.k++, in = NULL)
+		{
+			if (((ret = readindex(s, h, st.k, &p, &crc)) != BSPATCH_OK) ||
+				((ret = apply(s, h, &p, oldsize, 0, j, in, &st, work, worksize)) != BSPATCH_OK))
+				return ret;
+			if (st.crc != crc)
+				return BSPATCH_ECRC;
+		};
+		return BSPATCH_OK;
+	};
+
+	p.ctrl = h->ctrl;
+	p.diff = h->diff;
+	p.extra = h->extra;
+	p.end = h->end;
+	p.oldpos = 0;
+	p.newpos = 0;
+	p.newend = h->newsize;
+	st.k = 0;
+	if ((ret = apply(s, h, &p, oldsize, inplace, j, in, &st, work, worksize)) != BSPATCH_OK)
+		return ret;
+
+	if ((h->flags & FLAG_CRC) && (st.crc != h->newcrc))
+		return BSPATCH_ECRC;
+
+	return BSPATCH_OK;
+}
 
-	close(fd_new);
-	close(fd_old);
+int bspatch(const struct bspatch_stream *s, const struct bspatch_header *h,
+			off_t oldsize, int inplace, void *work, size_t worksize)
+{
+	return bspatch_journaled(s, h, oldsize, inplace, NULL, work, worksize);
+}
 
-	if (close(uzfctrl) || close(uzfdata) || close(uzfextra))
+#ifdef BSPATCH_EXECUTABLE
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INTERVAL (1 << 16)
+
+struct files
+{
+	int old, new, patch;
+	int journal, next; /* last checkpoint and the one being written, or -1 */
+	const char *path;  /* of the journal */
+	char tmp[PATH_MAX];
+};
+
+static ssize_t file_read_patch(void *opaque, off_t pos, void *buf, size_t len)
+{
+	struct files *f = opaque;
+
+	return pread(f->patch, buf, len, pos);
+}
+
+static int file_read_old(void *opaque, off_t pos, void *buf, size_t len)
+{
+	struct files *f = opaque;
+	ssize_t n;
+
+	for (; len > 0; len -= n, pos += n, buf = (uint8_t *)buf + n)
+		if ((n = pread(f->old, buf, len, pos)) <= 0)
+			return -1;
+
+	return 0;
+}
+
+static int file_write_new(void *opaque, off_t pos, const void *buf, size_t len)
+{
+	struct files *f = opaque;
+	ssize_t n;
+
+	for (; len > 0; len -= n, pos += n, buf = (const uint8_t *)buf + n)
+		if ((n = pwrite(f->new, buf, len, pos)) <= 0)
+			return -1;
+
+	return 0;
+}
+
+static ssize_t file_read_journal(void *opaque, off_t pos, void *buf, size_t len)
+{
+	struct files *f = opaque;
+
+	if (f->journal < 0)
+		return 0;
+
+	return pread(f->journal, buf, len, pos);
+}
+
+static int file_write_journal(void *opaque, off_t pos, const void *buf, size_t len)
+{
+	struct files *f = opaque;
+	ssize_t n;
+
+	if ((f->next < 0) && ((f->next = open(f->tmp, O_CREAT | O_TRUNC | O_RDWR, 0666)) < 0))
+		return -1;
+
+	for (; len > 0; len -= n, pos += n, buf = (const uint8_t *)buf + n)
+		if ((n = pwrite(f->next, buf, len, pos)) <= 0)
+			return -1;
+
+	return 0;
+}
+
+/* New is synced first, so the checkpoint is never ahead of it. The
+ * checkpoint then replaces the last one by a rename. */
+static int file_commit_journal(void *opaque)
+{
+	struct files *f = opaque;
+	char dir[PATH_MAX];
+	int fd;
+
+	if ((fsync(f->new) != 0) || (fsync(f->next) != 0) || (rename(f->tmp, f->path) != 0))
+		return -1;
+
+	snprintf(dir, sizeof(dir), "%s", f->path);
+	if ((fd = open(dirname(dir), O_RDONLY)) < 0)
+		return -1;
+	if (fsync(fd) != 0)
+	{
+		close(fd);
+		return -1;
+	};
+	close(fd);
+
+	if (f->journal >= 0)
+		close(f->journal);
+	f->journal = f->next;
+	f->next = -1;
+
+	return 0;
+}
+
+/* Chunks of an index are applied by up to jobs threads, each with its
+ * own part of work */
+struct chunks
+{
+	const struct bspatch_stream *s;
+	const struct bspatch_header *h;
+	off_t oldsize, next;
+	uint8_t *work;
+	size_t worksize;
+	int ret;
+	pthread_mutex_t lock;
+};
+
+static void *chunk_thread(void *arg)
+{
+	struct chunks *c = arg;
+	uint8_t *work;
+	off_t k;
+	int ret;
+
+	pthread_mutex_lock(&c->lock);
+	work = c->work;
+	c->work += c->worksize;
+	for (;;)
+	{
+		if ((c->ret != BSPATCH_OK) || (c->next >= c->h->chunks))
+			break;
+		k = c->next++;
+		pthread_mutex_unlock(&c->lock);
+
+		ret = bspatch_chunk(c->s, c->h, k, c->oldsize, work, c->worksize);
+
+		pthread_mutex_lock(&c->lock);
+		if (c->ret == BSPATCH_OK)
+			c->ret = ret;
+	};
+	pthread_mutex_unlock(&c->lock);
+
+	return NULL;
+}
+
+static int parallel(const struct bspatch_stream *s, const struct bspatch_header *h,
+					off_t oldsize, int jobs, void *work, size_t worksize)
+{
+	struct chunks c = {s, h, oldsize, 0, work, worksize, BSPATCH_OK, PTHREAD_MUTEX_INITIALIZER};
+	pthread_t *tids;
+	int t;
+
+	if ((c.ret = bspatch_checkold(s, h, oldsize, work, worksize)) != BSPATCH_OK)
+		return c.ret;
+
+	if ((tids = malloc(jobs * sizeof(pthread_t))) == NULL)
+		return BSPATCH_ENOMEM;
+	for (t = 1; t < jobs; t++)
+		if (pthread_create(&tids[t], NULL, chunk_thread, &c) != 0)
+			break;
+	chunk_thread(&c);
+	while (--t > 0)
+		pthread_join(tids[t], NULL);
+	free(tids);
+
+	return c.ret;
+}
+
+int main(int argc, char *argv[])
+{
+	struct files f = {-1, -1, -1, -1, -1, NULL, ""};
+	struct bspatch_stream s = {&f, file_read_patch, file_read_old, file_write_new};
+	struct bspatch_journal j = {&f, file_read_journal, file_write_journal, file_commit_journal, INTERVAL};
+	struct bspatch_header h;
+	struct stat sto, stn;
+	off_t oldsize, patchsize;
+	int inplace, jobs = 1, ret;
+	long long ram = 0;
+	size_t worksize;
+	void *work;
+	int ch;
+	const char *prog = argv[0];
+	const struct option longopts[] = {
+		{"ram", required_argument, NULL, 'm'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"journal", required_argument, NULL, 'J'},
+		{"interval", required_argument, NULL, 'c'},
+		{NULL, 0, NULL, 0}};
+
+	while ((ch = getopt_long(argc, argv, "m:j:J:c:", longopts, NULL)) != -1)
+	{
+		switch (ch)
+		{
+		case 'm':
+			if ((ram = atoll(optarg)) < 1)
+				errx(1, "invalid RAM size: %s\n", optarg);
+			break;
+		case 'j':
+			if ((jobs = atoi(optarg)) < 1)
+				errx(1, "invalid number of jobs: %s\n", optarg);
+			break;
+		case 'J':
+			f.path = optarg;
+			break;
+		case 'c':
+			if ((j.interval = atoll(optarg)) < 1)
+				errx(1, "invalid interval: %s\n", optarg);
+			break;
+		default:
+			errx(1, "usage: %s [-m ram] [-j jobs] [-J journal [-c interval]] oldfile newfile patchfile\n", prog);
+		};
+	};
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (argc != 4)
+		errx(1, "usage: %s [-m ram] [-j jobs] [-J journal [-c interval]] oldfile newfile patchfile\n", prog);
+
+	/* A checkpoint is written next to the journal, then renamed */
+	if (f.path != NULL)
+	{
+		if (snprintf(f.tmp, sizeof(f.tmp), "%s.tmp", f.path) >= (int)sizeof(f.tmp))
+			errx(1, "%s: name too long\n", f.path);
+		if (((f.journal = open(f.path, O_RDONLY)) < 0) && (errno != ENOENT))
+			err(1, "%s", f.path);
+	};
+
+	/* Open patch file and read its header */
+	if (((f.patch = open(argv[3], O_RDONLY)) < 0) ||
+		((patchsize = lseek(f.patch, 0, SEEK_END)) == -1))
+		err(1, "%s", argv[3]);
+
+	switch (bspatch_header(&h, &s, patchsize))
+	{
+	case BSPATCH_OK:
+		break;
+	case BSPATCH_EIO:
+		err(1, "read(%s)", argv[3]);
+	default:
+		errx(1, "Corrupt patch\n");
+	};
+
+	if (((f.old = open(argv[1], O_RDONLY)) < 0) || ((oldsize = lseek(f.old, 0, SEEK_END)) == -1))
+		err(1, "%s", argv[1]);
+
+	if ((f.new = open(argv[2], O_CREAT | O_RDWR, 0666)) < 0)
+		err(1, "%s", argv[2]);
+
+	/* Same file for old and new, patch in place */
+	if ((fstat(f.old, &sto) != 0) || (fstat(f.new, &stn) != 0))
+		err(1, "fstat");
+	inplace = (sto.st_dev == stn.st_dev) && (sto.st_ino == stn.st_ino);
+	if (inplace)
+	{
+		close(f.old);
+		f.old = f.new;
+	};
+
+	/* Only the chunks of an index can be applied in parallel, and
+		without a journal */
+	if (inplace || (h.chunks == 0) || (f.path != NULL))
+		jobs = 1;
+	else
+		jobs = MIN(jobs, h.chunks);
+
+	/* The RAM left after the windows goes to the buffers, split among
+		as many jobs as it has room for. Without a budget these are as
+		large as the window. */
+	worksize = bspatch_worksize(&h, inplace, h.window);
+	if (ram > 0)
+	{
+		if (ram < (long long)bspatch_worksize(&h, inplace, 0))
+			errx(1, "patch needs at least %lld bytes of RAM\n", (long long)bspatch_worksize(&h, inplace, 0));
+		jobs = MIN(jobs, ram / (long long)bspatch_worksize(&h, inplace, 0));
+		worksize = MIN((size_t)(ram / jobs), bspatch_worksize(&h, inplace, ram / jobs));
+	};
+
+	if ((work = malloc(worksize * jobs)) == NULL)
+		err(1, NULL);
+
+	if (jobs > 1)
+		ret = parallel(&s, &h, oldsize, jobs, work, worksize);
+	else
+		ret = bspatch_journaled(&s, &h, oldsize, inplace, (f.path != NULL) ? &j : NULL, work, worksize);
+
+	switch (ret)
+	{
+	case BSPATCH_OK:
+		break;
+	case BSPATCH_EIO:
+		err(1, "%s", argv[2]);
+	case BSPATCH_ENOMEM:
+		errx(1, "%s: needs more RAM to resume from\n", f.path);
+	case BSPATCH_EINPLACE:
+		errx(1, "%s: patch is not made for in-place patching\n", argv[3]);
+	case BSPATCH_EOLD:
+		errx(1, "%s: not the file %s was made from\n", argv[1], argv[3]);
+	case BSPATCH_ECRC:
+		errx(1, "%s: CRC does not match, the patch is corrupt\n", argv[2]);
+	default:
+		errx(1, "Corrupt patch\n");
+	};
+
+	/* Cut off what is left of old, or of an earlier newfile */
+	if (ftruncate(f.new, h.newsize) != 0)
+		err(1, "%s", argv[2]);
+
+	/* Done, nothing to resume. Until the journal is gone, resuming
+		from its last checkpoint only gets here again. */
+	if (f.path != NULL)
+	{
+		if (fsync(f.new) != 0)
+			err(1, "%s", argv[2]);
+		if (((unlink(f.path) != 0) && (errno != ENOENT)) || ((f.next >= 0) && (unlink(f.tmp) != 0)))
+			err(1, "%s", f.path);
+	};
+
+	if (!inplace)
+		close(f.old);
+	close(f.new);
+
+	if (close(f.patch))
 		err(1, "close(%s)", argv[3]);
 
+	free(work);
+
 	return 0;
 }
+
+#endif /* BSPATCH_EXECUTABLE */
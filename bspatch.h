@@ -0,0 +1,136 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright      2018 Johan Westlund
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BSPATCH_H
+#define BSPATCH_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Return values of bspatch_header() and bspatch() */
+#define BSPATCH_OK 0
+#define BSPATCH_ECORRUPT -1 /* not a patch, or a damaged one */
+#define BSPATCH_EIO -2		/* a callback failed */
+#define BSPATCH_ENOMEM -3	/* the work buffer is too small */
+#define BSPATCH_EINPLACE -4 /* patching in place with a patch not made for it */
+#define BSPATCH_EOLD -5		/* old is not what the patch was made from */
+#define BSPATCH_ECRC -6		/* new came out wrong, the patch is damaged */
+
+/* Where the patch, the old file and the new file are. The library does
+ * no I/O of its own, so these may go to files, flash or memory. */
+struct bspatch_stream
+{
+	void *opaque;
+
+	/* Reads up to len bytes of the patch at pos. Returns the bytes
+		read, fewer only at the end of the patch, or -1 on error. */
+	ssize_t (*read_patch)(void *opaque, off_t pos, void *buf, size_t len);
+
+	/* Reads len bytes of old at pos, returns 0 or -1 on error */
+	int (*read_old)(void *opaque, off_t pos, void *buf, size_t len);
+
+	/* Writes len bytes of new at pos, returns 0 or -1 on error. New is
+		written front to back. */
+	int (*write_new)(void *opaque, off_t pos, const void *buf, size_t len);
+};
+
+/* What the patch header says */
+struct bspatch_header
+{
+	off_t newsize;
+	off_t window;	  /* how far back each section refers */
+	off_t flags;
+	off_t lookbehind; /* bytes of old kept when patching in place */
+	uint32_t oldcrc, newcrc; /* CRC-32 of old and new, if flags say so */
+	off_t chunks, index; /* chunks in the index, 0 without one, and where it is */
+	int codec[3];		 /* of ctrl, diff and extra: 0 deflate, 1 stored, 2 lzr */
+	int filter;			 /* FILTER_THUMB of filter.h, or 0 */
+	off_t ctrl, diff, extra, end; /* where the sections are in the patch */
+};
+
+/* Reads and checks the header of a patch of patchsize bytes */
+int bspatch_header(struct bspatch_header *h, const struct bspatch_stream *s, off_t patchsize);
+
+/* Bytes of work buffer bspatch() needs to read bufsize bytes of each
+ * section and of old at a time. The least it can do with is
+ * bspatch_worksize(h, inplace, 0), more than
+ * bspatch_worksize(h, inplace, 1 << 20) is not used. Each section
+ * takes a window, but stored ones, and lzr ones 6 KB more. A filter
+ * takes a few bytes; old is then read from the start of a block of
+ * the filter where a read does not follow the last one. The buffer
+ * has to be aligned as malloc() aligns it. */
+size_t bspatch_worksize(const struct bspatch_header *h, int inplace, size_t bufsize);
+
+/* Applies the patch to old, oldsize bytes, and writes new. With inplace
+ * set, old and new are the same storage and read_old sees what
+ * write_new has written. If the patch has CRCs, old is read once and
+ * checked before anything is written, and new is checked as it is
+ * written. All memory is taken from work, nothing is allocated.
+ * Returns BSPATCH_OK or one of the errors above. */
+int bspatch(const struct bspatch_stream *s, const struct bspatch_header *h,
+			off_t oldsize, int inplace, void *work, size_t worksize);
+
+/* Where bspatch_journaled() keeps a checkpoint, to resume from after
+ * a power loss. A checkpoint is written with write from position 0 up,
+ * then made the one to resume from with commit, which has to replace
+ * the last one atomically, and make it and what was written of new
+ * durable, before it returns. read reads the last one committed, fewer
+ * bytes only at its end and none if there is none. All return -1 on
+ * error, write and commit 0 otherwise. */
+struct bspatch_journal
+{
+	void *opaque;
+	ssize_t (*read)(void *opaque, off_t pos, void *buf, size_t len);
+	int (*write)(void *opaque, off_t pos, const void *buf, size_t len);
+	int (*commit)(void *opaque);
+	off_t interval; /* bytes of new between checkpoints */
+};
+
+/* bspatch() that writes a checkpoint to j every interval bytes of new,
+ * and first resumes from the checkpoint j has for this patch, if any.
+ * Old is only checked when starting from the beginning. A checkpoint
+ * holds the state of the three sections with their windows and the
+ * ctrl read ahead, at most one buffer of it. In place it also holds
+ * the lookbehind and the next interval bytes of old, which are written
+ * back before resuming. */
+int bspatch_journaled(const struct bspatch_stream *s, const struct bspatch_header *h,
+					  off_t oldsize, int inplace, const struct bspatch_journal *j,
+					  void *work, size_t worksize);
+
+/* A patch with an index (h->chunks > 0) is cut in chunks that each
+ * write their own part of new. bspatch_chunk() applies chunk k, 0 to
+ * h->chunks - 1, and checks the part it wrote. The chunks may be
+ * applied in any order, or at the same time with a work buffer each,
+ * but not in place. bspatch_checkold() checks old against its CRC
+ * first, with work as the buffer to read it through. */
+int bspatch_checkold(const struct bspatch_stream *s, const struct bspatch_header *h,
+					 off_t oldsize, void *work, size_t worksize);
+int bspatch_chunk(const struct bspatch_stream *s, const struct bspatch_header *h, off_t k,
+				  off_t oldsize, void *work, size_t worksize);
+
+#endif /* BSPATCH_H */
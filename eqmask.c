@@ -0,0 +1,119 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright      2018 Johan Westlund
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define EQMASK_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define EQMASK_NEON
+#endif
+
+#include "eqmask.h"
+
+static uint64_t eqmask_scalar(const uint8_t *a, const uint8_t *b)
+{
+	uint64_t m = 0;
+	int i;
+
+	for (i = 0; i < 64; i++)
+		m |= (uint64_t)(a[i] == b[i]) << i;
+
+	return m;
+}
+
+#ifdef EQMASK_X86
+static uint64_t eqmask_sse2(const uint8_t *a, const uint8_t *b)
+{
+	uint64_t m = 0;
+	__m128i x, y;
+	int i;
+
+	for (i = 0; i < 64; i += 16)
+	{
+		x = _mm_loadu_si128((const __m128i *)(a + i));
+		y = _mm_loadu_si128((const __m128i *)(b + i));
+		m |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) << i;
+	};
+
+	return m;
+}
+
+__attribute__((target("avx2"))) static uint64_t eqmask_avx2(const uint8_t *a, const uint8_t *b)
+{
+	__m256i x0, y0, x1, y1;
+
+	x0 = _mm256_loadu_si256((const __m256i *)a);
+	y0 = _mm256_loadu_si256((const __m256i *)b);
+	x1 = _mm256_loadu_si256((const __m256i *)(a + 32));
+	y1 = _mm256_loadu_si256((const __m256i *)(b + 32));
+
+	return (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x0, y0)) |
+		   ((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x1, y1)) << 32);
+}
+#endif
+
+#ifdef EQMASK_NEON
+/* Weighs each byte of a compare with its bit and adds neighbours
+	pairwise until every byte holds the bits of eight */
+static uint64_t eqmask_neon(const uint8_t *a, const uint8_t *b)
+{
+	static const uint8_t w[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+								  1, 2, 4, 8, 16, 32, 64, 128};
+	uint8x16_t bits = vld1q_u8(w);
+	uint8x16_t c0, c1, c2, c3;
+
+	c0 = vandq_u8(vceqq_u8(vld1q_u8(a), vld1q_u8(b)), bits);
+	c1 = vandq_u8(vceqq_u8(vld1q_u8(a + 16), vld1q_u8(b + 16)), bits);
+	c2 = vandq_u8(vceqq_u8(vld1q_u8(a + 32), vld1q_u8(b + 32)), bits);
+	c3 = vandq_u8(vceqq_u8(vld1q_u8(a + 48), vld1q_u8(b + 48)), bits);
+
+	c0 = vpaddq_u8(c0, c1);
+	c2 = vpaddq_u8(c2, c3);
+	c0 = vpaddq_u8(c0, c2);
+	c0 = vpaddq_u8(c0, c0);
+
+	return vgetq_lane_u64(vreinterpretq_u64_u8(c0), 0);
+}
+#endif
+
+uint64_t (*eqmask)(const uint8_t *a, const uint8_t *b) = eqmask_scalar;
+
+void eqmask_init(void)
+{
+#if defined(EQMASK_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		eqmask = eqmask_avx2;
+	else
+		eqmask = eqmask_sse2;
+#elif defined(EQMASK_NEON)
+	eqmask = eqmask_neon;
+#endif
+}
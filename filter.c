@@ -0,0 +1,88 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright      2018 Johan Westlund
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "filter.h"
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+int filter_type(const char *name)
+{
+	if (strcmp(name, "none") == 0)
+		return FILTER_NONE;
+	if (strcmp(name, "thumb") == 0)
+		return FILTER_THUMB;
+
+	return -1;
+}
+
+/* A BL, its two halfwords with 22 bits of offset in halfwords, which
+ * counts from 4 bytes after it. The top bits of each stay. */
+static int thumb(int decode, uint8_t *b, off_t pos)
+{
+	uint32_t v;
+
+	if (((b[1] & 0xF8) != 0xF0) || ((b[3] & 0xF8) != 0xF8))
+		return 0;
+
+	v = (((b[1] & 7) << 19) | (b[0] << 11) | ((b[3] & 7) << 8) | b[2]) << 1;
+	v = decode ? v - (uint32_t)(pos + 4) : v + (uint32_t)(pos + 4);
+	v >>= 1;
+	b[1] = 0xF0 | ((v >> 19) & 7);
+	b[0] = v >> 11;
+	b[3] = 0xF8 | ((v >> 8) & 7);
+	b[2] = v;
+
+	return 1;
+}
+
+off_t filter_apply(int type, int decode, off_t size, uint8_t *buf, off_t pos, off_t end,
+				   off_t from, off_t limit)
+{
+	off_t i, last, step, block;
+
+	(void)type;
+	for (i = last = from; i < limit; last = i, i += step)
+	{
+		/* No window across a block or past the file */
+		block = MIN(i - i % FILTER_BLOCK + FILTER_BLOCK, size);
+		step = 2;
+		if (i + FILTER_WIDTH > block)
+			continue;
+		if (i + FILTER_WIDTH > end)
+			return i;
+		if (thumb(decode, buf + i - pos, i))
+			step = FILTER_WIDTH;
+	};
+
+	/* Past limit after a branch, or at the end of the file, where the
+		positions stepped over can not start a window */
+	if (i > limit)
+		return (limit < size) ? last : limit;
+
+	return i;
+}
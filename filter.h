@@ -0,0 +1,58 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright      2018 Johan Westlund
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/* Filters that make the relative branches of machine code absolute,
+ * so code that moved calls the same targets with the same bytes. A
+ * filter looks at a window of bytes at each aligned position, and
+ * when it holds a branch it converts the offset and goes on after it.
+ * Windows never cross a FILTER_BLOCK boundary, so a scan started at
+ * the start of any block finds the same branches as one from 0. */
+#define FILTER_NONE 0
+#define FILTER_THUMB 1 /* ARM Thumb BL */
+#define FILTER_BLOCK 1024
+#define FILTER_WIDTH 4 /* bytes of a window */
+
+/* Parses a filter name, returns -1 if unknown */
+int filter_type(const char *name);
+
+/* Converts the branches of a file of size bytes, encoding or with
+ * decode set the other way. buf holds pos..end of it. The scan starts
+ * at from, where an earlier scan stopped or the start of a block, and
+ * converts the windows that start before limit. Returns where the
+ * next scan starts: at a window that would end past end, or else at
+ * most limit and less than FILTER_WIDTH before it, and limit itself
+ * when that is size. All before it is converted. */
+off_t filter_apply(int type, int decode, off_t size, uint8_t *buf, off_t pos, off_t end,
+				   off_t from, off_t limit);
+
+#endif /* FILTER_H */
@@ -0,0 +1,636 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright      2018 Johan Westlund
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "lzr.h"
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+/* big is so much further back than small that one byte of match
+ * more is not worth it */
+#define FAR(small, big) (((big) >> 7) > (small))
+#define MIN_MATCH 2
+#define MAX_MATCH 273
+#define END_SLOT 63 /* the slot of the end marker */
+
+/* Where each model is in probs. state is what came before: 0 a
+ * literal, 1 a literal after a match, 2 a match, 3 a repeat of the
+ * last distance. */
+#define IS_MATCH 0	/* [state][position & 3] */
+#define IS_REP 16	/* [state] */
+#define LEN 20		/* lengths of matches, see putlen() */
+#define REP_LEN 294 /* ... and of repeats */
+#define SLOT 568	/* [length][slot], see putdist() */
+#define SPEC 824	/* low bits of distances below 128 */
+#define ALIGN 938	/* low 4 bits of longer ones */
+#define LIT 954		/* [top 3 bits of the byte before][tree] */
+
+#define PROB_INIT 1024
+#define LEN_BITS 4 /* about what a byte of match saves */
+
+static void initprobs(uint16_t *probs)
+{
+	int i;
+
+	for (i = 0; i < LZR_PROBS; i++)
+		probs[i] = PROB_INIT;
+}
+
+/* A distance less one is coded as a slot, its top two bits and how
+ * many follow, and then the rest of its bits */
+static unsigned slotof(uint32_t d)
+{
+	unsigned n;
+
+	if (d < 4)
+		return d;
+	for (n = 2; (d >> (n + 1)) != 0; n++)
+		;
+	return 2 * n + ((d >> (n - 1)) & 1);
+}
+
+static void flushout(struct lzr_enc *e)
+{
+	if (e->n > 0)
+		e->out(e->opaque, e->buf, e->n);
+	e->n = 0;
+}
+
+/* Range coder as in LZMA: low keeps a carry in bit 32, and a byte of
+ * 0xFF is held back in pending until it is known whether one comes */
+static void shiftlow(struct lzr_enc *e)
+{
+	uint8_t carry, b;
+
+	if (((uint32_t)e->low < 0xFF000000u) || ((e->low >> 32) != 0))
+	{
+		carry = e->low >> 32;
+		b = e->cache;
+		do
+		{
+			if (e->n == sizeof(e->buf))
+				flushout(e);
+			e->buf[e->n++] = b + carry;
+			b = 0xFF;
+		} while (--e->pending != 0);
+		e->cache = (e->low >> 24) & 0xFF;
+	};
+	e->pending++;
+	e->low = (e->low & 0x00FFFFFF) << 8;
+}
+
+static void putbit(struct lzr_enc *e, uint16_t *p, int bit)
+{
+	uint32_t bound = (e->range >> 11) * *p;
+
+	if (bit == 0)
+	{
+		e->range = bound;
+		*p += (2048 - *p) >> 5;
+	}
+	else
+	{
+		e->low += bound;
+		e->range -= bound;
+		*p -= *p >> 5;
+	};
+	while (e->range < (1u << 24))
+	{
+		e->range <<= 8;
+		shiftlow(e);
+	};
+}
+
+/* nbits of x with probability one half each */
+static void putdirect(struct lzr_enc *e, uint32_t x, int nbits)
+{
+	while (nbits-- > 0)
+	{
+		e->range >>= 1;
+		if ((x >> nbits) & 1)
+			e->low += e->range;
+		while (e->range < (1u << 24))
+		{
+			e->range <<= 8;
+			shiftlow(e);
+		};
+	};
+}
+
+/* nbits of x from the top, each in the context of those before */
+static void puttree(struct lzr_enc *e, uint16_t *p, int nbits, unsigned x)
+{
+	unsigned m = 1;
+	int bit;
+
+	while (nbits-- > 0)
+	{
+		bit = (x >> nbits) & 1;
+		putbit(e, p + m, bit);
+		m = (m << 1) | bit;
+	};
+}
+
+/* ... from the bottom */
+static void putreverse(struct lzr_enc *e, uint16_t *p, int nbits, unsigned x)
+{
+	unsigned m = 1;
+	int bit;
+
+	while (nbits-- > 0)
+	{
+		bit = x & 1;
+		x >>= 1;
+		putbit(e, p + m, bit);
+		m = (m << 1) | bit;
+	};
+}
+
+/* A length less two, 0 to 271, is a choice of 8 short, 8 middle or
+ * 256 long ones */
+static void putlen(struct lzr_enc *e, uint16_t *p, unsigned l)
+{
+	if (l < 8)
+	{
+		putbit(e, p, 0);
+		puttree(e, p + 2, 3, l);
+	}
+	else if (l < 16)
+	{
+		putbit(e, p, 1);
+		putbit(e, p + 1, 0);
+		puttree(e, p + 10, 3, l - 8);
+	}
+	else
+	{
+		putbit(e, p, 1);
+		putbit(e, p + 1, 1);
+		puttree(e, p + 18, 8, l - 16);
+	};
+}
+
+static void putdist(struct lzr_enc *e, unsigned len, uint32_t d, unsigned slot)
+{
+	uint32_t base;
+	int nbits;
+
+	puttree(e, e->probs + SLOT + (MIN(len - MIN_MATCH, 3) << 6), 6, slot);
+	if ((slot < 4) || (slot == END_SLOT))
+		return;
+
+	nbits = (slot >> 1) - 1;
+	base = (2 | (slot & 1)) << nbits;
+	if (slot < 14)
+		putreverse(e, e->probs + SPEC + base - slot - 1, nbits, d - base);
+	else
+	{
+		putdirect(e, (d - base) >> 4, nbits - 4);
+		putreverse(e, e->probs + ALIGN, 4, (d - base) & 15);
+	};
+}
+
+int lzr_enc_init(struct lzr_enc *e, size_t dict, int hash_bits, int depth,
+				 void (*out)(void *opaque, const uint8_t *buf, size_t len), void *opaque)
+{
+	uint32_t size;
+
+	dict = MIN(dict, LZR_MAX_DICT);
+	for (size = 1; size < dict; size <<= 1)
+		;
+	e->head = calloc((size_t)1 << hash_bits, sizeof(uint32_t));
+	e->chain = calloc(size, sizeof(uint32_t));
+	if ((e->head == NULL) || (e->chain == NULL))
+	{
+		free(e->head);
+		free(e->chain);
+		return -1;
+	};
+
+	e->out = out;
+	e->opaque = opaque;
+	e->dict = dict;
+	e->depth = depth;
+	e->hash_bits = hash_bits;
+	e->chainmask = size - 1;
+	e->pos = e->ins = 0;
+	e->low = 0;
+	e->pending = 1;
+	e->range = 0xFFFFFFFF;
+	e->cache = 0;
+	e->state = 0;
+	e->rep0 = 0;
+	e->n = 0;
+	initprobs(e->probs);
+
+	return 0;
+}
+
+static uint32_t hash(const struct lzr_enc *e, const uint8_t *p)
+{
+	return (((uint32_t)p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - e->hash_bits);
+}
+
+/* Enters the positions up to pos that have three bytes to hash.
+ * Positions are kept plus one, 0 is none. */
+static void insert(struct lzr_enc *e, const uint8_t *buf, uint64_t base, size_t end, uint64_t pos)
+{
+	uint32_t h;
+
+	for (; (e->ins < pos) && (e->ins - base + 3 <= end); e->ins++)
+	{
+		h = hash(e, buf + (e->ins - base));
+		e->chain[e->ins & e->chainmask] = e->head[h];
+		e->head[h] = (uint32_t)e->ins + 1;
+	};
+}
+
+static int bits(uint32_t d)
+{
+	int n;
+
+	for (n = 0; d != 0; n++)
+		d >>= 1;
+	return n;
+}
+
+static unsigned matchlen(const uint8_t *a, const uint8_t *b, unsigned limit)
+{
+	unsigned l;
+
+	for (l = 0; (l < limit) && (a[l] == b[l]); l++)
+		;
+	return l;
+}
+
+/* The longest match for buf[i..] at most avail bytes back and limit
+ * long, the positions before it entered. *dist is its distance. */
+static unsigned longest(const struct lzr_enc *e, const uint8_t *buf, size_t i, uint64_t pos,
+						unsigned limit, uint32_t avail, uint32_t *dist)
+{
+	uint32_t c, d, next;
+	unsigned best, l;
+	int tries;
+
+	best = 0;
+	c = e->head[hash(e, buf + i)];
+	for (tries = e->depth; (c != 0) && (tries > 0); tries--)
+	{
+		d = (uint32_t)pos - (c - 1);
+		if ((d == 0) || (d > avail))
+			break;
+		if (buf[i - d + best] == buf[i + best])
+		{
+			/* A match further back has to be longer by more than the
+				bits it costs to say where */
+			l = matchlen(buf + i - d, buf + i, limit);
+			if ((l > best) && ((best == 0) || ((int)(LEN_BITS * (l - best)) > bits(d) - bits(*dist))))
+			{
+				best = l;
+				*dist = d;
+				if (l == limit)
+					break;
+			};
+		};
+
+		/* Chains only go back, a slot reused by a newer position ends it */
+		next = e->chain[(c - 1) & e->chainmask];
+		if ((next == 0) || ((uint32_t)pos - (next - 1) <= d))
+			break;
+		c = next;
+	};
+
+	return best;
+}
+
+static void putliteral(struct lzr_enc *e, const uint8_t *buf, size_t i, uint64_t pos)
+{
+	uint8_t prev = (pos > 0) ? buf[i - 1] : 0;
+
+	putbit(e, e->probs + IS_MATCH + (e->state << 2) + (pos & 3), 0);
+	puttree(e, e->probs + LIT + ((prev >> 5) << 8), 8, buf[i]);
+	e->state = (e->state >= 2) ? 1 : 0;
+}
+
+/* Greedy, with one step of lazy evaluation as in the fast mode of
+ * LZMA. A repeat of the last distance is cheap and taken if it is
+ * about as long as the longest match. A match can not run past the end
+ * of buf. */
+void lzr_compress(struct lzr_enc *e, const uint8_t *buf, size_t hist, size_t len)
+{
+	uint64_t base, pos;
+	size_t i, end;
+	uint32_t avail, dist, dist2;
+	unsigned limit, ml, rl, ml2;
+	uint16_t *probs = e->probs;
+
+	end = hist + len;
+	base = e->pos - hist;
+	if (e->ins < base)
+		e->ins = base;
+
+	for (i = hist; i < end;)
+	{
+		pos = base + i;
+		insert(e, buf, base, end, pos);
+		limit = MIN(MAX_MATCH, end - i);
+		avail = MIN(e->dict, i);
+
+		ml = (limit >= 3) ? longest(e, buf, i, pos, limit, avail, &dist) : 0;
+		rl = ((e->rep0 > 0) && (e->rep0 <= avail)) ? matchlen(buf + i - e->rep0, buf + i, limit) : 0;
+
+		if ((rl >= MIN_MATCH) && ((rl + 1 >= ml) || ((rl + 2 >= ml) && (dist >= 512))))
+		{
+			putbit(e, probs + IS_MATCH + (e->state << 2) + (pos & 3), 1);
+			putbit(e, probs + IS_REP + e->state, 1);
+			putlen(e, probs + REP_LEN, rl - MIN_MATCH);
+			e->state = 3;
+			i += rl;
+			continue;
+		};
+
+		/* A short match far back costs more than its literals */
+		if ((ml < 3) || ((ml == 3) && (dist > 4096)))
+		{
+			putliteral(e, buf, i, pos);
+			i++;
+			continue;
+		};
+
+		/* Put the match off for a literal if the next position repeats
+			the last distance about as far, or has a longer match or one
+			as long and closer */
+		if ((ml < limit) && (i + 1 < end))
+		{
+			insert(e, buf, base, end, pos + 1);
+			limit = MIN(MAX_MATCH, end - i - 1);
+			avail = MIN(e->dict, i + 1);
+			rl = ((e->rep0 > 0) && (e->rep0 <= avail)) ? matchlen(buf + i + 1 - e->rep0, buf + i + 1, limit) : 0;
+			ml2 = (limit >= 3) ? longest(e, buf, i + 1, pos + 1, limit, avail, &dist2) : 0;
+			if ((rl >= MAX(ml - 1, MIN_MATCH)) || (ml2 > ml + 1) ||
+				((ml2 >= ml) && (dist2 < dist)) ||
+				((ml2 == ml + 1) && !FAR(dist, dist2)) ||
+				((ml2 + 1 >= ml) && FAR(dist2, dist)))
+			{
+				putliteral(e, buf, i, pos);
+				i++;
+				continue;
+			};
+		};
+
+		putbit(e, probs + IS_MATCH + (e->state << 2) + (pos & 3), 1);
+		putbit(e, probs + IS_REP + e->state, 0);
+		putlen(e, probs + LEN, ml - MIN_MATCH);
+		putdist(e, ml, dist - 1, slotof(dist - 1));
+		e->rep0 = dist;
+		e->state = 2;
+		i += ml;
+	};
+
+	e->pos += len;
+}
+
+void lzr_enc_finish(struct lzr_enc *e)
+{
+	int i;
+
+	putbit(e, e->probs + IS_MATCH + (e->state << 2) + (e->pos & 3), 1);
+	putbit(e, e->probs + IS_REP + e->state, 0);
+	putlen(e, e->probs + LEN, 0);
+	putdist(e, MIN_MATCH, 0, END_SLOT);
+	for (i = 0; i < 5; i++)
+		shiftlow(e);
+	flushout(e);
+
+	free(e->head);
+	free(e->chain);
+}
+
+void lzr_dec_init(struct lzr_dec *d, uint16_t *probs, uint8_t *ring, uint32_t dict)
+{
+	d->src = d->src_end = NULL;
+	d->probs = probs;
+	d->ring = ring;
+	d->dict = dict;
+	d->idx = 0;
+	d->total = 0;
+	d->range = 0xFFFFFFFF;
+	d->code = 0;
+	d->state = 0;
+	d->rep0 = 0;
+	d->len = 0;
+	d->eof = 0;
+	d->done = 0;
+	initprobs(probs);
+}
+
+static uint8_t getbyte(struct lzr_dec *d)
+{
+	int c;
+
+	if (d->src < d->src_end)
+		return *d->src++;
+	if ((c = d->fill(d)) < 0)
+	{
+		d->eof = 1;
+		return 0;
+	};
+	return c;
+}
+
+static int getbit(struct lzr_dec *d, uint16_t *p)
+{
+	uint32_t bound = (d->range >> 11) * *p;
+	int bit;
+
+	if (d->code < bound)
+	{
+		d->range = bound;
+		*p += (2048 - *p) >> 5;
+		bit = 0;
+	}
+	else
+	{
+		d->code -= bound;
+		d->range -= bound;
+		*p -= *p >> 5;
+		bit = 1;
+	};
+	if (d->range < (1u << 24))
+	{
+		d->range <<= 8;
+		d->code = (d->code << 8) | getbyte(d);
+	};
+	return bit;
+}
+
+static uint32_t getdirect(struct lzr_dec *d, int nbits)
+{
+	uint32_t x = 0;
+
+	while (nbits-- > 0)
+	{
+		d->range >>= 1;
+		x <<= 1;
+		if (d->code >= d->range)
+		{
+			d->code -= d->range;
+			x |= 1;
+		};
+		if (d->range < (1u << 24))
+		{
+			d->range <<= 8;
+			d->code = (d->code << 8) | getbyte(d);
+		};
+	};
+	return x;
+}
+
+static unsigned gettree(struct lzr_dec *d, uint16_t *p, int nbits)
+{
+	unsigned m = 1;
+	int i;
+
+	for (i = 0; i < nbits; i++)
+		m = (m << 1) | getbit(d, p + m);
+	return m - (1u << nbits);
+}
+
+static unsigned getreverse(struct lzr_dec *d, uint16_t *p, int nbits)
+{
+	unsigned m = 1, x = 0;
+	int i, bit;
+
+	for (i = 0; i < nbits; i++)
+	{
+		bit = getbit(d, p + m);
+		m = (m << 1) | bit;
+		x |= bit << i;
+	};
+	return x;
+}
+
+static unsigned getlen(struct lzr_dec *d, uint16_t *p)
+{
+	if (!getbit(d, p))
+		return gettree(d, p + 2, 3);
+	if (!getbit(d, p + 1))
+		return 8 + gettree(d, p + 10, 3);
+	return 16 + gettree(d, p + 18, 8);
+}
+
+int lzr_dec_start(struct lzr_dec *d)
+{
+	int i;
+
+	/* The coder starts with a 0 byte */
+	if (getbyte(d) != 0)
+		return LZR_ECORRUPT;
+	for (i = 0; i < 4; i++)
+		d->code = (d->code << 8) | getbyte(d);
+
+	return (d->eof || (d->code == d->range)) ? LZR_ECORRUPT : LZR_OK;
+}
+
+static void out(struct lzr_dec *d, uint8_t *dest, size_t *k, uint8_t b)
+{
+	dest[(*k)++] = b;
+	d->ring[d->idx] = b;
+	d->idx = (d->idx + 1 == d->dict) ? 0 : d->idx + 1;
+	d->total++;
+}
+
+int lzr_decode(struct lzr_dec *d, uint8_t *dest, size_t len, size_t *n)
+{
+	uint16_t *probs = d->probs;
+	uint32_t dist, base;
+	unsigned l, slot, nbits;
+	uint8_t prev;
+	size_t k = 0;
+
+	while ((k < len) && !d->eof)
+	{
+		/* The rest of a match */
+		if (d->len > 0)
+		{
+			for (; (d->len > 0) && (k < len); d->len--)
+				out(d, dest, &k, d->ring[(d->idx >= d->rep0) ? d->idx - d->rep0 : d->idx + d->dict - d->rep0]);
+			continue;
+		};
+		if (d->done)
+			break;
+
+		if (!getbit(d, probs + IS_MATCH + (d->state << 2) + (d->total & 3)))
+		{
+			prev = (d->total > 0) ? d->ring[(d->idx > 0) ? d->idx - 1 : d->dict - 1] : 0;
+			out(d, dest, &k, gettree(d, probs + LIT + ((prev >> 5) << 8), 8));
+			d->state = (d->state >= 2) ? 1 : 0;
+		}
+		else if (getbit(d, probs + IS_REP + d->state))
+		{
+			if (d->rep0 == 0)
+				return LZR_ECORRUPT;
+			d->len = getlen(d, probs + REP_LEN) + MIN_MATCH;
+			d->state = 3;
+		}
+		else
+		{
+			l = getlen(d, probs + LEN) + MIN_MATCH;
+			slot = gettree(d, probs + SLOT + (MIN(l - MIN_MATCH, 3) << 6), 6);
+			if (slot == END_SLOT)
+			{
+				d->done = 1;
+				continue;
+			};
+			if (slot >= 30)
+				return LZR_ECORRUPT;
+
+			dist = slot;
+			if (slot >= 4)
+			{
+				nbits = (slot >> 1) - 1;
+				base = (2 | (slot & 1)) << nbits;
+				if (slot < 14)
+					dist = base + getreverse(d, probs + SPEC + base - slot - 1, nbits);
+				else
+				{
+					dist = base + (getdirect(d, nbits - 4) << 4);
+					dist += getreverse(d, probs + ALIGN, 4);
+				};
+			};
+			dist++;
+			if ((dist > d->dict) || (dist > d->total))
+				return LZR_ECORRUPT;
+			d->rep0 = dist;
+			d->len = l;
+			d->state = 2;
+		};
+	};
+
+	*n = k;
+	return d->eof ? LZR_ECORRUPT : LZR_OK;
+}
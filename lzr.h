@@ -0,0 +1,107 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright      2018 Johan Westlund
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LZR_H
+#define LZR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* LZ77 with an adaptive binary range coder, in the manner of LZMA but
+ * smaller: one repeated distance, literals in the context of the top
+ * bits of the byte before, and matches of 2 to 273 bytes at most dict
+ * bytes back. The stream ends in an end marker. Both sides keep
+ * LZR_PROBS probabilities; the decoder also keeps dict bytes of
+ * output, and neither allocates once it is set up. */
+#define LZR_PROBS 3002
+#define LZR_MAX_DICT 32768
+
+/* Returned by lzr_decode() */
+#define LZR_OK 0
+#define LZR_ECORRUPT -1
+
+struct lzr_enc
+{
+	void (*out)(void *opaque, const uint8_t *buf, size_t len);
+	void *opaque;
+	size_t dict;
+	int depth;					  /* matches tried at each position */
+	uint32_t *head, *chain;		  /* positions by hash and the one before */
+	int hash_bits;
+	uint32_t chainmask;
+	uint64_t ins;				  /* next position to enter in them */
+	uint64_t pos;				  /* of the next byte in the stream */
+	uint64_t low, pending;		  /* range coder, bytes held for a carry */
+	uint32_t range;
+	uint8_t cache;
+	unsigned state, rep0;
+	uint16_t probs[LZR_PROBS];
+	size_t n;
+	uint8_t buf[4096]; /* output not passed to out() yet */
+};
+
+/* Sets up e to compress with matches at most dict bytes back, found
+ * through a table of 1 << hash_bits entries and depth tries. Output
+ * goes to out. Returns 0, or -1 if out of memory. */
+int lzr_enc_init(struct lzr_enc *e, size_t dict, int hash_bits, int depth,
+				 void (*out)(void *opaque, const uint8_t *buf, size_t len), void *opaque);
+
+/* Compresses buf[hist..hist+len), which follows buf[0..hist) in the
+ * stream. hist has to be all of the stream before it, or dict bytes
+ * of it. */
+void lzr_compress(struct lzr_enc *e, const uint8_t *buf, size_t hist, size_t len);
+
+/* Writes the end marker and the rest of the output, and frees e */
+void lzr_enc_finish(struct lzr_enc *e);
+
+struct lzr_dec
+{
+	/* Input, fill() is called when src reaches src_end and returns the
+		next byte, or -1 at the end of the input */
+	const uint8_t *src, *src_end;
+	int (*fill)(struct lzr_dec *d);
+	uint16_t *probs; /* LZR_PROBS */
+	uint8_t *ring;	 /* the last dict bytes of output */
+	uint32_t dict, idx;
+	uint64_t total; /* bytes of output */
+	uint32_t range, code;
+	unsigned state, rep0, len; /* len is what is left of a match */
+	int eof;				   /* fill() ran out */
+	int done;				   /* the end marker has been read */
+};
+
+/* Sets up d, with LZR_PROBS probabilities and dict bytes of ring */
+void lzr_dec_init(struct lzr_dec *d, uint16_t *probs, uint8_t *ring, uint32_t dict);
+
+/* Reads the start of the stream, returns LZR_OK or LZR_ECORRUPT */
+int lzr_dec_start(struct lzr_dec *d);
+
+/* Decodes up to len bytes to dest, fewer only at the end marker. *n is
+ * the bytes decoded. Returns LZR_OK or LZR_ECORRUPT. */
+int lzr_decode(struct lzr_dec *d, uint8_t *dest, size_t len, size_t *n);
+
+#endif /* LZR_H */
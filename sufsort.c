@@ -0,0 +1,324 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright      2018 Johan Westlund
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sufsort.h"
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+/* Parallel prefix doubling. Each round sorts every unsorted group by
+ * the group number of the suffix h bytes further on, like qsufsort(),
+ * but the new group numbers are only written to V once every group has
+ * been sorted. That way no thread reads a V entry that another thread
+ * is updating, and the groups can be handed out to threads freely.
+ * Groups are tracked in bitmaps rather than with negative lengths in I,
+ * so a thread can start in the middle of I. */
+#define PSORT_SLICES 16	 /* work slices per thread */
+#define PSORT_BIG 65536	 /* groups larger than this are shared */
+#define PSORT_KEYS 65792 /* 256 * 257 byte pair buckets */
+
+static void setbit(uint64_t *B, off_t i)
+{
+	__atomic_fetch_or(&B[i >> 6], (uint64_t)1 << (i & 63), __ATOMIC_RELAXED);
+}
+
+/* Returns the first set bit at or after i, or end if there is none */
+static off_t nextbit(const uint64_t *B, off_t i, off_t end)
+{
+	uint64_t w;
+
+	while (i < end)
+	{
+		if ((w = B[i >> 6] >> (i & 63)) != 0)
+			return MIN(i + __builtin_ctzll(w), end);
+		i = (i | 63) + 1;
+	};
+
+	return end;
+}
+
+static off_t pairkey(const uint8_t *old, off_t n, off_t i)
+{
+	return old[i] * 257 + ((i + 1 < n) ? old[i + 1] + 1 : 0);
+}
+
+/* 32-bit indices, for old files below 2 GiB */
+#define saidx_t int32_t
+#define SAFN(name) name##32
+#include "sufsort_impl.h"
+#undef saidx_t
+#undef SAFN
+
+/* 64-bit indices, only used while sorting larger files */
+#define saidx_t off_t
+#define SAFN(name) name##64
+#include "sufsort_impl.h"
+#undef saidx_t
+#undef SAFN
+
+/* Narrows a 64-bit suffix array to 40 bits in place */
+static void pack40(struct sufarray *sa)
+{
+	const off_t *I = sa->I;
+	uint8_t *p = sa->I;
+	off_t i, x;
+	void *q;
+
+	for (i = 0; i <= sa->n; i++)
+	{
+		x = I[i];
+		p[5 * i] = x;
+		p[5 * i + 1] = x >> 8;
+		p[5 * i + 2] = x >> 16;
+		p[5 * i + 3] = x >> 24;
+		p[5 * i + 4] = x >> 32;
+	};
+
+	if ((q = realloc(sa->I, 5 * (sa->n + 1))) != NULL)
+		sa->I = q;
+	sa->width = 5;
+}
+
+int sufsort(struct sufarray *sa, const uint8_t *old, off_t oldsize, int algo, int threads)
+{
+	sa->n = oldsize;
+	sa->map = NULL;
+	sa->maplen = 0;
+
+	if (oldsize < INT32_MAX)
+	{
+		sa->width = 4;
+		if ((sa->I = malloc((oldsize + 1) * sizeof(int32_t))) == NULL)
+			return -1;
+		if (sort32(sa->I, old, oldsize, algo, threads) == 0)
+			return 0;
+	}
+	else
+	{
+		sa->width = 8;
+		if ((sa->I = malloc((oldsize + 1) * sizeof(off_t))) == NULL)
+			return -1;
+		if (sort64(sa->I, old, oldsize, algo, threads) == 0)
+		{
+			pack40(sa);
+			return 0;
+		};
+	};
+
+	free(sa->I);
+	sa->I = NULL;
+
+	return -1;
+}
+
+void sufarray_free(struct sufarray *sa)
+{
+	if (sa->map != NULL)
+		munmap(sa->map, sa->maplen);
+	else
+		free(sa->I);
+	sa->I = NULL;
+	sa->map = NULL;
+}
+
+/* Cache file header is
+	0	8	"BSDIFFSA"
+	8	8	content hash of the old file
+	16	8	size of the old file
+	24	4	bytes per index
+	28	4	zero
+	32	??	I[0..oldsize] */
+#define SACACHE_HEADER 32
+
+static void put64(uint8_t *buf, uint64_t x)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		buf[i] = x >> (8 * i);
+}
+
+static uint64_t get64(const uint8_t *buf)
+{
+	uint64_t x = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		x = (x << 8) | buf[i];
+
+	return x;
+}
+
+uint64_t sufarray_hash(const uint8_t *old, off_t oldsize)
+{
+	uint64_t h, w;
+	off_t i;
+
+	/* Multiply-xorshift over 64-bit words. A collision only costs
+		patch size, any suffix array gives a correct patch. */
+	h = 0x9e3779b97f4a7c15ULL ^ (uint64_t)oldsize;
+	for (i = 0; i + 8 <= oldsize; i += 8)
+	{
+		memcpy(&w, old + i, 8);
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	};
+	for (; i < oldsize; i++)
+	{
+		h = (h ^ old[i]) * 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 29;
+	};
+
+	return h;
+}
+
+int sufarray_load(struct sufarray *sa, const char *path, uint64_t hash, off_t oldsize)
+{
+	uint8_t header[SACACHE_HEADER];
+	struct stat st;
+	void *map;
+	off_t i;
+	int fd, width;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+
+	width = 0;
+	if ((read(fd, header, SACACHE_HEADER) == SACACHE_HEADER) &&
+		(memcmp(header, "BSDIFFSA", 8) == 0) &&
+		(get64(header + 8) == hash) &&
+		(get64(header + 16) == (uint64_t)oldsize) &&
+		(fstat(fd, &st) == 0))
+		width = header[24];
+
+	if (((width != 4) && (width != 5)) ||
+		(st.st_size != SACACHE_HEADER + (oldsize + 1) * width) ||
+		((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED))
+	{
+		close(fd);
+		return -1;
+	};
+	close(fd);
+
+	sa->I = (uint8_t *)map + SACACHE_HEADER;
+	sa->n = oldsize;
+	sa->width = width;
+	sa->map = map;
+	sa->maplen = st.st_size;
+
+	/* The file may be damaged or written by someone else. An index
+		past old would be read past it, sort again instead. */
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	for (i = 0; i <= oldsize; i++)
+		if ((unsigned long long)sufarray_get(sa, i) > (unsigned long long)oldsize)
+		{
+			sufarray_free(sa);
+			return -1;
+		};
+	madvise(map, st.st_size, MADV_RANDOM);
+
+	return 0;
+}
+
+static int writeall(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t i;
+
+	while (len > 0)
+	{
+		if ((i = write(fd, buf, len)) <= 0)
+			return -1;
+		buf += i;
+		len -= i;
+	};
+
+	return 0;
+}
+
+int sufarray_save(const struct sufarray *sa, const char *path, uint64_t hash)
+{
+	uint8_t header[SACACHE_HEADER];
+	char *tmp;
+	int fd, ret, e;
+
+	memset(header, 0, SACACHE_HEADER);
+	memcpy(header, "BSDIFFSA", 8);
+	put64(header + 8, hash);
+	put64(header + 16, sa->n);
+	header[24] = sa->width;
+
+	/* Write a temporary file next to it and rename it into place, so
+		concurrent runs never map a half written array */
+	if ((tmp = malloc(strlen(path) + 8)) == NULL)
+		return -1;
+	sprintf(tmp, "%s.XXXXXX", path);
+
+	if ((fd = mkstemp(tmp)) < 0)
+	{
+		free(tmp);
+		return -1;
+	};
+
+	ret = ((fchmod(fd, 0644) == 0) &&
+		   (writeall(fd, header, SACACHE_HEADER) == 0) &&
+		   (writeall(fd, sa->I, (sa->n + 1) * sa->width) == 0))
+			  ? 0
+			  : -1;
+
+	if ((close(fd) != 0) || (ret != 0) || (rename(tmp, path) != 0))
+	{
+		e = errno;
+		unlink(tmp);
+		errno = e;
+		ret = -1;
+	};
+
+	free(tmp);
+
+	return ret;
+}
+
+int sufsort_algo(const char *name)
+{
+	if (strcmp(name, "qsufsort") == 0)
+		return SUFSORT_QSUFSORT;
+	if (strcmp(name, "sais") == 0)
+		return SUFSORT_SAIS;
+	if (strcmp(name, "parallel") == 0)
+		return SUFSORT_PARALLEL;
+
+	return -1;
+}
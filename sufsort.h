@@ -0,0 +1,85 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright      2018 Johan Westlund
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SUFSORT_H
+#define SUFSORT_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/* Suffix array construction algorithms */
+#define SUFSORT_QSUFSORT 0 /* Larsson-Sadakane, O(n log n), the reference */
+#define SUFSORT_SAIS 1	   /* Nong-Zhang-Chan induced sorting, O(n) */
+#define SUFSORT_PARALLEL 2 /* Multi-threaded prefix doubling */
+
+/* Suffix array I[0..n] of an old file of n bytes. The indices are
+ * 32-bit below 2 GiB and packed into 40 bits above that. */
+struct sufarray
+{
+	void *I;
+	off_t n;
+	int width;	   /* bytes per index, 4 or 5 */
+	void *map;	   /* cache file mapping I points into, or NULL */
+	size_t maplen;
+};
+
+/* Builds the suffix array of old[0..oldsize). I[0] is always oldsize
+ * (the empty suffix), the result is identical for every algorithm.
+ * threads is only used by SUFSORT_PARALLEL. Returns 0 on success, -1
+ * if out of memory. */
+int sufsort(struct sufarray *sa, const uint8_t *old, off_t oldsize, int algo, int threads);
+
+void sufarray_free(struct sufarray *sa);
+
+/* Content hash of an old file, the key of its cached suffix array */
+uint64_t sufarray_hash(const uint8_t *old, off_t oldsize);
+
+/* Maps a suffix array saved by sufarray_save(). Returns -1 if path
+ * does not exist or does not hold the array for this hash and size,
+ * or has an index past oldsize. */
+int sufarray_load(struct sufarray *sa, const char *path, uint64_t hash, off_t oldsize);
+
+/* Saves a suffix array, atomically replacing path. Returns 0 on
+ * success, -1 with errno set otherwise. */
+int sufarray_save(const struct sufarray *sa, const char *path, uint64_t hash);
+
+static inline off_t sufarray_get(const struct sufarray *sa, off_t i)
+{
+	const uint8_t *p;
+
+	if (sa->width == 4)
+		return ((const int32_t *)sa->I)[i];
+
+	p = (const uint8_t *)sa->I + 5 * i;
+	return (off_t)p[0] | ((off_t)p[1] << 8) | ((off_t)p[2] << 16) |
+		   ((off_t)p[3] << 24) | ((off_t)p[4] << 32);
+}
+
+/* Parses an algorithm name, returns -1 if unknown */
+int sufsort_algo(const char *name);
+
+#endif /* SUFSORT_H */
@@ -0,0 +1,760 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright      2018 Johan Westlund
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Suffix sorting for one index width. This file is included by
+ * sufsort.c once per width with saidx_t set to the index type and
+ * SAFN(name) giving the function names for that width. */
+
+static void SAFN(split)(saidx_t *I, saidx_t *V, off_t start, off_t len, off_t h)
+{
+	off_t i, j, k, x, tmp, jj, kk;
+
+	if (len < 16)
+	{
+		for (k = start; k < start + len; k += j)
+		{
+			j = 1;
+			x = V[I[k] + h];
+			for (i = 1; k + i < start + len; i++)
+			{
+				if (V[I[k + i] + h] < x)
+				{
+					x = V[I[k + i] + h];
+					j = 0;
+				};
+				if (V[I[k + i] + h] == x)
+				{
+					tmp = I[k + j];
+					I[k + j] = I[k + i];
+					I[k + i] = tmp;
+					j++;
+				};
+			};
+			for (i = 0; i < j; i++)
+				V[I[k + i]] = k + j - 1;
+			if (j == 1)
+				I[k] = -1;
+		};
+		return;
+	};
+
+	x = V[I[start + len / 2] + h];
+	jj = 0;
+	kk = 0;
+	for (i = start; i < start + len; i++)
+	{
+		if (V[I[i] + h] < x)
+			jj++;
+		if (V[I[i] + h] == x)
+			kk++;
+	};
+	jj += start;
+	kk += jj;
+
+	i = start;
+	j = 0;
+	k = 0;
+	while (i < jj)
+	{
+		if (V[I[i] + h] < x)
+		{
+			i++;
+		}
+		else if (V[I[i] + h] == x)
+		{
+			tmp = I[i];
+			I[i] = I[jj + j];
+			I[jj + j] = tmp;
+			j++;
+		}
+		else
+		{
+			tmp = I[i];
+			I[i] = I[kk + k];
+			I[kk + k] = tmp;
+			k++;
+		};
+	};
+
+	while (jj + j < kk)
+	{
+		if (V[I[jj + j] + h] == x)
+		{
+			j++;
+		}
+		else
+		{
+			tmp = I[jj + j];
+			I[jj + j] = I[kk + k];
+			I[kk + k] = tmp;
+			k++;
+		};
+	};
+
+	if (jj > start)
+		SAFN(split)(I, V, start, jj - start, h);
+
+	for (i = 0; i < kk - jj; i++)
+		V[I[jj + i]] = kk - 1;
+	if (jj == kk - 1)
+		I[jj] = -1;
+
+	if (start + len > kk)
+		SAFN(split)(I, V, kk, start + len - kk, h);
+}
+
+static void SAFN(qsufsort)(saidx_t *I, saidx_t *V, const uint8_t *old, off_t oldsize)
+{
+	off_t buckets[256];
+	off_t i, h, len;
+
+	for (i = 0; i < 256; i++)
+		buckets[i] = 0;
+	for (i = 0; i < oldsize; i++)
+		buckets[old[i]]++;
+	for (i = 1; i < 256; i++)
+		buckets[i] += buckets[i - 1];
+	for (i = 255; i > 0; i--)
+		buckets[i] = buckets[i - 1];
+	buckets[0] = 0;
+
+	for (i = 0; i < oldsize; i++)
+		I[++buckets[old[i]]] = i;
+	I[0] = oldsize;
+	for (i = 0; i < oldsize; i++)
+		V[i] = buckets[old[i]];
+	V[oldsize] = 0;
+	for (i = 1; i < 256; i++)
+		if (buckets[i] == buckets[i - 1] + 1)
+			I[buckets[i]] = -1;
+	I[0] = -1;
+
+	for (h = 1; I[0] != -(oldsize + 1); h += h)
+	{
+		len = 0;
+		for (i = 0; i < oldsize + 1;)
+		{
+			if (I[i] < 0)
+			{
+				len -= I[i];
+				i -= I[i];
+			}
+			else
+			{
+				if (len)
+					I[i - len] = -len;
+				len = V[I[i]] + 1 - i;
+				SAFN(split)(I, V, i, len, h);
+				i += len;
+				len = 0;
+			};
+		};
+		if (len)
+			I[i - len] = -len;
+	};
+
+	for (i = 0; i < oldsize + 1; i++)
+		I[V[i]] = i;
+}
+
+/* SA-IS works on the bytes of the old file at the top level and on
+ * saidx_t names in the reduced problems, cs is the symbol size */
+#define chr(i) (cs == 1 ? (off_t)((const uint8_t *)T)[i] : ((const saidx_t *)T)[i])
+#define tget(i) ((t[(i) >> 3] >> ((i) & 7)) & 1)
+#define tset(i, b) (t[(i) >> 3] = (t[(i) >> 3] & ~(1 << ((i) & 7))) | ((b) << ((i) & 7)))
+#define isLMS(i) ((i) > 0 && tget(i) && !tget((i) - 1))
+
+static void SAFN(getbuckets)(const void *T, saidx_t *bkt, off_t n, off_t k, int cs, int end)
+{
+	off_t i, sum;
+
+	for (i = 0; i < k; i++)
+		bkt[i] = 0;
+	for (i = 0; i < n; i++)
+		bkt[chr(i)]++;
+	for (i = 0, sum = 0; i < k; i++)
+	{
+		sum += bkt[i];
+		bkt[i] = end ? sum : sum - bkt[i];
+	};
+}
+
+static void SAFN(induce)(const void *T, saidx_t *SA, const uint8_t *t,
+						 saidx_t *bkt, off_t n, off_t k, int cs)
+{
+	off_t i, j;
+
+	/* L-type suffixes, left to right. The implicit sentinel suffix
+		comes first and T[n-1] is always L-type */
+	SAFN(getbuckets)(T, bkt, n, k, cs, 0);
+	SA[bkt[chr(n - 1)]++] = n - 1;
+	for (i = 0; i < n; i++)
+	{
+		j = SA[i] - 1;
+		if ((SA[i] > 0) && !tget(j))
+			SA[bkt[chr(j)]++] = j;
+	};
+
+	/* S-type suffixes, right to left */
+	SAFN(getbuckets)(T, bkt, n, k, cs, 1);
+	for (i = n - 1; i >= 0; i--)
+	{
+		j = SA[i] - 1;
+		if ((SA[i] > 0) && tget(j))
+			SA[--bkt[chr(j)]] = j;
+	};
+}
+
+/* Sorts the non-empty suffixes of T[0..n) over the alphabet 0..k-1
+ * into SA[0..n). T is treated as if followed by a unique sentinel
+ * smaller than every symbol, which is what bsdiff expects. */
+static int SAFN(sais)(const void *T, saidx_t *SA, off_t n, off_t k, int cs)
+{
+	uint8_t *t;
+	saidx_t *bkt;
+	off_t i, j, d, n1, name, prev, pos;
+	int diff;
+
+	if (n <= 1)
+	{
+		if (n == 1)
+			SA[0] = 0;
+		return 0;
+	};
+
+	if (((t = calloc(n / 8 + 1, 1)) == NULL) ||
+		((bkt = malloc(k * sizeof(saidx_t))) == NULL))
+	{
+		free(t);
+		return -1;
+	};
+
+	/* Classify the suffixes, 1 = S-type */
+	tset(n - 1, 0);
+	for (i = n - 2; i >= 0; i--)
+		tset(i, (chr(i) < chr(i + 1)) ||
+					((chr(i) == chr(i + 1)) && tget(i + 1)));
+
+	/* Stage 1: sort the LMS substrings */
+	SAFN(getbuckets)(T, bkt, n, k, cs, 1);
+	for (i = 0; i < n; i++)
+		SA[i] = -1;
+	for (i = 1; i < n; i++)
+		if (isLMS(i))
+			SA[--bkt[chr(i)]] = i;
+	SAFN(induce)(T, SA, t, bkt, n, k, cs);
+
+	/* Compact the sorted LMS substrings into SA[0..n1), n1 <= n/2 */
+	n1 = 0;
+	for (i = 0; i < n; i++)
+		if (isLMS(SA[i]))
+			SA[n1++] = SA[i];
+
+	/* Name them, the substring ending in the sentinel is always unique */
+	for (i = n1; i < n; i++)
+		SA[i] = -1;
+	name = 0;
+	prev = -1;
+	for (i = 0; i < n1; i++)
+	{
+		pos = SA[i];
+		diff = 0;
+		for (d = 0;; d++)
+		{
+			if ((prev == -1) || (pos + d == n) || (prev + d == n) ||
+				(chr(pos + d) != chr(prev + d)) ||
+				(tget(pos + d) != tget(prev + d)))
+			{
+				diff = 1;
+				break;
+			};
+			if ((d > 0) && (isLMS(pos + d) || isLMS(prev + d)))
+				break;
+		};
+		if (diff)
+		{
+			name++;
+			prev = pos;
+		};
+		SA[n1 + pos / 2] = name - 1;
+	};
+	for (i = n - 1, j = n - 1; i >= n1; i--)
+		if (SA[i] >= 0)
+			SA[j--] = SA[i];
+
+	/* Stage 2: sort the reduced string, recursing if names repeat.
+		The buckets are given back meanwhile to keep the peak down */
+	free(bkt);
+	if (name < n1)
+	{
+		if (SAFN(sais)(SA + n - n1, SA, n1, name, sizeof(saidx_t)))
+		{
+			free(t);
+			return -1;
+		};
+	}
+	else
+	{
+		for (i = 0; i < n1; i++)
+			SA[SA[n - n1 + i]] = i;
+	};
+
+	/* Stage 3: induce the full order from the sorted LMS suffixes */
+	if ((bkt = malloc(k * sizeof(saidx_t))) == NULL)
+	{
+		free(t);
+		return -1;
+	};
+	for (i = 1, j = n - n1; i < n; i++)
+		if (isLMS(i))
+			SA[j++] = i;
+	for (i = 0; i < n1; i++)
+		SA[i] = SA[n - n1 + SA[i]];
+	for (i = n1; i < n; i++)
+		SA[i] = -1;
+	SAFN(getbuckets)(T, bkt, n, k, cs, 1);
+	for (i = n1 - 1; i >= 0; i--)
+	{
+		j = SA[i];
+		SA[i] = -1;
+		SA[--bkt[chr(j)]] = j;
+	};
+	SAFN(induce)(T, SA, t, bkt, n, k, cs);
+
+	free(bkt);
+	free(t);
+
+	return 0;
+}
+
+#undef chr
+#undef tget
+#undef tset
+#undef isLMS
+
+struct SAFN(psort)
+{
+	saidx_t *I, *V;
+	const uint8_t *old;
+	off_t n, h;
+	uint64_t *U;  /* starts of the unsorted groups */
+	uint64_t *U2; /* ... of the next round */
+	uint64_t *N;  /* group boundaries found in this round */
+	off_t *cnt;	  /* per thread byte pair counts */
+	off_t *end;	  /* last index of each byte pair bucket */
+	off_t *tasks; /* large groups waiting to be split */
+	int ntasks, active, threads, nslices, done;
+	off_t next[4]; /* next slice for each phase of a round */
+	off_t unsorted;
+	pthread_barrier_t barrier;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+struct SAFN(psort_arg)
+{
+	struct SAFN(psort) *ps;
+	int id;
+};
+
+/* Three way partition of I[start..start+len) around x, by the key
+ * V[I[k]+h]. The keys equal to x end up in I[*lt..*gt). */
+static void SAFN(partition)(saidx_t *I, const saidx_t *V, off_t start,
+						   off_t len, off_t h, off_t x, off_t *lt, off_t *gt)
+{
+	off_t i, j, k, tmp;
+
+	i = start;
+	j = start;
+	k = start + len;
+	while (j < k)
+	{
+		if (V[I[j] + h] < x)
+		{
+			tmp = I[i];
+			I[i++] = I[j];
+			I[j++] = tmp;
+		}
+		else if (V[I[j] + h] > x)
+		{
+			tmp = I[--k];
+			I[k] = I[j];
+			I[j] = tmp;
+		}
+		else
+		{
+			j++;
+		};
+	};
+
+	*lt = i;
+	*gt = k;
+}
+
+static off_t SAFN(pivot)(const saidx_t *I, const saidx_t *V, off_t start, off_t len, off_t h)
+{
+	off_t a, b, c;
+
+	a = V[I[start] + h];
+	b = V[I[start + len / 2] + h];
+	c = V[I[start + len - 1] + h];
+
+	if (a < b)
+		return (b < c) ? b : ((a < c) ? c : a);
+	return (a < c) ? a : ((b < c) ? c : b);
+}
+
+/* Sorts I[start..start+len) by V[I[k]+h], leaving V untouched */
+static void SAFN(keysort)(saidx_t *I, const saidx_t *V, off_t start, off_t len, off_t h)
+{
+	off_t i, j, x, lt, gt, tmp;
+
+	while (len > 16)
+	{
+		SAFN(partition)(I, V, start, len, h, SAFN(pivot)(I, V, start, len, h), &lt, &gt);
+		if (lt - start < start + len - gt)
+		{
+			SAFN(keysort)(I, V, start, lt - start, h);
+			len = start + len - gt;
+			start = gt;
+		}
+		else
+		{
+			SAFN(keysort)(I, V, gt, start + len - gt, h);
+			len = lt - start;
+		};
+	};
+
+	for (i = start + 1; i < start + len; i++)
+	{
+		tmp = I[i];
+		x = V[tmp + h];
+		for (j = i; (j > start) && (V[I[j - 1] + h] > x); j--)
+			I[j] = I[j - 1];
+		I[j] = tmp;
+	};
+}
+
+static void SAFN(pushtask)(struct SAFN(psort) *ps, off_t start, off_t len)
+{
+	pthread_mutex_lock(&ps->lock);
+	ps->tasks[2 * ps->ntasks] = start;
+	ps->tasks[2 * ps->ntasks + 1] = len;
+	ps->ntasks++;
+	pthread_cond_signal(&ps->cond);
+	pthread_mutex_unlock(&ps->lock);
+}
+
+/* All threads split the large groups together, each partition step
+ * hands its upper part back to the pool */
+static void SAFN(bigsort)(struct SAFN(psort) *ps)
+{
+	off_t start, len, lt, gt;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&ps->lock);
+		while ((ps->ntasks == 0) && (ps->active > 0))
+			pthread_cond_wait(&ps->cond, &ps->lock);
+		if (ps->ntasks == 0)
+		{
+			pthread_mutex_unlock(&ps->lock);
+			return;
+		};
+		ps->ntasks--;
+		start = ps->tasks[2 * ps->ntasks];
+		len = ps->tasks[2 * ps->ntasks + 1];
+		ps->active++;
+		pthread_mutex_unlock(&ps->lock);
+
+		while (len >= PSORT_BIG)
+		{
+			SAFN(partition)(ps->I, ps->V, start, len, ps->h,
+					  SAFN(pivot)(ps->I, ps->V, start, len, ps->h), &lt, &gt);
+			if (start + len - gt >= PSORT_BIG)
+				SAFN(pushtask)(ps, gt, start + len - gt);
+			else
+				SAFN(keysort)(ps->I, ps->V, gt, start + len - gt, ps->h);
+			len = lt - start;
+		};
+		SAFN(keysort)(ps->I, ps->V, start, len, ps->h);
+
+		pthread_mutex_lock(&ps->lock);
+		if ((--ps->active == 0) && (ps->ntasks == 0))
+			pthread_cond_broadcast(&ps->cond);
+		pthread_mutex_unlock(&ps->lock);
+	};
+}
+
+/* Hands out the slices of I[0..n] for one phase. Returns 0 when
+ * there are no slices left. */
+static int SAFN(nextslice)(struct SAFN(psort) *ps, int phase, off_t *from, off_t *to)
+{
+	off_t j;
+
+	if ((j = __atomic_fetch_add(&ps->next[phase], 1, __ATOMIC_RELAXED)) >= ps->nslices)
+		return 0;
+
+	*from = j * (ps->n + 1) / ps->nslices;
+	*to = (j + 1) * (ps->n + 1) / ps->nslices;
+
+	return 1;
+}
+
+static void *SAFN(psort_thread)(void *arg)
+{
+	struct SAFN(psort) *ps = ((struct SAFN(psort_arg) *)arg)->ps;
+	int id = ((struct SAFN(psort_arg) *)arg)->id;
+	saidx_t *I, *V;
+	off_t *cnt;
+	off_t i, k, s, e, a, b, from, to, key, unsorted;
+	uint64_t *tmp;
+	int t;
+
+	/* Wait until all threads are started */
+	pthread_mutex_lock(&ps->lock);
+	pthread_mutex_unlock(&ps->lock);
+
+	I = ps->I;
+	V = ps->V;
+	cnt = ps->cnt + (off_t)id * PSORT_KEYS;
+	from = id * ps->n / ps->threads;
+	to = (id + 1) * ps->n / ps->threads;
+
+	/* Bucket sort by the first two bytes */
+	for (i = from; i < to; i++)
+		cnt[pairkey(ps->old, ps->n, i)]++;
+
+	pthread_barrier_wait(&ps->barrier);
+
+	if (id == 0)
+	{
+		for (k = 0, i = 1; k < PSORT_KEYS; k++)
+		{
+			s = i;
+			for (t = 0; t < ps->threads; t++)
+			{
+				e = ps->cnt[(off_t)t * PSORT_KEYS + k];
+				ps->cnt[(off_t)t * PSORT_KEYS + k] = i;
+				i += e;
+			};
+			ps->end[k] = i - 1;
+			if (i - s > 1)
+				setbit(ps->U, s);
+		};
+		I[0] = ps->n;
+		V[ps->n] = 0;
+	};
+
+	pthread_barrier_wait(&ps->barrier);
+
+	for (i = from; i < to; i++)
+	{
+		key = pairkey(ps->old, ps->n, i);
+		I[cnt[key]++] = i;
+		V[i] = ps->end[key];
+	};
+
+	for (;;)
+	{
+		pthread_barrier_wait(&ps->barrier);
+
+		/* Sort the unsorted groups, the large ones are shared */
+		while (SAFN(nextslice)(ps, 0, &from, &to))
+			for (s = nextbit(ps->U, from, to); s < to; s = nextbit(ps->U, s + 1, to))
+			{
+				e = V[I[s]] + 1;
+				if (e - s < PSORT_BIG)
+					SAFN(keysort)(I, V, s, e - s, ps->h);
+				else
+					SAFN(pushtask)(ps, s, e - s);
+			};
+
+		pthread_barrier_wait(&ps->barrier);
+		SAFN(bigsort)(ps);
+		pthread_barrier_wait(&ps->barrier);
+
+		/* Find where the keys change */
+		while (SAFN(nextslice)(ps, 1, &from, &to))
+			for (s = nextbit(ps->U, from, to); s < to; s = nextbit(ps->U, s + 1, to))
+			{
+				e = V[I[s]] + 1;
+				for (k = s + 1; k < e; k++)
+					if (V[I[k] + ps->h] != V[I[k - 1] + ps->h])
+						setbit(ps->N, k);
+			};
+
+		pthread_barrier_wait(&ps->barrier);
+
+		/* Renumber the new groups */
+		unsorted = 0;
+		while (SAFN(nextslice)(ps, 2, &from, &to))
+			for (s = nextbit(ps->U, from, to); s < to; s = nextbit(ps->U, s + 1, to))
+			{
+				e = V[I[s]] + 1;
+				for (a = s; a < e; a = b)
+				{
+					b = nextbit(ps->N, a + 1, e);
+					for (k = a; k < b; k++)
+						V[I[k]] = b - 1;
+					if (b - a > 1)
+					{
+						setbit(ps->U2, a);
+						unsorted++;
+					};
+				};
+			};
+		__atomic_fetch_add(&ps->unsorted, unsorted, __ATOMIC_RELAXED);
+
+		pthread_barrier_wait(&ps->barrier);
+
+		if (id == 0)
+		{
+			tmp = ps->U;
+			ps->U = ps->U2;
+			ps->U2 = tmp;
+			ps->done = (ps->unsorted == 0);
+			ps->unsorted = 0;
+			ps->h += ps->h;
+			memset(ps->next, 0, sizeof(ps->next));
+		};
+
+		pthread_barrier_wait(&ps->barrier);
+
+		/* Clear the bitmaps for the next round */
+		while (SAFN(nextslice)(ps, 3, &from, &to))
+		{
+			from = (from + 63) >> 6;
+			to = (to + 63) >> 6;
+			memset(ps->U2 + from, 0, (to - from) * sizeof(uint64_t));
+			memset(ps->N + from, 0, (to - from) * sizeof(uint64_t));
+		};
+
+		if (ps->done)
+			break;
+	};
+
+	return NULL;
+}
+
+static int SAFN(psufsort)(saidx_t *I, const uint8_t *old, off_t oldsize, int threads)
+{
+	struct SAFN(psort) ps;
+	struct SAFN(psort_arg) *args;
+	pthread_t *tids;
+	size_t words;
+	int t, ret = -1;
+
+	memset(&ps, 0, sizeof(ps));
+	words = (oldsize + 64) / 64;
+	ps.I = I;
+	ps.old = old;
+	ps.n = oldsize;
+	ps.h = 2;
+	ps.V = malloc((oldsize + 1) * sizeof(saidx_t));
+	ps.U = calloc(words, sizeof(uint64_t));
+	ps.U2 = calloc(words, sizeof(uint64_t));
+	ps.N = calloc(words, sizeof(uint64_t));
+	ps.cnt = calloc((size_t)threads * PSORT_KEYS, sizeof(off_t));
+	ps.end = malloc(PSORT_KEYS * sizeof(off_t));
+	ps.tasks = malloc(2 * ((oldsize + 1) / PSORT_BIG + 1) * sizeof(off_t));
+	args = malloc(threads * sizeof(*args));
+	tids = malloc(threads * sizeof(*tids));
+
+	if ((ps.V != NULL) && (ps.U != NULL) && (ps.U2 != NULL) && (ps.N != NULL) &&
+		(ps.cnt != NULL) && (ps.end != NULL) && (ps.tasks != NULL) &&
+		(args != NULL) && (tids != NULL))
+	{
+		pthread_mutex_init(&ps.lock, NULL);
+		pthread_cond_init(&ps.cond, NULL);
+
+		/* Run with as many threads as could be started */
+		pthread_mutex_lock(&ps.lock);
+		for (t = 1; t < threads; t++)
+		{
+			args[t].ps = &ps;
+			args[t].id = t;
+			if (pthread_create(&tids[t], NULL, SAFN(psort_thread), &args[t]))
+				break;
+		};
+		ps.threads = t;
+		ps.nslices = t * PSORT_SLICES;
+		pthread_barrier_init(&ps.barrier, NULL, t);
+		pthread_mutex_unlock(&ps.lock);
+
+		args[0].ps = &ps;
+		args[0].id = 0;
+		SAFN(psort_thread)(&args[0]);
+
+		while (--t > 0)
+			pthread_join(tids[t], NULL);
+
+		pthread_barrier_destroy(&ps.barrier);
+		pthread_cond_destroy(&ps.cond);
+		pthread_mutex_destroy(&ps.lock);
+		ret = 0;
+	};
+
+	free(tids);
+	free(args);
+	free(ps.tasks);
+	free(ps.end);
+	free(ps.cnt);
+	free(ps.N);
+	free(ps.U2);
+	free(ps.U);
+	free(ps.V);
+
+	return ret;
+}
+
+static int SAFN(sort)(saidx_t *I, const uint8_t *old, off_t oldsize, int algo, int threads)
+{
+	saidx_t *V;
+
+	switch (algo)
+	{
+	case SUFSORT_QSUFSORT:
+		if ((V = malloc((oldsize + 1) * sizeof(saidx_t))) == NULL)
+			return -1;
+		SAFN(qsufsort)(I, V, old, oldsize);
+		free(V);
+		return 0;
+
+	case SUFSORT_SAIS:
+		I[0] = oldsize;
+		return SAFN(sais)(old, I + 1, oldsize, 256, 1);
+
+	case SUFSORT_PARALLEL:
+		/* Not worth starting threads for */
+		if ((threads <= 1) || (oldsize < PSORT_BIG))
+			return SAFN(sort)(I, old, oldsize, SUFSORT_SAIS, 1);
+		return SAFN(psufsort)(I, old, oldsize, threads);
+	};
+
+	return -1;
+}
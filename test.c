@@ -0,0 +1,1514 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright      2018 Johan Westlund
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Round trips through libbsdiff and libbspatch, in memory. Each test
+ * makes a patch, applies it and compares what comes out with new.
+ * Exits with 1 if any fails. */
+
+#include <sys/types.h>
+#include <err.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bsdiff.h"
+#include "bspatch.h"
+#include "crc32.h"
+#include "eqmask.h"
+#include "filter.h"
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+
+/* A patch, new file or journal that grows as it is written */
+struct mem
+{
+	uint8_t *buf;
+	off_t size, cap;
+};
+
+static void *xmalloc(size_t n)
+{
+	void *p;
+
+	if ((p = malloc(n)) == NULL)
+		err(1, NULL);
+	return p;
+}
+
+static void memwrite(struct mem *m, off_t pos, const void *buf, size_t len)
+{
+	if (len == 0)
+		return;
+	if (pos + (off_t)len > m->cap)
+	{
+		m->cap = MAX(2 * m->cap, pos + (off_t)len);
+		if ((m->buf = realloc(m->buf, m->cap)) == NULL)
+			err(1, NULL);
+	};
+	memcpy(m->buf + pos, buf, len);
+	m->size = MAX(m->size, pos + (off_t)len);
+}
+
+static uint64_t rnd(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static int report(const char *name, int failed)
+{
+	printf("%s %s\n", failed ? "FAIL" : "ok  ", name);
+	return failed;
+}
+
+/* Files of size bytes, of SAMPLES kinds, that are hard on suffix
+ * sorting and searching in different ways */
+#define SAMPLES 6
+static uint8_t *sample(int kind, off_t size, uint64_t *seed)
+{
+	uint8_t *p;
+	off_t i;
+
+	p = xmalloc(size + 1);
+	for (i = 0; i < size; i++)
+		switch (kind)
+		{
+		case 0: /* any byte */
+			p[i] = rnd(seed);
+			break;
+		case 1: /* two letters */
+			p[i] = 'a' + rnd(seed) % 2;
+			break;
+		case 2: /* one byte, one long group */
+			p[i] = 0xFF;
+			break;
+		case 3: /* a short period with a few bytes changed */
+			p[i] = (rnd(seed) % 1000 == 0) ? (uint8_t)rnd(seed) : "abcab"[i % 5];
+			break;
+		case 4: /* runs of a few bytes */
+			p[i] = (i > 0) && (rnd(seed) % 16 != 0) ? p[i - 1] : rnd(seed) % 4;
+			break;
+		default: /* a random block repeated */
+			p[i] = (i < 4096) ? rnd(seed) : p[i - 4096];
+			break;
+		};
+
+	return p;
+}
+
+/* Each algorithm gives the same suffix array as qsufsort */
+static int test_sort(const char *name, int algo, int threads)
+{
+	static const off_t sizes[] = {0, 1, 2, 7, 1000, 100000};
+	struct sufarray ref, sa;
+	uint64_t seed = 1;
+	uint8_t *old;
+	off_t i;
+	size_t k;
+	int kind, failed = 0;
+
+	for (kind = 0; kind < SAMPLES; kind++)
+		for (k = 0; k < sizeof(sizes) / sizeof(*sizes); k++)
+		{
+			old = sample(kind, sizes[k], &seed);
+			if ((sufsort(&ref, old, sizes[k], SUFSORT_QSUFSORT, 1) != 0) ||
+				(sufsort(&sa, old, sizes[k], algo, threads) != 0))
+				err(1, NULL);
+			for (i = 0; i <= sizes[k]; i++)
+				if (sufarray_get(&sa, i) != sufarray_get(&ref, i))
+				{
+					printf("%s: kind %d, %lld bytes, rank %lld\n", name, kind,
+						   (long long)sizes[k], (long long)i);
+					failed = 1;
+					break;
+				};
+			sufarray_free(&ref);
+			sufarray_free(&sa);
+			free(old);
+		};
+
+	return report(name, failed);
+}
+
+static int patch_write(void *opaque, off_t pos, const void *buf, size_t len)
+{
+	memwrite(opaque, pos, buf, len);
+	return 0;
+}
+
+/* new made from old by copying runs of it, with bytes changed, left
+ * out and put in between them */
+static uint8_t *edit(const uint8_t *old, off_t oldsize, off_t *newsize, uint64_t *seed)
+{
+	uint8_t *new;
+	off_t i, j, n;
+
+	new = xmalloc(2 * oldsize + 4096);
+	for (i = j = 0; (i < oldsize) && (j < oldsize + 2048);)
+	{
+		n = 1 + rnd(seed) % 2000;
+		n = MIN(n, oldsize - i);
+		memcpy(new + j, old + i, n);
+		if (rnd(seed) % 2 == 0)
+			new[j + rnd(seed) % n] ^= 1 + rnd(seed) % 255;
+		i += n;
+		j += n;
+		switch (rnd(seed) % 3)
+		{
+		case 0:
+			i += rnd(seed) % 200;
+			break;
+		case 1:
+			for (n = rnd(seed) % 200; n > 0; n--)
+				new[j++] = rnd(seed);
+			break;
+		};
+	};
+	*newsize = j;
+
+	return new;
+}
+
+static void defaults(struct bsdiff_options *opt)
+{
+	memset(opt, 0, sizeof(*opt));
+	opt->threads = 1;
+	opt->chunksize = 1 << 20;
+	opt->window = 512;
+	opt->lookbehind = -1;
+}
+
+/* Diffs new against old with the suffix array sa of old */
+static void diffwith(const struct sufarray *sa, const uint8_t *old, off_t oldsize,
+					 const uint8_t *new, off_t newsize, const struct bsdiff_options *opt,
+					 struct mem *patch)
+{
+	struct sufindex ix;
+	struct bsdiff_stream out = {patch, patch_write};
+
+	if (sufindex_init(&ix, sa, old, oldsize) != 0)
+		err(1, NULL);
+	patch->size = 0;
+	if (bsdiff(&ix, old, oldsize, new, newsize, opt, &out) < 0)
+		err(1, "bsdiff");
+	sufindex_free(&ix);
+}
+
+/* Diffs new against old, in place with lookbehind >= 0, through a
+ * filter unless it is FILTER_NONE */
+static void makepatch(const uint8_t *old, off_t oldsize, const uint8_t *new, off_t newsize,
+					  off_t lookbehind, int filter, struct mem *patch)
+{
+	struct sufarray sa;
+	struct sufindex ix;
+	struct bsdiff_options opt;
+	struct bsdiff_stream out = {patch, patch_write};
+	uint8_t *filtered;
+
+	defaults(&opt);
+	opt.lookbehind = lookbehind;
+	opt.filter = filter;
+
+	filtered = xmalloc(oldsize + 1);
+	memcpy(filtered, old, oldsize);
+	if (filter != FILTER_NONE)
+		filter_apply(filter, 0, oldsize, filtered, 0, oldsize, 0, oldsize);
+	if ((sufsort(&sa, filtered, oldsize, SUFSORT_SAIS, 1) != 0) ||
+		(sufindex_init(&ix, &sa, filtered, oldsize) != 0))
+		err(1, NULL);
+	ix.crc = crc32_update(0, old, oldsize);
+	patch->size = 0;
+	if (bsdiff(&ix, filtered, oldsize, new, newsize, &opt, &out) < 0)
+		err(1, "bsdiff");
+	sufindex_free(&ix);
+	sufarray_free(&sa);
+	free(filtered);
+}
+
+/* The 40-bit indices of old files above 2 GiB read back as they were
+ * written, and diff like the 32-bit ones */
+static int test_packed(void)
+{
+	struct sufarray sa, packed;
+	struct bsdiff_options opt;
+	struct mem patch[2] = {{0}};
+	uint64_t seed = 1;
+	uint8_t *old, *new, *p;
+	off_t oldsize = 100000, newsize, i, x;
+	int k, failed = 0;
+
+	old = sample(3, oldsize, &seed);
+	new = edit(old, oldsize, &newsize, &seed);
+	if (sufsort(&sa, old, oldsize, SUFSORT_SAIS, 1) != 0)
+		err(1, NULL);
+	packed = sa;
+	packed.width = 5;
+	packed.I = p = xmalloc(5 * (oldsize + 1));
+	for (i = 0; i <= oldsize; i++)
+		for (k = 0, x = sufarray_get(&sa, i); k < 5; k++)
+			p[5 * i + k] = x >> (8 * k);
+	for (i = 0; i <= oldsize; i++)
+		failed |= (sufarray_get(&packed, i) != sufarray_get(&sa, i));
+
+	defaults(&opt);
+	diffwith(&sa, old, oldsize, new, newsize, &opt, &patch[0]);
+	diffwith(&packed, old, oldsize, new, newsize, &opt, &patch[1]);
+	failed |= (patch[0].size != patch[1].size) || (memcmp(patch[0].buf, patch[1].buf, patch[0].size) != 0);
+
+	/* The fifth byte is the top of the index */
+	memcpy(p, "\x9A\x78\x56\x34\x12", 5);
+	failed |= (sufarray_get(&packed, 0) != 0x123456789A);
+
+	sufarray_free(&sa);
+	free(packed.I);
+	free(patch[0].buf);
+	free(patch[1].buf);
+	free(old);
+	free(new);
+	return report("40-bit indices", failed);
+}
+
+/* What bspatch reads and writes. In place, old is what has been
+ * written to out. Writes to out fail from kill on, as if the power
+ * went there. The journal keeps the last checkpoint committed and the
+ * one being written. */
+struct files
+{
+	const uint8_t *old;
+	struct mem patch, out, journal, next;
+	int inplace;
+	off_t kill;
+	off_t patchread; /* bytes of patch read */
+	struct mem reads; /* where and how much, if log is set */
+	int log;
+};
+
+static ssize_t read_patch(void *opaque, off_t pos, void *buf, size_t len)
+{
+	struct files *f = opaque;
+
+	len = (pos < f->patch.size) ? MIN((off_t)len, f->patch.size - pos) : 0;
+	memcpy(buf, f->patch.buf + pos, len);
+	f->patchread += len;
+	if (f->log)
+	{
+		memwrite(&f->reads, f->reads.size, &pos, sizeof(pos));
+		memwrite(&f->reads, f->reads.size, &len, sizeof(len));
+	};
+	return len;
+}
+
+static int read_old(void *opaque, off_t pos, void *buf, size_t len)
+{
+	struct files *f = opaque;
+
+	memcpy(buf, (f->inplace ? f->out.buf : f->old) + pos, len);
+	return 0;
+}
+
+static int write_new(void *opaque, off_t pos, const void *buf, size_t len)
+{
+	struct files *f = opaque;
+
+	if ((f->kill >= 0) && (pos + (off_t)len > f->kill))
+		return -1;
+	memwrite(&f->out, pos, buf, len);
+	return 0;
+}
+
+static ssize_t journal_read(void *opaque, off_t pos, void *buf, size_t len)
+{
+	struct files *f = opaque;
+
+	len = (pos < f->journal.size) ? MIN((off_t)len, f->journal.size - pos) : 0;
+	if (len > 0)
+		memcpy(buf, f->journal.buf + pos, len);
+	return len;
+}
+
+static int journal_write(void *opaque, off_t pos, const void *buf, size_t len)
+{
+	struct files *f = opaque;
+
+	memwrite(&f->next, pos, buf, len);
+	return 0;
+}
+
+static int journal_commit(void *opaque)
+{
+	struct files *f = opaque;
+
+	f->journal.size = 0;
+	memwrite(&f->journal, 0, f->next.buf, f->next.size);
+	f->next.size = 0;
+	return 0;
+}
+
+/* Applies f->patch with a work buffer of worksize, or the least one
+ * for 0, and a checkpoint every interval bytes if interval > 0 */
+static int apply(struct files *f, off_t oldsize, size_t worksize, off_t interval)
+{
+	struct bspatch_stream s = {f, read_patch, read_old, write_new};
+	struct bspatch_journal j = {f, journal_read, journal_write, journal_commit, interval};
+	struct bspatch_header h;
+	void *work;
+	int ret;
+
+	if ((ret = bspatch_header(&h, &s, f->patch.size)) != BSPATCH_OK)
+		return ret;
+	worksize = MAX(worksize, bspatch_worksize(&h, f->inplace, 0));
+	work = xmalloc(worksize);
+	ret = bspatch_journaled(&s, &h, oldsize, f->inplace, (interval > 0) ? &j : NULL, work, worksize);
+	free(work);
+
+	return ret;
+}
+
+static void files_free(struct files *f)
+{
+	free(f->patch.buf);
+	free(f->out.buf);
+	free(f->journal.buf);
+	free(f->next.buf);
+	free(f->reads.buf);
+}
+
+static int check(const char *name, const struct files *f, const uint8_t *new, off_t newsize)
+{
+	return report(name, (f->out.size < newsize) || (memcmp(f->out.buf, new, newsize) != 0));
+}
+
+/* CRC-32 a bit at a time, as the tables are made */
+static uint32_t crc_bitwise(const uint8_t *p, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+	int k;
+
+	for (; len > 0; len--)
+		for (crc ^= *p++, k = 0; k < 8; k++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+	return ~crc;
+}
+
+struct crcjob
+{
+	const uint8_t *buf;
+	size_t len;
+	uint32_t crc;
+};
+
+static void *crc_thread(void *arg)
+{
+	struct crcjob *job = arg;
+
+	job->crc = crc32_update(0, job->buf, job->len);
+	return NULL;
+}
+
+/* crc32_update() gives the CRC of gzip for any length and alignment,
+ * continued over any split, and on many threads at once from the start */
+static int test_crc(void)
+{
+	struct crcjob jobs[8];
+	pthread_t tid[8];
+	uint64_t seed = 1;
+	uint8_t *buf;
+	size_t i, k, n = 1 << 20;
+	int failed = 0;
+
+	buf = sample(0, n, &seed);
+	failed |= (crc32_update(0, "123456789", 9) != 0xcbf43926) || (crc32_update(0, buf, 0) != 0);
+	for (i = 0; i < 8; i++)
+		for (k = 0; k < 70; k++)
+			failed |= (crc32_update(0, buf + i, k) != crc_bitwise(buf + i, k));
+	for (i = 0; i <= 1000; i++)
+		failed |= (crc32_update(crc32_update(0, buf, i), buf + i, 1000 - i) != crc_bitwise(buf, 1000));
+	for (i = 0; i < 8; i++)
+	{
+		jobs[i].buf = buf + i;
+		jobs[i].len = n - 8;
+		if (pthread_create(&tid[i], NULL, crc_thread, &jobs[i]) != 0)
+			errx(1, "pthread_create");
+	};
+	for (i = 0; i < 8; i++)
+	{
+		pthread_join(tid[i], NULL);
+		failed |= (jobs[i].crc != crc_bitwise(buf + i, n - 8));
+	};
+
+	free(buf);
+	return report("crc32 of gzip on threads", failed);
+}
+
+/* A byte of old changed gives EOLD before anything is written, also in
+ * place, and a byte of a stored diff section changed gives ECRC */
+static int test_damaged(void)
+{
+	struct sufarray sa;
+	struct bsdiff_options opt;
+	struct bspatch_header h;
+	struct files f;
+	struct bspatch_stream s = {&f, read_patch, read_old, write_new};
+	uint64_t seed = 1;
+	uint8_t *old, *new, *bad;
+	off_t oldsize = 100000, newsize;
+	int inplace, failed = 0;
+
+	old = sample(5, oldsize, &seed);
+	new = edit(old, oldsize, &newsize, &seed);
+	bad = xmalloc(oldsize);
+	memcpy(bad, old, oldsize);
+	bad[oldsize / 2] ^= 1;
+	for (inplace = 0; inplace < 2; inplace++)
+	{
+		memset(&f, 0, sizeof(f));
+		f.old = bad;
+		f.kill = -1;
+		f.inplace = inplace;
+		makepatch(old, oldsize, new, newsize, inplace ? 65536 : -1, FILTER_NONE, &f.patch);
+		if (inplace)
+			memwrite(&f.out, 0, bad, oldsize);
+		failed |= (apply(&f, oldsize, 0, 0) != BSPATCH_EOLD) ||
+				  (f.out.size != (inplace ? oldsize : 0)) ||
+				  (inplace && (memcmp(f.out.buf, bad, oldsize) != 0));
+		files_free(&f);
+	};
+
+	memset(&f, 0, sizeof(f));
+	f.old = old;
+	f.kill = -1;
+	if (sufsort(&sa, old, oldsize, SUFSORT_SAIS, 1) != 0)
+		err(1, NULL);
+	defaults(&opt);
+	opt.codec[1] = BSDIFF_STORED;
+	diffwith(&sa, old, oldsize, new, newsize, &opt, &f.patch);
+	if (bspatch_header(&h, &s, f.patch.size) != BSPATCH_OK)
+		errx(1, "bspatch_header");
+	f.patch.buf[(h.diff + h.extra) / 2] ^= 1;
+	failed |= (apply(&f, oldsize, 0, 0) != BSPATCH_ECRC);
+	files_free(&f);
+
+	sufarray_free(&sa);
+	free(old);
+	free(new);
+	free(bad);
+	return report("damaged old and patch found by their CRCs", failed);
+}
+
+/* Blocks of old far apart and in reverse order: ctrl has long seeks
+ * both ways, in varints, fewer bytes than 24 a triple. The triples
+ * are read across refills of the least buffer as of a large one. */
+static int test_varint(void)
+{
+	struct sufarray sa;
+	struct bsdiff_options opt;
+	struct bsdiff_stats st;
+	struct bspatch_header h;
+	struct files f;
+	struct bspatch_stream s = {&f, read_patch, read_old, write_new};
+	uint64_t seed = 1;
+	uint8_t *old, *new;
+	off_t oldsize = 4 << 20, newsize = 0, pos;
+	int k, failed = 0;
+
+	old = sample(0, oldsize, &seed);
+	new = xmalloc(oldsize);
+	for (k = 0; k < 256; k++)
+	{
+		pos = (255 - k) * (oldsize / 256) + rnd(&seed) % 4096;
+		memcpy(new + newsize, old + pos, 8192);
+		new[newsize + rnd(&seed) % 8192] ^= 1;
+		newsize += 8192;
+	};
+	if (sufsort(&sa, old, oldsize, SUFSORT_SAIS, 1) != 0)
+		err(1, NULL);
+	defaults(&opt);
+	opt.stats = &st;
+	memset(&f, 0, sizeof(f));
+	f.old = old;
+	f.kill = -1;
+	diffwith(&sa, old, oldsize, new, newsize, &opt, &f.patch);
+	if (bspatch_header(&h, &s, f.patch.size) != BSPATCH_OK)
+		errx(1, "bspatch_header");
+	failed |= !(h.flags & 4 /* FLAG_VARINT */) || (st.triples < 256) || (st.raw[0] >= 24 * st.triples);
+	failed |= (apply(&f, oldsize, 0, 0) != BSPATCH_OK) || (f.out.size != newsize) ||
+			  (memcmp(f.out.buf, new, newsize) != 0);
+	f.out.size = 0;
+	failed |= (apply(&f, oldsize, 8 << 20, 0) != BSPATCH_OK) || (f.out.size != newsize) ||
+			  (memcmp(f.out.buf, new, newsize) != 0);
+
+	files_free(&f);
+	sufarray_free(&sa);
+	free(old);
+	free(new);
+	return report("varint ctrl with long seeks both ways", failed);
+}
+
+/* Callbacks of struct files for threads, with nothing counted and new
+ * grown to its size before */
+static ssize_t read_patch_shared(void *opaque, off_t pos, void *buf, size_t len)
+{
+	struct files *f = opaque;
+
+	len = (pos < f->patch.size) ? MIN((off_t)len, f->patch.size - pos) : 0;
+	memcpy(buf, f->patch.buf + pos, len);
+	return len;
+}
+
+static int write_new_shared(void *opaque, off_t pos, const void *buf, size_t len)
+{
+	struct files *f = opaque;
+
+	memcpy(f->out.buf + pos, buf, len);
+	return 0;
+}
+
+struct chunkjob
+{
+	const struct bspatch_stream *s;
+	const struct bspatch_header *h;
+	off_t oldsize, first, step;
+	int ret;
+};
+
+/* Applies the chunks first, first - step, ... down to 0 */
+static void *chunk_thread(void *arg)
+{
+	struct chunkjob *job = arg;
+	size_t worksize = bspatch_worksize(job->h, 0, 0);
+	void *work = xmalloc(worksize);
+	off_t k;
+
+	for (k = job->first, job->ret = BSPATCH_OK; (k >= 0) && (job->ret == BSPATCH_OK); k -= job->step)
+		job->ret = bspatch_chunk(job->s, job->h, k, job->oldsize, work, worksize);
+	free(work);
+	return NULL;
+}
+
+/* The chunks of a patch with an index apply in any order, and on
+ * many threads at once */
+static int test_chunks(void)
+{
+	struct sufarray sa;
+	struct bsdiff_options opt;
+	struct bspatch_header h;
+	struct files f;
+	struct bspatch_stream s = {&f, read_patch, read_old, write_new};
+	struct bspatch_stream shared = {&f, read_patch_shared, read_old, write_new_shared};
+	struct chunkjob jobs[4];
+	pthread_t tid[4];
+	uint64_t seed = 1;
+	uint8_t *old, *new, *work;
+	off_t oldsize = 300000, newsize, *order, i, k, t;
+	size_t worksize;
+	int failed = 0;
+
+	old = sample(5, oldsize, &seed);
+	new = edit(old, oldsize, &newsize, &seed);
+	if (sufsort(&sa, old, oldsize, SUFSORT_SAIS, 1) != 0)
+		err(1, NULL);
+	defaults(&opt);
+	opt.indexchunk = 16384;
+	memset(&f, 0, sizeof(f));
+	f.old = old;
+	f.kill = -1;
+	diffwith(&sa, old, oldsize, new, newsize, &opt, &f.patch);
+	if ((bspatch_header(&h, &s, f.patch.size) != BSPATCH_OK) || (h.chunks < 8))
+		errx(1, "bspatch_header");
+
+	/* One at a time, shuffled */
+	order = xmalloc(h.chunks * sizeof(*order));
+	for (i = 0; i < h.chunks; i++)
+		order[i] = i;
+	for (i = h.chunks - 1; i > 0; i--)
+	{
+		k = rnd(&seed) % (i + 1);
+		t = order[i];
+		order[i] = order[k];
+		order[k] = t;
+	};
+	worksize = bspatch_worksize(&h, 0, 0);
+	work = xmalloc(worksize);
+	failed |= (bspatch_checkold(&s, &h, oldsize, work, worksize) != BSPATCH_OK);
+	for (i = 0; i < h.chunks; i++)
+		failed |= (bspatch_chunk(&s, &h, order[i], oldsize, work, worksize) != BSPATCH_OK);
+	failed |= (f.out.size != newsize) || (memcmp(f.out.buf, new, newsize) != 0);
+	free(work);
+	free(order);
+
+	/* Four threads from the last chunk down, each a fourth of them */
+	memset(f.out.buf, 0, newsize);
+	for (i = 0; i < 4; i++)
+	{
+		jobs[i].s = &shared;
+		jobs[i].h = &h;
+		jobs[i].oldsize = oldsize;
+		jobs[i].first = h.chunks - 1 - i;
+		jobs[i].step = 4;
+		if (pthread_create(&tid[i], NULL, chunk_thread, &jobs[i]) != 0)
+			errx(1, "pthread_create");
+	};
+	for (i = 0; i < 4; i++)
+	{
+		pthread_join(tid[i], NULL);
+		failed |= (jobs[i].ret != BSPATCH_OK);
+	};
+	failed |= (memcmp(f.out.buf, new, newsize) != 0);
+
+	files_free(&f);
+	sufarray_free(&sa);
+	free(old);
+	free(new);
+	return report("index chunks in any order and on threads", failed);
+}
+
+/* Each codec, and a mix of them across the sections, round trips and
+ * is the one the header has. smallest keeps the fewest bytes of
+ * stored, deflate and lzr for each section, fast of stored and deflate. */
+static int test_codecs(void)
+{
+	static const int kinds[] = {0, 4, 5};
+	static const size_t windows[] = {512, 32768};
+	static const int codecs[][3] = {
+		{BSDIFF_DEFLATE, BSDIFF_DEFLATE, BSDIFF_DEFLATE},
+		{BSDIFF_STORED, BSDIFF_STORED, BSDIFF_STORED},
+		{BSDIFF_LZR, BSDIFF_LZR, BSDIFF_LZR},
+		{BSDIFF_SMALLEST, BSDIFF_SMALLEST, BSDIFF_SMALLEST},
+		{BSDIFF_FAST, BSDIFF_FAST, BSDIFF_FAST},
+		{BSDIFF_LZR, BSDIFF_STORED, BSDIFF_DEFLATE},
+		{BSDIFF_STORED, BSDIFF_DEFLATE, BSDIFF_LZR}};
+	struct sufarray sa;
+	struct bsdiff_options opt;
+	struct bsdiff_stats st;
+	struct bspatch_header h;
+	struct files f;
+	struct bspatch_stream s = {&f, read_patch, read_old, write_new};
+	uint64_t seed = 1;
+	uint8_t *old, *new;
+	off_t oldsize = 100000, newsize, packed[3][3];
+	size_t i, w, c;
+	int k, bad, failed = 0;
+
+	for (i = 0; i < sizeof(kinds) / sizeof(*kinds); i++)
+	{
+		old = sample(kinds[i], oldsize, &seed);
+		new = edit(old, oldsize, &newsize, &seed);
+		if (sufsort(&sa, old, oldsize, SUFSORT_SAIS, 1) != 0)
+			err(1, NULL);
+		for (w = 0; w < sizeof(windows) / sizeof(*windows); w++)
+			for (c = 0; c < sizeof(codecs) / sizeof(*codecs); c++)
+			{
+				memset(&f, 0, sizeof(f));
+				f.old = old;
+				f.kill = -1;
+				defaults(&opt);
+				opt.window = windows[w];
+				opt.stats = &st;
+				memcpy(opt.codec, codecs[c], sizeof(opt.codec));
+				diffwith(&sa, old, oldsize, new, newsize, &opt, &f.patch);
+				if (bspatch_header(&h, &s, f.patch.size) != BSPATCH_OK)
+					errx(1, "bspatch_header");
+				bad = (apply(&f, oldsize, 0, 0) != BSPATCH_OK) || (f.out.size != newsize) ||
+					  (memcmp(f.out.buf, new, newsize) != 0);
+				f.out.size = 0;
+				bad |= (apply(&f, oldsize, 1 << 20, 0) != BSPATCH_OK) || (f.out.size != newsize) ||
+					   (memcmp(f.out.buf, new, newsize) != 0);
+				for (k = 0; k < 3; k++)
+				{
+					bad |= (h.codec[k] != st.codec[k]);
+					if (codecs[c][k] < BSDIFF_SMALLEST)
+						bad |= (h.codec[k] != codecs[c][k]);
+					if (c < 3)
+						packed[c][k] = st.packed[k];
+					if (codecs[c][k] == BSDIFF_SMALLEST)
+						bad |= (st.packed[k] > MIN(MIN(packed[0][k], packed[1][k]), packed[2][k]));
+					if (codecs[c][k] == BSDIFF_FAST)
+						bad |= (h.codec[k] == BSDIFF_LZR) ||
+							   (st.packed[k] > MIN(packed[0][k], packed[1][k]));
+				};
+				if (bad)
+					printf("codecs: kind %d, window %zu, set %zu\n", kinds[i], windows[w], c);
+				failed |= bad;
+				files_free(&f);
+			};
+		sufarray_free(&sa);
+		free(old);
+		free(new);
+	};
+
+	return report("every codec round trips", failed);
+}
+
+/* The optimal parse keeps the greedy one where it is not smaller, so
+ * its patch is never larger, and is smaller for some of these */
+static int test_optimal(void)
+{
+	static const int codecs[] = {BSDIFF_DEFLATE, BSDIFF_LZR, BSDIFF_SMALLEST};
+	struct sufarray sa;
+	struct bsdiff_options opt;
+	struct bsdiff_stats st;
+	struct mem greedy = {0};
+	struct files f;
+	uint64_t seed = 1;
+	uint8_t *old, *new;
+	off_t oldsize = 100000, newsize;
+	size_t c;
+	int kind, threads, smaller = 0, failed = 0;
+
+	for (kind = 0; kind < SAMPLES; kind++)
+	{
+		old = sample(kind, oldsize, &seed);
+		new = edit(old, oldsize, &newsize, &seed);
+		if (sufsort(&sa, old, oldsize, SUFSORT_SAIS, 1) != 0)
+			err(1, NULL);
+		for (c = 0; c < sizeof(codecs) / sizeof(*codecs); c++)
+			for (threads = 1; threads <= 3; threads += 2)
+			{
+				memset(&f, 0, sizeof(f));
+				f.old = old;
+				f.kill = -1;
+				defaults(&opt);
+				opt.threads = threads;
+				opt.chunksize = 16384;
+				opt.codec[0] = opt.codec[1] = opt.codec[2] = codecs[c];
+				diffwith(&sa, old, oldsize, new, newsize, &opt, &greedy);
+				opt.optimal = 1;
+				opt.stats = &st;
+				diffwith(&sa, old, oldsize, new, newsize, &opt, &f.patch);
+				if ((f.patch.size > greedy.size) ||
+					(st.packed[0] + st.packed[1] + st.packed[2] > st.greedy[0] + st.greedy[1] + st.greedy[2]) ||
+					(apply(&f, oldsize, 0, 0) != BSPATCH_OK) || (f.out.size != newsize) ||
+					(memcmp(f.out.buf, new, newsize) != 0))
+				{
+					printf("optimal: kind %d, codec %d, %d threads, %lld bytes against %lld\n", kind,
+						   codecs[c], threads, (long long)f.patch.size, (long long)greedy.size);
+					failed = 1;
+				};
+				smaller += (f.patch.size < greedy.size);
+				files_free(&f);
+			};
+		sufarray_free(&sa);
+		free(old);
+		free(new);
+	};
+	free(greedy.buf);
+
+	return report("optimal parse never larger than greedy", failed || (smaller == 0));
+}
+
+/* A suffix array out of order, as a damaged cache file may hold one,
+ * still gives a patch that applies. Many of its indices are of the
+ * last suffixes, shorter than the bytes search() takes as matched. */
+static int test_disorder(void)
+{
+	struct sufarray sa;
+	struct bsdiff_options opt;
+	struct files f;
+	uint64_t seed = 1;
+	uint8_t *old, *new;
+	off_t oldsize = 100000, newsize, i, k;
+	int32_t *I, x;
+	int ret;
+
+	old = sample(3, oldsize, &seed);
+	new = edit(old, oldsize, &newsize, &seed);
+	if (sufsort(&sa, old, oldsize, SUFSORT_SAIS, 1) != 0)
+		err(1, NULL);
+	for (I = sa.I, i = oldsize; i > 0; i--)
+	{
+		k = rnd(&seed) % (i + 1);
+		x = I[i];
+		I[i] = I[k];
+		I[k] = (i % 2) ? oldsize - (off_t)(rnd(&seed) % 3) : x;
+	};
+
+	memset(&f, 0, sizeof(f));
+	f.old = old;
+	f.kill = -1;
+	defaults(&opt);
+	diffwith(&sa, old, oldsize, new, newsize, &opt, &f.patch);
+	ret = apply(&f, oldsize, 0, 0);
+	ret = (ret != BSPATCH_OK) | check("suffix array out of order", &f, new, newsize);
+
+	sufarray_free(&sa);
+	files_free(&f);
+	free(old);
+	free(new);
+	return ret;
+}
+
+/* search() finds where in old each slice of new came from, for files
+ * whose byte pairs fall in few buckets or many, and at their ends, so
+ * no byte of new goes to extra. Not for the periodic kinds, where a
+ * slice is found at the offset the scan is at already. */
+static int test_search(void)
+{
+	static const off_t sizes[] = {1000, 4097, 100000};
+	struct sufarray sa;
+	struct bsdiff_options opt;
+	struct bsdiff_stats st;
+	struct mem patch = {0};
+	uint64_t seed = 1;
+	uint8_t *old, *new;
+	off_t oldsize, newsize, i, n;
+	size_t k;
+	int kind, failed = 0;
+
+	defaults(&opt);
+	opt.stats = &st;
+	for (kind = 0; kind < SAMPLES; kind++)
+		for (k = 0; (kind != 2) && (kind != 3) && (k < sizeof(sizes) / sizeof(*sizes)); k++)
+		{
+			oldsize = sizes[k];
+			old = sample(kind, oldsize, &seed);
+			new = xmalloc(2 * oldsize);
+			for (newsize = 0; newsize < oldsize; newsize += n)
+			{
+				n = 64 + rnd(&seed) % 449;
+				i = (rnd(&seed) % 4 == 0) ? oldsize - n : (off_t)(rnd(&seed) % (oldsize - n));
+				memcpy(new + newsize, old + i, n);
+			};
+			if (sufsort(&sa, old, oldsize, SUFSORT_SAIS, 1) != 0)
+				err(1, NULL);
+			diffwith(&sa, old, oldsize, new, newsize, &opt, &patch);
+			if (st.raw[2] > 0)
+			{
+				printf("search: kind %d, %lld bytes, %lld extra\n", kind,
+					   (long long)oldsize, (long long)st.raw[2]);
+				failed = 1;
+			};
+			sufarray_free(&sa);
+			free(old);
+			free(new);
+		};
+
+	free(patch.buf);
+	return report("search finds every slice of old", failed);
+}
+
+/* eqmask() agrees with a byte at a time, at any alignment */
+static int test_eqmask(void)
+{
+	uint8_t a[128], b[128];
+	uint64_t seed = 1, m;
+	int i, k, failed = 0;
+
+	eqmask_init();
+	for (k = 0; k < 10000; k++)
+	{
+		for (i = 0; i < 128; i++)
+			b[i] = a[i] = rnd(&seed);
+		for (i = 0; (k % 7 == 0) && (i < 128); i++)
+			b[i] = ~a[i];
+		for (i = rnd(&seed) % 65; i > 0; i--)
+			b[rnd(&seed) % 128] ^= 1 << (rnd(&seed) % 8);
+		m = 0;
+		for (i = 0; i < 64; i++)
+			m |= (uint64_t)(a[k % 64 + i] == b[k % 64 + i]) << i;
+		failed |= (eqmask(a + k % 64, b + k % 64) != m);
+	};
+
+	return report("eqmask compares like a byte loop", failed);
+}
+
+/* new is cut in the same chunks on any number of threads, so the
+ * patch is the same, and it applies */
+static int test_threads(void)
+{
+	static const int threads[] = {1, 2, 5};
+	struct sufarray sa;
+	struct bsdiff_options opt;
+	struct files f;
+	struct mem serial = {0};
+	uint64_t seed = 1;
+	uint8_t *old, *new;
+	off_t oldsize = 200000, newsize;
+	size_t k;
+	int ret, failed = 0;
+
+	old = sample(3, oldsize, &seed);
+	new = edit(old, oldsize, &newsize, &seed);
+	if (sufsort(&sa, old, oldsize, SUFSORT_SAIS, 1) != 0)
+		err(1, NULL);
+	defaults(&opt);
+	opt.chunksize = 4096;
+	for (k = 0; k < sizeof(threads) / sizeof(*threads); k++)
+	{
+		memset(&f, 0, sizeof(f));
+		f.old = old;
+		f.kill = -1;
+		opt.threads = threads[k];
+		diffwith(&sa, old, oldsize, new, newsize, &opt, &f.patch);
+		if (k == 0)
+			memwrite(&serial, 0, f.patch.buf, f.patch.size);
+		failed |= (f.patch.size != serial.size) || (memcmp(f.patch.buf, serial.buf, serial.size) != 0);
+		ret = apply(&f, oldsize, 0, 0);
+		failed |= (ret != BSPATCH_OK) || (f.out.size != newsize) || (memcmp(f.out.buf, new, newsize) != 0);
+		files_free(&f);
+	};
+
+	sufarray_free(&sa);
+	free(serial.buf);
+	free(old);
+	free(new);
+	return report("same patch on 1, 2 and 5 threads", failed);
+}
+
+/* A section is one deflate stream, so it refers back across the
+ * chunks it is compressed in, as far as the window and no further:
+ * bspatch has only the window for it */
+static int test_stream(void)
+{
+	static const size_t windows[] = {32768, 512};
+	struct sufarray sa;
+	struct bsdiff_options opt;
+	struct files f;
+	uint64_t seed = 1;
+	uint8_t old[1] = {0}, *new;
+	off_t newsize = 200000, i;
+	int k, ret, failed = 0;
+
+	new = xmalloc(newsize);
+	for (i = 0; i < newsize; i++)
+		new[i] = (i < 4096) ? rnd(&seed) : new[i - 4096];
+	if (sufsort(&sa, old, 0, SUFSORT_SAIS, 1) != 0)
+		err(1, NULL);
+	defaults(&opt);
+	for (k = 0; k < 2; k++)
+	{
+		memset(&f, 0, sizeof(f));
+		f.old = old;
+		f.kill = -1;
+		opt.window = windows[k];
+		diffwith(&sa, old, 0, new, newsize, &opt, &f.patch);
+		ret = apply(&f, 0, 0, 0);
+		failed |= (ret != BSPATCH_OK) || (f.out.size != newsize) || (memcmp(f.out.buf, new, newsize) != 0);
+		if (k == 0)
+			failed |= (f.patch.size > newsize / 4);
+		files_free(&f);
+	};
+
+	sufarray_free(&sa);
+	free(new);
+	return report("sections refer back across chunks", failed);
+}
+
+/* The window is in the header, and bspatch needs a buffer that grows
+ * with it: the least for one window is too small for the next */
+static int test_window(void)
+{
+	static const size_t windows[] = {1, 512, 4096, 32768};
+	struct sufarray sa;
+	struct bsdiff_options opt;
+	struct bspatch_stream s = {NULL, read_patch, read_old, write_new};
+	struct bspatch_header h;
+	struct files f;
+	uint64_t seed = 1;
+	uint8_t *old, *new;
+	off_t oldsize = 100000, newsize;
+	size_t k, last = 0;
+	void *work;
+	int ret, failed = 0;
+
+	old = sample(4, oldsize, &seed);
+	new = edit(old, oldsize, &newsize, &seed);
+	if (sufsort(&sa, old, oldsize, SUFSORT_SAIS, 1) != 0)
+		err(1, NULL);
+	defaults(&opt);
+	for (k = 0; k < sizeof(windows) / sizeof(*windows); k++)
+	{
+		memset(&f, 0, sizeof(f));
+		f.old = old;
+		f.kill = -1;
+		s.opaque = &f;
+		opt.window = windows[k];
+		diffwith(&sa, old, oldsize, new, newsize, &opt, &f.patch);
+		if ((bspatch_header(&h, &s, f.patch.size) != BSPATCH_OK) || (h.window != (off_t)windows[k]) ||
+			(bspatch_worksize(&h, 0, 0) <= last))
+			failed = 1;
+
+		/* Too small for this window */
+		if (last > 0)
+		{
+			work = xmalloc(last);
+			failed |= (bspatch(&s, &h, oldsize, 0, work, last) != BSPATCH_ENOMEM);
+			free(work);
+		};
+		last = bspatch_worksize(&h, 0, 0);
+		ret = apply(&f, oldsize, 0, 0);
+		failed |= (ret != BSPATCH_OK) || (f.out.size != newsize) || (memcmp(f.out.buf, new, newsize) != 0);
+		files_free(&f);
+	};
+
+	sufarray_free(&sa);
+	free(old);
+	free(new);
+	return report("window in the header", failed);
+}
+
+/* bspatch reads no byte of the patch twice, with the least buffers or
+ * large ones */
+static int test_readonce(void)
+{
+	struct sufarray sa;
+	struct bsdiff_options opt;
+	struct files f;
+	uint64_t seed = 1;
+	uint8_t *old, *new;
+	off_t oldsize = 200000, newsize;
+	int k, ret, failed = 0;
+
+	old = sample(0, oldsize, &seed);
+	new = edit(old, oldsize, &newsize, &seed);
+	if (sufsort(&sa, old, oldsize, SUFSORT_SAIS, 1) != 0)
+		err(1, NULL);
+	defaults(&opt);
+	for (k = 0; k < 2; k++)
+	{
+		memset(&f, 0, sizeof(f));
+		f.old = old;
+		f.kill = -1;
+		diffwith(&sa, old, oldsize, new, newsize, &opt, &f.patch);
+		ret = apply(&f, oldsize, k ? 1 << 20 : 0, 0);
+		failed |= (f.patchread > f.patch.size);
+		failed |= (ret != BSPATCH_OK) || (f.out.size != newsize) || (memcmp(f.out.buf, new, newsize) != 0);
+		files_free(&f);
+	};
+
+	sufarray_free(&sa);
+	free(old);
+	free(new);
+	return report("patch read once", failed);
+}
+
+/* After the header, each read of the patch is within one section and
+ * goes on where the last read of it ended */
+static int test_sections(void)
+{
+	struct sufarray sa;
+	struct bsdiff_options opt;
+	struct bspatch_stream s = {NULL, read_patch, read_old, write_new};
+	struct bspatch_header h;
+	struct files f;
+	uint64_t seed = 1;
+	uint8_t *old, *new, *p;
+	off_t oldsize = 200000, newsize, bounds[4], next[3], pos;
+	size_t len;
+	int k, ret, failed = 0;
+
+	old = sample(0, oldsize, &seed);
+	new = edit(old, oldsize, &newsize, &seed);
+	if (sufsort(&sa, old, oldsize, SUFSORT_SAIS, 1) != 0)
+		err(1, NULL);
+	defaults(&opt);
+	memset(&f, 0, sizeof(f));
+	f.old = old;
+	f.kill = -1;
+	s.opaque = &f;
+	diffwith(&sa, old, oldsize, new, newsize, &opt, &f.patch);
+	if (bspatch_header(&h, &s, f.patch.size) != BSPATCH_OK)
+		err(1, "bspatch_header");
+
+	f.log = 1;
+	ret = apply(&f, oldsize, 0, 0);
+	failed |= (ret != BSPATCH_OK) || (f.out.size != newsize) || (memcmp(f.out.buf, new, newsize) != 0);
+	bounds[0] = next[0] = h.ctrl;
+	bounds[1] = next[1] = h.diff;
+	bounds[2] = next[2] = h.extra;
+	bounds[3] = h.end;
+	for (p = f.reads.buf; p < f.reads.buf + f.reads.size; p += sizeof(pos) + sizeof(len))
+	{
+		memcpy(&pos, p, sizeof(pos));
+		memcpy(&len, p + sizeof(pos), sizeof(len));
+		if (pos < h.ctrl)
+			continue;
+		for (k = 0; (k < 3) && (pos >= bounds[k + 1]); k++)
+			;
+		if ((k == 3) || (pos != next[k]) || (pos + (off_t)len > bounds[k + 1]))
+			failed = 1;
+		else
+			next[k] += len;
+	};
+
+	files_free(&f);
+	sufarray_free(&sa);
+	free(old);
+	free(new);
+	return report("sections read front to back", failed);
+}
+
+/* In place, with any lookbehind, new shorter or longer than old and
+ * made of it moved around. A patch not made for it is refused. */
+static int test_inplace(void)
+{
+	static const off_t lookbehinds[] = {0, 512, 65536};
+	struct files f;
+	uint64_t seed = 1;
+	uint8_t *old, *new, *swapped;
+	off_t oldsize = 100000, newsize, half;
+	size_t k;
+	int n, ret, failed = 0;
+
+	old = sample(4, oldsize, &seed);
+	for (n = 0; n < 3; n++)
+	{
+		/* Edited, then with its halves swapped, then cut short */
+		new = edit(old, oldsize, &newsize, &seed);
+		if (n == 1)
+		{
+			half = newsize / 2;
+			swapped = xmalloc(newsize);
+			memcpy(swapped, new + half, newsize - half);
+			memcpy(swapped + newsize - half, new, half);
+			free(new);
+			new = swapped;
+		}
+		else if (n == 2)
+			newsize /= 3;
+
+		for (k = 0; k < sizeof(lookbehinds) / sizeof(*lookbehinds); k++)
+		{
+			memset(&f, 0, sizeof(f));
+			f.old = old;
+			f.kill = -1;
+			f.inplace = 1;
+			makepatch(old, oldsize, new, newsize, lookbehinds[k], FILTER_NONE, &f.patch);
+			memwrite(&f.out, 0, old, oldsize);
+			ret = apply(&f, oldsize, 0, 0);
+			failed |= (ret != BSPATCH_OK) || (memcmp(f.out.buf, new, newsize) != 0);
+			files_free(&f);
+		};
+		free(new);
+	};
+
+	/* Made to be applied to a copy of old */
+	memset(&f, 0, sizeof(f));
+	f.old = old;
+	f.kill = -1;
+	f.inplace = 1;
+	new = edit(old, oldsize, &newsize, &seed);
+	makepatch(old, oldsize, new, newsize, -1, FILTER_NONE, &f.patch);
+	memwrite(&f.out, 0, old, oldsize);
+	failed |= (apply(&f, oldsize, 0, 0) != BSPATCH_EINPLACE);
+	files_free(&f);
+	free(new);
+
+	free(old);
+	return report("in place", failed);
+}
+
+/* Heap in use, with what is mapped for large blocks */
+static size_t heap(void)
+{
+	struct mallinfo2 m = mallinfo2();
+
+	return m.uordblks + m.hblkhd;
+}
+
+/* patch_write() that keeps the most heap seen in use */
+static size_t heapmax;
+static int patch_write_heap(void *opaque, off_t pos, const void *buf, size_t len)
+{
+	heapmax = MAX(heapmax, heap());
+	return patch_write(opaque, pos, buf, len);
+}
+
+/* The diff and extra bytes are made from ctrl as the sections are
+ * written, many chunks of them: between them they have all of new,
+ * and bsdiff takes far less heap than new for them */
+static int test_sizes(void)
+{
+	struct sufarray sa;
+	struct bsdiff_options opt;
+	struct bsdiff_stats st;
+	struct sufindex ix;
+	struct bsdiff_stream out = {NULL, patch_write_heap};
+	struct files f;
+	uint64_t seed = 1;
+	uint8_t *old, *new;
+	off_t oldsize = 3 << 20, newsize;
+	size_t base;
+	int ret, failed = 0;
+
+	old = sample(0, oldsize, &seed);
+	new = edit(old, oldsize, &newsize, &seed);
+	if (sufsort(&sa, old, oldsize, SUFSORT_SAIS, 1) != 0)
+		err(1, NULL);
+	defaults(&opt);
+	opt.stats = &st;
+	memset(&f, 0, sizeof(f));
+	f.old = old;
+	f.kill = -1;
+	out.opaque = &f.patch;
+	if (sufindex_init(&ix, &sa, old, oldsize) != 0)
+		err(1, NULL);
+	/* Grow the patch buffer first, so only bsdiff's heap is counted */
+	memwrite(&f.patch, 0, new, newsize / 8);
+	f.patch.size = 0;
+	base = heapmax = heap();
+	if (bsdiff(&ix, old, oldsize, new, newsize, &opt, &out) < 0)
+		err(1, "bsdiff");
+	sufindex_free(&ix);
+	failed |= (heapmax - base > (size_t)newsize / 4) || (f.patch.size > newsize / 8);
+	failed |= (st.raw[1] + st.raw[2] != newsize) || (st.raw[2] == 0);
+	ret = apply(&f, oldsize, 0, 0);
+	failed |= (ret != BSPATCH_OK) || (f.out.size != newsize) || (memcmp(f.out.buf, new, newsize) != 0);
+
+	files_free(&f);
+	sufarray_free(&sa);
+	free(old);
+	free(new);
+	return report("diff and extra stream in little heap", failed);
+}
+
+/* Callbacks of struct files that keep the most heap seen in use */
+static ssize_t read_patch_heap(void *opaque, off_t pos, void *buf, size_t len)
+{
+	heapmax = MAX(heapmax, heap());
+	return read_patch(opaque, pos, buf, len);
+}
+
+static int read_old_heap(void *opaque, off_t pos, void *buf, size_t len)
+{
+	heapmax = MAX(heapmax, heap());
+	return read_old(opaque, pos, buf, len);
+}
+
+static int write_new_heap(void *opaque, off_t pos, const void *buf, size_t len)
+{
+	heapmax = MAX(heapmax, heap());
+	return write_new(opaque, pos, buf, len);
+}
+
+/* bspatch() takes all its memory from the work buffer: it allocates
+ * nothing, works with bspatch_worksize() bytes and not with one less */
+static int test_noalloc(void)
+{
+	struct sufarray sa;
+	struct bsdiff_options opt;
+	struct bspatch_header h;
+	struct files f;
+	struct bspatch_stream s = {&f, read_patch_heap, read_old_heap, write_new_heap};
+	uint64_t seed = 1;
+	uint8_t *old, *new, *work;
+	off_t oldsize = 200000, newsize;
+	size_t worksize, base;
+	int i, failed = 0;
+
+	old = sample(5, oldsize, &seed);
+	new = edit(old, oldsize, &newsize, &seed);
+	if (sufsort(&sa, old, oldsize, SUFSORT_SAIS, 1) != 0)
+		err(1, NULL);
+	for (i = 0; i < 4; i++)
+	{
+		memset(&f, 0, sizeof(f));
+		f.old = old;
+		f.kill = -1;
+		defaults(&opt);
+		switch (i)
+		{
+		case 1:
+			opt.window = 32768;
+			opt.codec[0] = opt.codec[1] = opt.codec[2] = BSDIFF_LZR;
+			break;
+		case 2:
+			makepatch(old, oldsize, new, newsize, 65536, FILTER_NONE, &f.patch);
+			f.inplace = 1;
+			break;
+		case 3:
+			makepatch(old, oldsize, new, newsize, -1, FILTER_THUMB, &f.patch);
+			break;
+		};
+		if (i < 2)
+			diffwith(&sa, old, oldsize, new, newsize, &opt, &f.patch);
+		if (bspatch_header(&h, &s, f.patch.size) != BSPATCH_OK)
+			errx(1, "bspatch_header");
+		worksize = bspatch_worksize(&h, f.inplace, 0);
+		work = xmalloc(worksize);
+		failed |= (bspatch(&s, &h, oldsize, f.inplace, work, worksize - 1) != BSPATCH_ENOMEM);
+		/* Grow new to its size first, so only bspatch() is counted */
+		memwrite(&f.out, 0, new, newsize);
+		f.out.size = 0;
+		memwrite(&f.out, 0, old, oldsize);
+		f.out.size = f.inplace ? oldsize : 0;
+		base = heapmax = heap();
+		if ((bspatch(&s, &h, oldsize, f.inplace, work, worksize) != BSPATCH_OK) ||
+			(heapmax != base) || (f.out.size != newsize) ||
+			(memcmp(f.out.buf, new, newsize) != 0))
+		{
+			printf("noalloc: patch %d, heap %+lld\n", i, (long long)(heapmax - base));
+			failed = 1;
+		};
+		free(work);
+		files_free(&f);
+	};
+
+	sufarray_free(&sa);
+	free(old);
+	free(new);
+	return report("bspatch allocates nothing", failed);
+}
+
+/* In place, new larger than old and the power lost after newpos has
+ * passed the end of old. Resuming from the journal finishes it. */
+static int test_resume_grown(void)
+{
+	struct files f;
+	uint8_t *old, *new;
+	off_t oldsize = 20000, newsize = 31000, i;
+	uint64_t seed = 1;
+	int ret;
+
+	old = xmalloc(oldsize);
+	new = xmalloc(newsize);
+	for (i = 0; i < oldsize; i++)
+		old[i] = rnd(&seed) % 8;
+	memcpy(new, old, 5000);
+	for (i = 5000; i < 16000; i++)
+		new[i] = rnd(&seed) % 8;
+	memcpy(new + 16000, old + 5000, newsize - 16000);
+
+	memset(&f, 0, sizeof(f));
+	f.old = old;
+	f.inplace = 1;
+	makepatch(old, oldsize, new, newsize, 4096, FILTER_NONE, &f.patch);
+	memwrite(&f.out, 0, old, oldsize);
+
+	f.kill = oldsize + 3000;
+	ret = apply(&f, oldsize, 0, 1024);
+	f.kill = -1;
+	if ((ret != BSPATCH_EIO) || (f.journal.size == 0))
+		ret = -1;
+	else
+		ret = apply(&f, oldsize, 0, 1024);
+	if (ret != BSPATCH_OK)
+		printf("bspatch: %d\n", ret);
+
+	ret = (ret != BSPATCH_OK) | check("resume in place past old", &f, new, newsize);
+	free(old);
+	free(new);
+	files_free(&f);
+	return ret;
+}
+
+/* The Thumb filter with new not a whole number of blocks, and of odd
+ * size for its halfwords, applied with a large and the least work
+ * buffer, in place and resumed from the journal. The bytes are mostly
+ * the ones the filter looks for, and new is old with some moved. */
+static int test_filter(off_t oldsize, off_t newsize)
+{
+	static const uint8_t code[] = {0x00, 0xFF, 0xF0, 0xF8, 0x12, 0x34};
+	static const char *modes[] = {"", " least RAM", " in place", " resumed"};
+	struct files f;
+	uint8_t *old, *new;
+	uint64_t seed = 1;
+	char name[80];
+	off_t i;
+	int mode, ret, failed = 0;
+
+	old = xmalloc(oldsize + 1);
+	new = xmalloc(newsize + 1);
+	for (i = 0; i < oldsize; i++)
+		old[i] = code[rnd(&seed) % sizeof(code)];
+	for (i = 0; i < newsize; i++)
+		new[i] = ((i >= 300) && (i - 300 < oldsize) && (rnd(&seed) % 64 != 0)) ?
+					 old[i - 300] : code[rnd(&seed) % sizeof(code)];
+
+	for (mode = 0; mode < 4; mode++)
+	{
+		memset(&f, 0, sizeof(f));
+		f.old = old;
+		f.inplace = (mode == 2);
+		f.kill = -1;
+		makepatch(old, oldsize, new, newsize, f.inplace ? 4096 : -1, FILTER_THUMB, &f.patch);
+		if (f.inplace)
+			memwrite(&f.out, 0, old, oldsize);
+
+		if (mode == 3)
+		{
+			f.kill = newsize / 2;
+			ret = apply(&f, oldsize, 0, 64);
+			f.kill = -1;
+			if (ret == BSPATCH_EIO)
+				ret = apply(&f, oldsize, 0, 64);
+		}
+		else
+			ret = apply(&f, oldsize, (mode == 0) ? 1 << 20 : 0, 0);
+
+		snprintf(name, sizeof(name), "thumb %lld from %lld%s", (long long)newsize, (long long)oldsize,
+				 modes[mode]);
+		if (ret != BSPATCH_OK)
+			printf("bspatch: %d\n", ret);
+		failed |= (ret != BSPATCH_OK) | check(name, &f, new, newsize);
+		files_free(&f);
+	};
+
+	free(old);
+	free(new);
+	return failed;
+}
+
+int main(void)
+{
+	/* old and new sizes for test_filter() */
+	static const off_t sizes[][2] = {{0, 1}, {0, 3057}, {5000, 3}, {5000, 1025}, {5000, 3057}, {3000, 4097}};
+	size_t i;
+	int failed = 0;
+
+	failed |= test_crc();
+	failed |= test_sort("sais sorts like qsufsort", SUFSORT_SAIS, 1);
+	failed |= test_sort("parallel sort on 1 thread", SUFSORT_PARALLEL, 1);
+	failed |= test_sort("parallel sort on 3 threads", SUFSORT_PARALLEL, 3);
+	failed |= test_sort("parallel sort on 8 threads", SUFSORT_PARALLEL, 8);
+	failed |= test_packed();
+	failed |= test_disorder();
+	failed |= test_eqmask();
+	failed |= test_search();
+	failed |= test_threads();
+	failed |= test_stream();
+	failed |= test_window();
+	failed |= test_readonce();
+	failed |= test_sections();
+	failed |= test_inplace();
+	failed |= test_sizes();
+	failed |= test_noalloc();
+	failed |= test_damaged();
+	failed |= test_varint();
+	failed |= test_chunks();
+	failed |= test_codecs();
+	failed |= test_optimal();
+	failed |= test_resume_grown();
+	for (i = 0; i < sizeof(sizes) / sizeof(*sizes); i++)
+		failed |= test_filter(sizes[i][0], sizes[i][1]);
+
+	return failed;
+}
@@ -0,0 +1,120 @@
+#!/bin/sh
+# Checks of the bsdiff and bspatch programs, on the sources here and
+# changed copies of them. Exits with 1 if any fails.
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+report()
+{
+	if [ "$2" -eq 0 ]; then
+		echo "ok   $1"
+	else
+		echo "FAIL $1"
+		failed=1
+	fi
+}
+
+old=$dir/old
+cat bsdiff.c sufsort.c > "$old"
+sed 's/off_t/ssize_t/g' bsdiff.c > "$dir/n1"
+cat sufsort.c bsdiff.c > "$dir/n2"
+
+# A cache miss sorts and saves the array, the next run loads it and
+# writes the same patch. A changed old file or a damaged cache file
+# is sorted again.
+mkdir "$dir/cache"
+./bsdiff -C "$dir/cache" --stats "$dir/s1" "$old" "$dir/n1" "$dir/p1" &&
+	grep -q '"cached": false' "$dir/s1" &&
+	./bsdiff -C "$dir/cache" --stats "$dir/s2" "$old" "$dir/n1" "$dir/p2" &&
+	grep -q '"algorithm": "cache"' "$dir/s2" &&
+	cmp -s "$dir/p1" "$dir/p2"
+report "cache hit after a miss" $?
+
+cp "$old" "$dir/old2"
+echo changed >> "$dir/old2"
+./bsdiff -C "$dir/cache" --stats "$dir/s3" "$dir/old2" "$dir/n1" "$dir/p3" &&
+	grep -q '"cached": false' "$dir/s3" &&
+	[ "$(ls "$dir/cache" | wc -l)" -eq 2 ]
+report "cache miss for a changed old file" $?
+
+for f in "$dir"/cache/*.sa; do
+	printf '\377\377\377\177' | dd of="$f" bs=1 seek=100 conv=notrunc 2>/dev/null
+done
+./bsdiff -C "$dir/cache" --stats "$dir/s4" "$old" "$dir/n1" "$dir/p4" &&
+	grep -q '"cached": false' "$dir/s4" &&
+	cmp -s "$dir/p1" "$dir/p4"
+report "damaged cache file sorted again" $?
+
+# --stats reports each file of a batch, with the sizes of the files
+# written and diff and extra adding up to new
+num()
+{
+	grep -o "\"$1\": [0-9]*" "$2" | sed 's/.*: //'
+}
+raw()
+{
+	grep -o "\"$1\": {\"codec\": \"[a-z]*\", \"raw\": [0-9]*" "$2" | sed 's/.*: //'
+}
+cp bspatch.c "$dir/n3"
+./bsdiff --stats "$dir/s5" "$old" "$dir/n1" "$dir/p1" "$dir/n3" "$dir/p3"
+ret=$?
+for key in old oldsize algorithm cached total load sort index peak_rss_kb files new patch \
+	newsize patchsize scan searches probes_per_search triples ctrl diff extra compressed time; do
+	[ $ret -eq 0 ] && grep -q "\"$key\": " "$dir/s5"
+	ret=$?
+done
+[ $ret -eq 0 ] &&
+	[ "$(num newsize "$dir/s5")" = "$(wc -c < "$dir/n1")
+$(wc -c < "$dir/n3")" ] &&
+	[ "$(num patchsize "$dir/s5")" = "$(wc -c < "$dir/p1")
+$(wc -c < "$dir/p3")" ] &&
+	[ "$(raw diff "$dir/s5" | head -1)" -gt 0 ] &&
+	[ $(($(raw diff "$dir/s5" | head -1) + $(raw extra "$dir/s5" | head -1))) -eq "$(wc -c < "$dir/n1")" ] &&
+	[ $(($(raw diff "$dir/s5" | tail -1) + $(raw extra "$dir/s5" | tail -1))) -eq "$(wc -c < "$dir/n3")" ] &&
+	[ "$(num compressed "$dir/s5" | awk '{ s += $1 } END { print s }')" -lt \
+		"$(cat "$dir/p1" "$dir/p3" | wc -c)" ] &&
+	[ "$(num triples "$dir/s5" | head -1)" -gt 0 ] && [ "$(num searches "$dir/s5" | head -1)" -gt 0 ]
+report "stats of a batch add up to its files" $?
+
+# Each patch of a batch is the one a run on its own writes, however
+# the threads are shared out among the files, and applies
+for opts in "" "-j 4 -S 1000" "-j 2 -O -z lzr" "-i 4096 -w 4096" "-P 8192 -f thumb"; do
+	./bsdiff $opts "$old" "$dir/n1" "$dir/p1" "$dir/n2" "$dir/p2" "$dir/n3" "$dir/p3"
+	ret=$?
+	for k in 1 2 3; do
+		[ $ret -eq 0 ] &&
+			./bsdiff $opts "$old" "$dir/n$k" "$dir/q$k" &&
+			cmp -s "$dir/p$k" "$dir/q$k" &&
+			./bspatch "$old" "$dir/out" "$dir/p$k" &&
+			cmp -s "$dir/n$k" "$dir/out"
+		ret=$?
+	done
+	report "batch writes single run patches: ${opts:-defaults}" $ret
+done
+
+# Inputs are mapped, but empty ones are read. Files of whole pages end
+# where the mapping does, so nothing may be read past them.
+cat bsdiff.c bspatch.c sufsort.c > "$dir/src"
+sed 's/int/long/g' "$dir/src" > "$dir/src2"
+ret=0
+for n in 0 4096 65536; do
+	for m in 0 4096 65536; do
+		head -c $n "$dir/src" > "$dir/o"
+		head -c $m "$dir/src2" > "$dir/n"
+		./bsdiff "$dir/o" "$dir/n" "$dir/p" &&
+			./bspatch "$dir/o" "$dir/out" "$dir/p" &&
+			cmp -s "$dir/n" "$dir/out" || ret=1
+	done
+done
+report "empty and page sized files" $ret
+
+# The bench corpora are the same on every run, so are the patches of
+# them, and each patch applies in every RAM budget the bench sets
+./bsbench > "$dir/b1" && ./bsbench > "$dir/b2" &&
+	[ "$(wc -l < "$dir/b1")" -eq 28 ] &&
+	[ "$(cut -d, -f1-6 "$dir/b1")" = "$(cut -d, -f1-6 "$dir/b2")" ]
+report "bench corpora and patches are the same every run" $?
+
+exit $failed